@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <compression/deflate.c>
+#include <compression/gzip.c>
+#include <compression/zlib.c>
+
+// NOTE: a raw deflate stream with a fixed Huffman block (sync flushed, so
+// followed by an empty stored block), and then a dynamic Huffman block
+byte fixedThenDynamic[] = {
+    0x4a, 0xcb, 0xac, 0x48, 0x4d, 0x51, 0x48, 0x43, 0x22, 0x93, 0x72, 0xf2,
+    0x93, 0xb3, 0x51, 0x44, 0x88, 0x11, 0x07, 0x00, 0x00, 0x00, 0xff, 0xff,
+    0xb5, 0xcc, 0x55, 0x16, 0x82, 0x50, 0x14, 0x40, 0xd1, 0xa9, 0x5c, 0xbb,
+    0xbb, 0xbb, 0xbb, 0x15, 0x3b, 0x49, 0x41, 0x1f, 0x3c, 0x05, 0x11, 0xb1,
+    0xc6, 0xae, 0x83, 0xd0, 0xef, 0xb3, 0xce, 0x26, 0x78, 0x16, 0xce, 0xaa,
+    0x40, 0x1f, 0x81, 0x92, 0xb1, 0x26, 0x01, 0x87, 0x6f, 0x70, 0x50, 0xc5,
+    0x93, 0x02, 0xf8, 0xca, 0xca, 0x70, 0xf9, 0x66, 0x44, 0xde, 0x75, 0x60,
+    0xf0, 0x1e, 0x34, 0x5e, 0x40, 0x2c, 0x90, 0xc0, 0xe8, 0x12, 0x29, 0x0a,
+    0x34, 0x50, 0x08, 0x7f, 0x3f, 0x0e, 0x23, 0x84, 0x35, 0xc5, 0x0b, 0xc4,
+    0xef, 0x28, 0x30, 0x18, 0x4d, 0x66, 0x8b, 0xd5, 0x66, 0x77, 0x38, 0x5d,
+    0x6e, 0x8f, 0xd7, 0xe7, 0x0f, 0x04, 0x43, 0xe1, 0x48, 0x34, 0x16, 0x4f,
+    0x24, 0x53, 0xe9, 0x4c, 0x36, 0x97, 0x2f, 0x14, 0x4b, 0xe5, 0x4a, 0xb5,
+    0x56, 0x6f, 0x34, 0x5b, 0xed, 0x4e, 0xb7, 0xd7, 0x1f, 0x0c, 0x47, 0xc4,
+    0x78, 0x32, 0x9d, 0xcd, 0x17, 0xcb, 0xd5, 0x7a, 0xb3, 0xdd, 0x91, 0x14,
+    0xcd, 0xb0, 0xdc, 0x9e, 0x17, 0x0e, 0x47, 0x24, 0x4a, 0xf8, 0x74, 0x96,
+    0x95, 0x8b, 0x7a, 0xd5, 0x6e, 0xfa, 0xfd, 0xf1, 0x7c, 0xbd, 0xff, 0xcc,
+    0x7f, 0x00,
+};
+
+Mem fixedThenDynamicContent(void) {
+    StringBuilder sb = mkStringBuilder();
+    for(int i = 0; i < 3; i++) sb_appendMem(&sb, mkString("fixed fixed fixed block "));
+    for(int i = 0; i < 2; i++) sb_appendMem(&sb, mkString("The quick brown fox jumps over the lazy dog while a dynamic block follows. "));
+    for(int i = 0; i < 2; i++) {
+        for(byte c = 32; c < 127; c++) sb_appendChar(&sb, c);
+    }
+    return sb_build(sb);
+}
+
+bool testDecompressMem(Mem raw, Mem expected) {
+    DeflateDeCompResult result = Deflate_decompressMem(raw, ALLOC);
+    return isJust(result) && mem_eq(result.mem, expected) && result.consumed == raw.len;
+}
+
+// NOTE: feeds the decoder piece bytes at a time, piece == 0 - all at once
+bool testDecoder(Mem raw, Mem expected, usz piece) {
+    DeflateDecoder *decoder = (DeflateDecoder *)AllocateBytes(sizeof(DeflateDecoder)).s;
+    Deflate_decoderInit(decoder);
+
+    Mem out = AllocateBytes(expected.len + 1);
+    usz produced = 0;
+    usz consumed = 0;
+    bool done = false;
+    while(!done) {
+        usz len = raw.len - consumed;
+        if(piece != 0 && len > piece) len = piece;
+
+        DeflateDecodeResult result = Deflate_decoderDecode(decoder, mkMem(raw.s + consumed, len), memIndex(out, produced));
+        if(isNone(result)) return false;
+        if(result.consumed == 0 && result.produced == 0 && !result.done) return false;
+
+        consumed += result.consumed;
+        produced += result.produced;
+        done = result.done;
+    }
+
+    return mem_eq(mkMem(out.s, produced), expected);
+}
+
+// NOTE: text that compresses about as well as a web page would
+Mem parallelContent(usz len) {
+    char *words[] = { "<div ", "class=", "\"item\">", "the ", "quick ", "brown ", "fox ", "</div>\n", "jumps ", "lazy " };
+    StringBuilder sb = mkStringBuilder();
+    u32 state = 1;
+    while(sb.len < len) {
+        state = state * 1103515245 + 12345;
+        sb_appendMem(&sb, mkString(words[(state >> 16) % 10]));
+        if((state >> 8) % 7 == 0) sb_appendChar(&sb, 'a' + (state >> 20) % 26);
+    }
+    return memLimit(sb_build(sb), len);
+}
+
+// NOTE: the chunks end with sync flushes, so if they were compressed in
+// parallel, the output differs from a single threaded one
+bool testParallel(Mem raw, bool gzip) {
+    Mem single = gzip ? Gzip_compressParallel(raw, 9, 1, ALLOC) : Zlib_compressParallel(raw, 9, 1, ALLOC);
+    Mem parallel = gzip ? Gzip_compressParallel(raw, 9, 4, ALLOC) : Zlib_compressParallel(raw, 9, 4, ALLOC);
+    if(isNull(single) || isNull(parallel) || mem_eq(single, parallel)) return false;
+
+    Mem result = gzip ? Gzip_decompress(parallel, ALLOC) : Zlib_decompress(parallel, ALLOC);
+    return mem_eq(result, raw);
+}
+
+int main() {
+    Mem raw = mkMem(fixedThenDynamic, sizeof(fixedThenDynamic));
+    Mem expected = fixedThenDynamicContent();
+
+    int failed = 0;
+#define Test(name, expr) if(!(expr)) { printf("FAILED: %s\n", name); failed += 1; }
+    Test("fixed then dynamic, decompressMem", testDecompressMem(raw, expected));
+    Test("fixed then dynamic, decoder", testDecoder(raw, expected, 0));
+    Test("fixed then dynamic, decoder byte by byte", testDecoder(raw, expected, 1));
+    // NOTE: decoding the dynamic block must not have touched the shared fixed tables
+    Test("fixed then dynamic, decoder again", testDecoder(raw, expected, 0));
+    Test("fixed then dynamic, decompressMem again", testDecompressMem(raw, expected));
+
+    // NOTE: FileStorage only compresses the files it caches, which are
+    // smaller than its sendfileThreshold, 1 MiB by default
+    Mem cached = parallelContent(640 << 10);
+    Test("cached file, gzip in parallel", testParallel(cached, true));
+    Test("cached file, zlib in parallel", testParallel(cached, false));
+#undef Test
+
+    if(failed == 0) printf("All tests passed\n");
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1 @@
+mkdir -p ./../bin && gcc --std=gnu99 ./test.c -o ./../bin/compression-test -I../lib -ggdb -Wall -Wextra && ./../bin/compression-test
@@ -0,0 +1,195 @@
+#ifndef __LIB_COIL_CACHE
+#define __LIB_COIL_CACHE
+
+#include <time.h>
+#include <pthread.h>
+
+#include <stream.h>
+#include <compression/gzip.c>
+#include <compression/zlib.c>
+#include <crypto/sha.c>
+
+#include <map.h>
+#include <hashmap.h>
+#include <lru.h>
+
+typedef struct ResponseCacheEntry ResponseCacheEntry;
+
+// NOTE: one representation of a dynamic response, with the content
+// already in its final encoding (null if identity)
+typedef struct {
+    bool error;
+
+    Mem content;
+    HttpMediaType mediaType;
+    String encoding;
+
+    // NOTE: of the identity content, so that every encoding of
+    // the same content gets the same ETag, modulo the suffix
+    Hash256 hash;
+    time_t created;
+    time_t expires;
+
+    // NOTE: set if the response came from a ResponseCache, in which
+    // case it stays valid until releaseCachedResponse is called on it
+    ResponseCacheEntry *entry;
+} CachedResponse;
+
+typedef struct {
+    // NOTE: in seconds. Past this, the response is produced again
+    time_t ttl;
+
+    // NOTE: a miss is compressed while the client waits, so
+    // this isn't the slowest level, unlike in FileStorage
+    u8 compressionLevel;
+
+    LruCache lru;
+} ResponseCache;
+
+// NOTE: each CachedResponse handed out by the cache holds a reference
+struct ResponseCacheEntry {
+    LruEntry lru;
+    CachedResponse response;
+};
+
+// NOTE: HEAD gets the same representation as GET, so they share entries.
+// The encoding can't contain a space, so the key is unambiguous
+String responseCacheKey(HttpMethod method, UriPath path, String query, String encoding, Alloc *alloc) {
+    if(method == HTTP_HEAD) method = HTTP_GET;
+
+    StringBuilder sb = mkStringBuilder();
+    sb.alloc = alloc;
+    sb_appendByte(&sb, (byte)method);
+    sb_appendMem(&sb, encoding);
+    sb_appendChar(&sb, ' ');
+    dynar_foreach(String, &path.segments) {
+        sb_appendChar(&sb, '/');
+        sb_appendMem(&sb, loop.it);
+    }
+    sb_appendChar(&sb, '?');
+    sb_appendMem(&sb, query);
+
+    return sb_build(sb);
+}
+
+// NOTE: compresses data with the given encoding, keeping it as is if
+// that doesn't make it any smaller. Media type parameters aren't kept
+CachedResponse mkCachedResponse(Mem data, HttpMediaType mediaType, String encoding, u8 level, time_t ttl, Alloc *alloc) {
+    CachedResponse response = {
+        .mediaType = {
+            .type = mem_clone(mediaType.type, alloc),
+            .subtype = mem_clone(mediaType.subtype, alloc),
+        },
+        .hash = Sha256(data),
+        .created = time(null),
+    };
+    response.expires = response.created + ttl;
+
+    Mem compressed = memnull;
+    if(mem_eq(encoding, mkString("gzip"))) compressed = Gzip_compressM(data, level, alloc);
+    else if(mem_eq(encoding, mkString("deflate"))) compressed = Zlib_compressM(data, level, alloc);
+
+    if(!isNull(compressed) && compressed.len < data.len) {
+        response.content = compressed;
+        response.encoding = encoding;
+    }
+    else {
+        FreeC(alloc, compressed.s);
+        response.content = mem_clone(data, alloc);
+    }
+
+    if(isNull(response.content) && data.len != 0) return none(CachedResponse);
+    return response;
+}
+
+usz cachedResponseCost(CachedResponse *response) {
+    return response->content.len + response->mediaType.type.len + response->mediaType.subtype.len;
+}
+
+void freeCachedResponse(CachedResponse *response, Alloc *alloc) {
+    FreeC(alloc, response->content.s);
+    FreeC(alloc, response->mediaType.type.s);
+    FreeC(alloc, response->mediaType.subtype.s);
+}
+
+void freeResponseCacheEntry(LruEntry *lru) {
+    ResponseCacheEntry *entry = (ResponseCacheEntry *)lru;
+    Alloc *alloc = lru->cache->alloc;
+    freeCachedResponse(&entry->response, alloc);
+    FreeC(alloc, entry);
+}
+
+void releaseCachedResponse(CachedResponse response) {
+    if(response.entry != null) lru_unref(&response.entry->lru);
+}
+
+#define getResponseCacheStats(cache) lru_stats(&(cache)->lru)
+
+// NOTE: responses from the cache have to be given back with
+// releaseCachedResponse. Expired ones are taken out of the cache
+CachedResponse getCachedResponse(ResponseCache *cache, String key) {
+    Map *map = hm_getMap(&cache->lru.hm, key);
+    time_t now = time(null);
+
+    CachedResponse response = none(CachedResponse);
+    ResponseCacheEntry *expired = null;
+    map_block(map) {
+        ResponseCacheEntry *entry = (ResponseCacheEntry *)lru_find(map, key);
+        if(entry == null) continue;
+
+        if(now >= entry->response.expires) {
+            if(lru_expire(&cache->lru, map, &entry->lru)) expired = entry;
+        }
+        else if(lru_hit(&cache->lru, &entry->lru)) {
+            response = entry->response;
+        }
+    }
+
+    if(expired != null) lru_unref(&expired->lru);
+    return response;
+}
+
+// NOTE: builds the response from data and caches it under key, replacing
+// whatever was there. If two requests miss at once, both produce the
+// response, and the one that finishes last stays
+CachedResponse putCachedResponse(ResponseCache *cache, String key, Mem data, HttpMediaType mediaType, String encoding) {
+    Alloc *alloc = cache->lru.alloc;
+    CachedResponse response = mkCachedResponse(data, mediaType, encoding, cache->compressionLevel, cache->ttl, alloc);
+    if(isNone(response)) return response;
+
+    ResponseCacheEntry _newEntry = {
+        .lru = mkLruEntry(&cache->lru, key, cachedResponseCost(&response) + key.len),
+        .response = response,
+    };
+    AllocateVarC(ResponseCacheEntry, newEntry, _newEntry, alloc);
+    if(newEntry == null) {
+        freeCachedResponse(&response, alloc);
+        FreeC(alloc, _newEntry.lru.key.s);
+        return none(CachedResponse);
+    }
+    newEntry->response.entry = newEntry;
+    response = newEntry->response;
+
+    LruEntry *replaced = null;
+    Map *map = hm_getMap(&cache->lru.hm, key);
+    map_block(map) {
+        replaced = lru_insert(&cache->lru, map, &newEntry->lru);
+    }
+
+    if(replaced != null) lru_unref(replaced);
+    lru_evict(&cache->lru);
+
+    return response;
+}
+
+ResponseCache mkResponseCache(Alloc *alloc) {
+    ResponseCache cache = {
+        .ttl = 60,
+        .compressionLevel = DEFLATE_LEVEL_DEFAULT,
+        .lru = mkLruCache(alloc, 16 << 20, freeResponseCacheEntry),
+    };
+
+    return cache;
+}
+
+#endif // __LIB_COIL_CACHE
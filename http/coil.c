@@ -3,6 +3,8 @@
 
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <pthread.h>
@@ -11,13 +13,21 @@
 #include "http.c"
 
 #include "file.c"
+#include "cache.c"
 #include "router.c"
 #include "logging.c"
+#include "pool.c"
 
 #ifndef CONTENT_LIMIT
 #define CONTENT_LIMIT 100000000
 #endif
 
+// NOTE: dynamic content is compressed on every response, so
+// it's better to be fast than to be small
+#ifndef COIL_COMPRESSION_LEVEL
+#define COIL_COMPRESSION_LEVEL DEFLATE_LEVEL_FASTEST
+#endif
+
 #define Coil_GetPathMatch(c, s) Coil_GetPathMatchL((c), mkString(s))
 String Coil_GetPathMatchL(RouteContext *context, String segment) {
     return map_get(context->matches, segment);
@@ -30,21 +40,45 @@ bool Coil_AddDate(RouteContext *context) {
     return true;
 }
 
-bool Coil_AddETag(RouteContext *context, Mem data, bool isWeak) {
+// NOTE: different encodings of the same content need different
+// ETags, so the suffix is the encoding, if any
+#define Coil_AddETag(c, d, w) Coil_AddETagS((c), (d), (w), memnull)
+HttpEntityTag Coil_MakeETag(Mem data, bool isWeak, String suffix) {
+    StringBuilder sb = mkStringBuilder();
+    Stream out = mkStreamSb(&sb);
+    Stream s = mkStreamStr(data);
+    checkRetVal(writeBytesToBase64(&s, &out, false, false), none(HttpEntityTag));
+    if(!isNull(suffix)) {
+        checkRetVal(stream_writeChar(&out, '-'), none(HttpEntityTag));
+        tryRetVal(stream_write(&out, suffix), none(HttpEntityTag));
+    }
+
+    return (HttpEntityTag){
+        .isWeak = isWeak,
+        .value = sb_build(sb),
+    };
+}
+
+bool Coil_AddEntityTag(RouteContext *context, HttpEntityTag etag) {
     tryRet(stream_write(context->s, mkString("ETag: ")));
-    if(isWeak) {
+    if(etag.isWeak) {
         checkRet(stream_writeChar(context->s, 'W'));
         checkRet(stream_writeChar(context->s, '/'));
     }
 
     checkRet(stream_writeChar(context->s, '\"'));
-    Stream s = mkStreamStr(data);
-    checkRet(writeBytesToBase64(&s, context->s, false, false));
+    tryRet(stream_write(context->s, etag.value));
     checkRet(stream_writeChar(context->s, '\"'));
     checkRet(Http_writeCRLF(context->s));
     return true;
 }
 
+bool Coil_AddETagS(RouteContext *context, Mem data, bool isWeak, String suffix) {
+    HttpEntityTag etag = Coil_MakeETag(data, isWeak, suffix);
+    if(isNone(etag)) return false;
+    return Coil_AddEntityTag(context, etag);
+}
+
 bool Coil_AddLastModified(RouteContext *context, time_t lastModified) {
     tryRet(stream_write(context->s, mkString("Last-Modified: ")));
     checkRet(Http_writeDate(context->s, lastModified));
@@ -78,16 +112,19 @@ bool Coil_AddContentLength(RouteContext *context, u64 length) {
     return true;
 }
 
+// NOTE: contexts that don't persist are those whose connection gets
+// closed right after the response, including refusals and bad requests
 bool Coil_AddAllNecessaryHeaders(RouteContext *context) {
     checkRet(Coil_AddDate(context));
-    checkRet(Coil_AddHeader(context, mkString("Connection"), mkString("keep-alive")));
+    String connection = context->persist ? mkString("keep-alive") : mkString("close");
+    checkRet(Coil_AddHeader(context, mkString("Connection"), connection));
     return true;
 }
 
 bool Coil_AddContent(RouteContext *context, Mem content) {
     checkRet(Coil_AddContentLength(context, content.len));
     checkRet(Coil_SealHeaders(context));
-    if(context->method != HEAD) {
+    if(context->method != HTTP_HEAD) {
         tryRet(stream_write(context->s, content));
     }
     return true;
@@ -98,27 +135,136 @@ bool Coil_NoContent(RouteContext *context) {
     return true;
 }
 
-bool Coil_AddContentType(RouteContext *context, HttpMediaType mediaType) {
-    tryRet(stream_write(context->s, mkString("Content-Type: ")));
-    checkRet(Http_writeMediaType(context->s, mediaType));
+bool Coil_WriteContentType(Stream *s, HttpMediaType mediaType) {
+    tryRet(stream_write(s, mkString("Content-Type: ")));
+    checkRet(Http_writeMediaType(s, mediaType));
 
     // TODO: make this less bad
-    tryRet(stream_write(context->s, mkString(";charset=utf-8")));
+    tryRet(stream_write(s, mkString(";charset=utf-8")));
 
-    checkRet(Http_writeCRLF(context->s));
+    checkRet(Http_writeCRLF(s));
+    return true;
+}
+
+bool Coil_AddContentType(RouteContext *context, HttpMediaType mediaType) {
+    return Coil_WriteContentType(context->s, mediaType);
+}
+
+// NOTE: the body is sent with sendfile() where the stream allows it
+bool Coil_AddContentFile(RouteContext *context, String path, usz size) {
+    int fd = open(fixchar path.s, O_RDONLY);
+    if(fd == -1) return false;
+
+    bool result = Coil_AddContentLength(context, size) && Coil_SealHeaders(context);
+    if(result && context->method != HTTP_HEAD) {
+        ResultWrite written = stream_sendfile(context->s, fd, 0, size);
+        result = !written.error && !written.partial;
+    }
+
+    close(fd);
+    return result;
+}
+
+typedef struct {
+    Mem content;
+    String encoding;
+    bool hasVariants;
+
+    bool hasETag;
+    HttpEntityTag etag;
+} CoilFileVariant;
+
+// NOTE: picks the encoding the client prefers according to Accept-Encoding,
+// out of the available ones, or identity (null). On equal q-values,
+// compressed encodings win over identity, and gzip wins over deflate
+String Coil_NegotiateEncoding(RouteContext *context, bool hasGzip, bool hasDeflate) {
+    HttpH_AcceptEncoding *accept = null;
+    if(map_has(context->headers, mkString("accept-encoding"))) {
+        accept = memExtractPtr(HttpH_AcceptEncoding, map_get(context->headers, mkString("accept-encoding")));
+    }
+
+    String encoding = memnull;
+    f32 best = Http_matchEncoding(accept, mkString("identity"));
+
+    f32 q = Http_matchEncoding(accept, mkString("gzip"));
+    if(hasGzip && q > 0 && q >= best) {
+        encoding = mkString("gzip");
+        best = q;
+    }
+
+    q = Http_matchEncoding(accept, mkString("deflate"));
+    if(hasDeflate && q > 0 && (q > best || (q == best && isNull(encoding)))) {
+        encoding = mkString("deflate");
+        best = q;
+    }
+
+    return encoding;
+}
+
+// NOTE: picks the precompressed variant of the file that the client
+// prefers according to Accept-Encoding, or identity
+CoilFileVariant Coil_GetFileVariant(RouteContext *context, File *file) {
+    CoilFileVariant variant = {
+        .content = file->data,
+        .hasVariants = !isNull(file->gzip) || !isNull(file->zlib),
+    };
+
+    if(variant.hasVariants) {
+        variant.encoding = Coil_NegotiateEncoding(context,
+            !isNull(file->gzip) && file->gzip.len < file->data.len,
+            !isNull(file->zlib) && file->zlib.len < file->data.len);
+
+        if(mem_eq(variant.encoding, mkString("gzip"))) variant.content = file->gzip;
+        else if(mem_eq(variant.encoding, mkString("deflate"))) variant.content = file->zlib;
+    }
+
+    if(file->hasHash) {
+        variant.etag = Coil_MakeETag(mkMem(file->hash.data, 256 / 8), false, variant.encoding);
+        variant.hasETag = isJust(variant.etag);
+    }
+    else if(!isNull(file->path)) {
+        // NOTE: hashing would mean reading the whole file
+        u64 validator[2] = { file->size, (u64)file->modTime };
+        variant.etag = Coil_MakeETag(mkMem(validator, sizeof(validator)), true, memnull);
+        variant.hasETag = isJust(variant.etag);
+    }
+
+    return variant;
+}
+
+// NOTE: the headers describing the selected representation, which
+// are sent with both 200 and 304
+bool Coil_AddFileValidators(RouteContext *context, File *file, CoilFileVariant *variant) {
+    if(variant->hasVariants) {
+        checkRet(Coil_AddHeader(context, mkString("Vary"), mkString("Accept-Encoding")));
+    }
+    if(variant->hasETag) {
+        checkRet(Coil_AddEntityTag(context, variant->etag));
+    }
+    checkRet(Coil_AddLastModified(context, file->modTime));
     return true;
 }
 
 bool Coil_AddFile(RouteContext *context, File file) {
+    CoilFileVariant variant = Coil_GetFileVariant(context, &file);
+
     checkRet(Coil_AddContentType(context, file.mediaType));
-    if(file.hasHash) {
-        checkRet(Coil_AddETag(context, mkMem(file.hash.data, 256 / 8), false));
+    if(!isNull(variant.encoding)) {
+        checkRet(Coil_AddHeader(context, mkString("Content-Encoding"), variant.encoding));
+    }
+    checkRet(Coil_AddFileValidators(context, &file, &variant));
+    checkRet(Coil_AddHeader(context, mkString("Accept-Ranges"), mkString("bytes")));
+
+    if(isNull(file.data) && !isNull(file.path)) {
+        checkRet(Coil_AddContentFile(context, file.path, file.size));
+    }
+    else {
+        checkRet(Coil_AddContent(context, variant.content));
     }
-    checkRet(Coil_AddLastModified(context, file.modTime));
-    checkRet(Coil_AddContent(context, file.data));
     return true;
 }
 
+
 bool Coil_AddTransferEncoding(RouteContext *context, Dynar(HttpTransferCoding) *codings) {
     tryRet(stream_write(context->s, mkString("Transfer-Encoding: ")));
     dynar_foreach(HttpTransferCoding, codings) {
@@ -132,24 +278,80 @@ bool Coil_AddTransferEncoding(RouteContext *context, Dynar(HttpTransferCoding) *
     return true;
 }
 
-// NOTE: this would've been much cooler if we had lazy streams
-// (i.e. we could make a nested stream that applies all
-// codings, and then lazily request 1024 at a time from it)
+bool Coil_WriteChunk(RouteContext *context, Mem mem) {
+    u64 elen = Sha_endian64(mem.len);
+    Stream elens = mkStreamStr(mkMem(&elen, 8));
+    checkRet(writeBytesToHex(&elens, context->s, false, false));
+    // here we would've put chunk extensions if we were sadists
+    checkRet(Http_writeCRLF(context->s));
+    tryRet(stream_write(context->s, mem));
+    checkRet(Http_writeCRLF(context->s));
+    return true;
+}
+
+// NOTE: a gzip or deflate transfer coding, applied as the content is read.
+// Whatever it has produced so far is collected in sb
+typedef struct {
+    bool isGzip;
+    GzipEncoder gzip;
+    ZlibEncoder zlib;
+
+    StringBuilder sb;
+    Stream out;
+} CoilTransferEncoder;
+
+bool Coil_TransferEncoderInit(CoilTransferEncoder *encoder, String coding) {
+    encoder->sb = mkStringBuilder();
+    encoder->out = mkStreamSb(&encoder->sb);
+    encoder->isGzip = mem_eq(coding, mkString("gzip"));
+
+    if(encoder->isGzip) return Gzip_encoderInit(&encoder->gzip, &encoder->out, COIL_COMPRESSION_LEVEL, ALLOC);
+    else return Zlib_encoderInit(&encoder->zlib, &encoder->out, COIL_COMPRESSION_LEVEL, ALLOC);
+}
+
+void Coil_TransferEncoderDeinit(CoilTransferEncoder *encoder) {
+    if(encoder->isGzip) Gzip_encoderDeinit(&encoder->gzip);
+    else Zlib_encoderDeinit(&encoder->zlib);
+    if(encoder->sb.s.s != null) Free(encoder->sb.s.s);
+}
+
+// NOTE: passes mem through every encoder in turn, and sends what comes
+// out of the last one as a chunk. Encoders only produce output once they
+// have a whole block, so most calls don't send anything
+bool Coil_WriteEncodedChunk(RouteContext *context, CoilTransferEncoder *encoders, usz count, Mem mem, bool finish) {
+    for(usz i = 0; i < count; i++) {
+        CoilTransferEncoder *encoder = &encoders[i];
+        bool result = encoder->isGzip
+            ? Gzip_encoderPush(&encoder->gzip, mem) && (!finish || Gzip_encoderFinish(&encoder->gzip))
+            : Zlib_encoderPush(&encoder->zlib, mem) && (!finish || Zlib_encoderFinish(&encoder->zlib));
+        if(!result) return false;
+
+        mem = mkMem(encoder->sb.s.s, encoder->sb.len);
+    }
+
+    if(mem.len != 0) checkRet(Coil_WriteChunk(context, mem));
+
+    for(usz i = 0; i < count; i++) {
+        encoders[i].sb.len = 0;
+    }
+    return true;
+}
+
+// NOTE: the content is read, coded and sent a piece at a time, so
+// only a few blocks of it are ever in memory, however long it is
 
 // NOTE: also Firefox doesn't support any TE except for chunked,
 // so I won't be able to test this lol
 bool Coil_AddContentStream(RouteContext *context, Stream *s, Dynar(HttpTransferCoding) *codings) {
     if(context->clientVersion.value < Http_getVersion(1, 1)) {
         checkRet(Coil_SealHeaders(context));
-        if(context->method != HEAD) {
+        if(context->method != HTTP_HEAD) {
             checkRet(stream_dumpInto(s, context->s, 0, true));
             context->persist = false;
         }
         return true;
     }
 
-    Stream _s;
-
     dynar_foreach(HttpTransferCoding, codings) {
         if(
         // NOTE: chunked should never appear here
@@ -165,6 +367,8 @@ bool Coil_AddContentStream(RouteContext *context, Stream *s, Dynar(HttpTransferC
         }
     }
 
+    usz encoderCount = codings->len;
+
     bool result;
     dynar_append(codings, HttpTransferCoding, mkHttpTransferCoding("chunked"), result);
     if(!result) return false;
@@ -172,55 +376,38 @@ bool Coil_AddContentStream(RouteContext *context, Stream *s, Dynar(HttpTransferC
     checkRet(Coil_AddTransferEncoding(context, codings));
     checkRet(Coil_SealHeaders(context));
 
-    if(context->method == HEAD) return true;
-
-
-
-    dynar_foreach(HttpTransferCoding, codings) {
-        if(mem_eq(loop.it.coding, mkString("chunked"))) {
-            ResultRead r;
-
-            byte buffer[1024];
+    if(context->method == HTTP_HEAD) return true;
 
-            while(isJust(r = stream_read(s, mkMem(buffer, 1024)))) {
-                u64 len = r.read;
-                if(len == 0) break;
+    CoilTransferEncoder *encoders = (CoilTransferEncoder *)AllocateBytes(sizeof(CoilTransferEncoder) * (encoderCount + 1)).s;
+    if(encoders == null) return false;
 
-                u64 elen = Sha_endian64(len);
-                Stream elens = mkStreamStr(mkMem(&elen, 8));
-                checkRet(writeBytesToHex(&elens, context->s, false, false));
-                // here we would've put chunk extensions if we were sadists
-                checkRet(Http_writeCRLF(context->s));
-                tryRet(stream_write(context->s, mkMem(buffer, len)));
-                checkRet(Http_writeCRLF(context->s));
+    usz initialized = 0;
+    result = true;
+    for(; result && initialized < encoderCount; initialized++) {
+        result = Coil_TransferEncoderInit(&encoders[initialized], dynar_index(HttpTransferCoding, codings, initialized).coding);
+    }
 
-                if(r.partial) break;
-            }
+    byte buffer[1024];
+    ResultRead r;
+    while(result && isJust(r = stream_read(s, mkMem(buffer, 1024)))) {
+        if(r.read == 0) break;
+        result = Coil_WriteEncodedChunk(context, encoders, encoderCount, mkMem(buffer, r.read), false);
+        if(r.partial) break;
+    }
+    result = result && Coil_WriteEncodedChunk(context, encoders, encoderCount, memnull, true);
 
-            checkRet(stream_writeChar(context->s, '0'));
-            checkRet(Http_writeCRLF(context->s));
+    for(usz i = 0; i < initialized; i++) {
+        Coil_TransferEncoderDeinit(&encoders[i]);
+    }
+    Free(encoders);
+    if(!result) return false;
 
-            // here we would've put trailer fields if we were sadists
+    checkRet(stream_writeChar(context->s, '0'));
+    checkRet(Http_writeCRLF(context->s));
 
-            checkRet(Http_writeCRLF(context->s));
-        }
-        else if(mem_eq(loop.it.coding, mkString("gzip"))) {
-            Mem mem = Gzip_compress(stream_dump(s, ALLOC, 0, true), ALLOC);
-            if(isNull(mem)) return false;
-            _s = mkStreamStr(mem);
-            s = &_s;
-        }
-        else if(mem_eq(loop.it.coding, mkString("deflate"))) {
-            Mem mem = Zlib_compress(stream_dump(s, ALLOC, 0, true), ALLOC);
-            if(isNull(mem)) return false;
-            _s = mkStreamStr(mem);
-            s = &_s;
-        }
-        else {
-            return false;
-        }
-    }
+    // here we would've put trailer fields if we were sadists
 
+    checkRet(Http_writeCRLF(context->s));
     return true;
 }
 
@@ -241,387 +428,831 @@ bool Coil_StatusLine(RouteContext *context, HttpStatusCode statusCode) {
     return true;
 }
 
-// TODO: the result type needs to convey error vs empty content
-Mem Coil_GetContent(RouteContext *context) {
-    bool hasContentLength = map_has(context->headers, mkString("content-length"));
-    bool hasTransferEncoding = map_has(context->headers, mkString("transfer-encoding"));
-    // if(hasContentLength && hasTransferEncoding) return memnull; // unreachable, caught in threadRoutine
-    if(!hasContentLength && !hasTransferEncoding) return memnull;
-    if(hasTransferEncoding) hasContentLength = false;
+bool Coil_HeaderMatchesETag(RouteContext *context, String header, HttpEntityTag *etag, bool strong) {
+    HttpH_IfMatch *condition = memExtractPtr(HttpH_IfMatch, map_get(context->headers, header));
+    if(condition->any) return true;
+    if(etag == null) return false;
 
-    if(hasContentLength) {
-        HttpH_ContentLength contentLength = memExtract(HttpH_ContentLength, map_get(context->headers, mkString("content-length")));
-        if(contentLength.length > CONTENT_LIMIT) return memnull;
-        Mem mem = AllocateBytes(contentLength.length);
-        ResultRead r = stream_read(context->s, mem);
-        if(r.error || r.partial) return memnull;
-        return mem;
+    dynar_foreach(HttpEntityTag, &condition->etags) {
+        if(Http_matchEntityTag(loop.it, *etag, strong)) return true;
     }
-    else if(hasTransferEncoding) {
-        HttpH_TransferEncoding transferEncoding = memExtract(HttpH_TransferEncoding, map_get(context->headers, mkString("transfer-encoding")));
+    return false;
+}
 
-        Mem mem = memnull;
-        while(transferEncoding.codings.len != 0) {
-            HttpTransferCoding coding = dynar_peek(HttpTransferCoding, &transferEncoding.codings);
-            dynar_pop(HttpTransferCoding, &transferEncoding.codings);
+// NOTE: evaluates the preconditions in the order of RFC 9110 13.2.2, for
+// a representation that exists. Returns the status code to respond with,
+// which is 200 if the request should proceed
+HttpStatusCode Coil_EvaluatePreconditions(RouteContext *context, HttpEntityTag *etag, time_t lastModified) {
+    bool isGetOrHead = context->method == HTTP_GET || context->method == HTTP_HEAD;
 
-            // printf("CODING %.*s\n", (int)coding.coding.len, coding.coding.s);
+    if(map_has(context->headers, mkString("if-match"))) {
+        if(!Coil_HeaderMatchesETag(context, mkString("if-match"), etag, true)) return 412;
+    }
+    else if(map_has(context->headers, mkString("if-unmodified-since"))) {
+        HttpH_IfUnmodifiedSince header = memExtract(HttpH_IfUnmodifiedSince, map_get(context->headers, mkString("if-unmodified-since")));
+        if(lastModified > header.lastModified) return 412;
+    }
 
-            // printf("RBUFFER\n");
-            write(STDOUT_FILENO, context->s->rbuffer.s, context->s->rbuffer.len);
+    if(map_has(context->headers, mkString("if-none-match"))) {
+        if(Coil_HeaderMatchesETag(context, mkString("if-none-match"), etag, false)) return isGetOrHead ? 304 : 412;
+    }
+    else if(isGetOrHead && map_has(context->headers, mkString("if-modified-since"))) {
+        HttpH_IfModifiedSince header = memExtract(HttpH_IfModifiedSince, map_get(context->headers, mkString("if-modified-since")));
+        if(lastModified <= header.lastModified) return 304;
+    }
 
-            if(mem_eq(coding.coding, mkString("chunked"))) {
-                StringBuilder sb = mkStringBuilder();
-                Stream s = mkStreamSb(&sb);
+    return 200;
+}
 
-                while(true) {
-                    u64 chunkLength;
-                    checkRetVal(parseU64FromHex(context->s, &chunkLength, false), memnull);
-                    HttpChunkExtensions ext = Http_parseChunkExtensions(context->s, ALLOC);
-                    if(isNone(ext)) return memnull;
-                    checkRetVal(Http_parseCRLF(context->s), memnull);
+typedef struct {
+    u64 start;
+    u64 len;
+} CoilRange;
+
+// NOTE: the part of a representation of the given length that the range
+// covers, as per RFC 9110 14.1.2. Returns false if it's unsatisfiable
+bool Coil_ResolveRange(HttpRange range, u64 length, CoilRange *result) {
+    if(range.hasFirst) {
+        if(range.first >= length) return false;
+        u64 last = range.hasLast && range.last < length ? range.last : length - 1;
+        *result = (CoilRange){ .start = range.first, .len = last - range.first + 1 };
+    }
+    else {
+        if(range.last == 0 || length == 0) return false;
+        u64 len = range.last < length ? range.last : length;
+        *result = (CoilRange){ .start = length - len, .len = len };
+    }
+    return true;
+}
 
-                    if(chunkLength > CONTENT_LIMIT) return memnull;
-                    if(sb.len + chunkLength > CONTENT_LIMIT) return memnull;
+// NOTE: Range is only defined for GET, and If-Range has to match the
+// selected representation with a strong comparison, otherwise the whole
+// representation is sent (RFC 9110 13.1.5)
+bool Coil_WantsRanges(RouteContext *context, CoilFileVariant *variant, time_t lastModified) {
+    if(context->method != HTTP_GET) return false;
+    if(!map_has(context->headers, mkString("range"))) return false;
+    if(!map_has(context->headers, mkString("if-range"))) return true;
+
+    HttpH_IfRange *ifRange = memExtractPtr(HttpH_IfRange, map_get(context->headers, mkString("if-range")));
+    if(ifRange->isDate) return ifRange->date == lastModified;
+    return variant->hasETag && Http_matchEntityTag(ifRange->etag, variant->etag, true);
+}
 
-                    if(chunkLength == 0) { break; } // final chunk
-                    checkRetVal(stream_dumpInto(context->s, &s, chunkLength, false), memnull);
-                    checkRetVal(Http_parseCRLF(context->s), memnull);
-                }
+bool Coil_WriteContentRange(Stream *s, CoilRange range, u64 length) {
+    tryRet(stream_write(s, mkString("Content-Range: bytes ")));
+    checkRet(writeU64ToDecimal(s, range.start));
+    checkRet(stream_writeChar(s, '-'));
+    checkRet(writeU64ToDecimal(s, range.start + range.len - 1));
+    checkRet(stream_writeChar(s, '/'));
+    checkRet(writeU64ToDecimal(s, length));
+    checkRet(Http_writeCRLF(s));
+    return true;
+}
 
-                MaybeChar c = stream_peekChar(context->s);
-                if(isNone(c)) return memnull;
+// NOTE: the bytes come either from memory (which may be mapped, see
+// getFileMapped), or straight from the disk if fd != -1
+bool Coil_WriteFileRange(RouteContext *context, Mem content, int fd, CoilRange range) {
+    if(fd == -1) {
+        tryRet(stream_write(context->s, mkMem(content.s + range.start, range.len)));
+        return true;
+    }
 
-                if(isJust(c) && c.value == HTTP_CR) {
-                    checkRetVal(Http_parseCRLF(context->s), memnull);
-                }
-                else {
-                    // i fucking hate trailer fields
-                    while(true) {
-                        HttpError result = Http_parseHeaderField(context->s, context->headers);
-                        bool crlf = Http_parseCRLF(context->s);
-                        if(!crlf && result == HTTPERR_SUCCESS) { result = HTTPERR_INVALID_HEADER_FIELD; }
-
-                        if(result != HTTPERR_SUCCESS) {
-                            context->error = result;
-                            context->statusCode = 400;
-                            Handle(context, context->lastRouter->handler_badRequest);
-                            return memnull;
-                        }
+    ResultWrite written = stream_sendfile(context->s, fd, range.start, range.len);
+    return !written.error && !written.partial;
+}
 
-                        bool finalCrlf = Http_parseCRLF(&s);
-                        if(finalCrlf) break;
-                    }
-                }
+#define COIL_BOUNDARY_PREFIX "coil-byteranges-"
+
+// NOTE: the headers of a multipart/byteranges part, preceded by its delimiter
+String Coil_MakeRangePartHeader(HttpMediaType mediaType, String boundary, CoilRange range, u64 length) {
+    StringBuilder sb = mkStringBuilder();
+    Stream out = mkStreamSb(&sb);
+    checkRetVal(Http_writeCRLF(&out), memnull);
+    tryRetVal(stream_write(&out, mkString("--")), memnull);
+    tryRetVal(stream_write(&out, boundary), memnull);
+    checkRetVal(Http_writeCRLF(&out), memnull);
+    checkRetVal(Coil_WriteContentType(&out, mediaType), memnull);
+    checkRetVal(Coil_WriteContentRange(&out, range, length), memnull);
+    checkRetVal(Http_writeCRLF(&out), memnull);
+    return sb_build(sb);
+}
 
-                mem = sb_build(sb);
-            }
-            // NOTE: I wanted to test this via curl, but for some reason "Transfer-Encoding: gzip, chunked" couldn't be properly sent
+bool Coil_AddRanges(RouteContext *context, File *file, CoilFileVariant *variant, int fd, CoilRange *ranges, usz rangeCount, u64 length) {
+    if(rangeCount == 1) {
+        checkRet(Coil_AddContentType(context, file->mediaType));
+        checkRet(Coil_WriteContentRange(context->s, ranges[0], length));
+        checkRet(Coil_AddContentLength(context, ranges[0].len));
+        checkRet(Coil_SealHeaders(context));
+        checkRet(Coil_WriteFileRange(context, variant->content, fd, ranges[0]));
+        return true;
+    }
 
-            // else if(mem_eq(coding.coding, mkString("gzip"))) {
-            //     Mem un = Gzip_decompress(mem, ALLOC);
-            //     if(isNull(un)) return memnull;
-            //     mem = un;
-            // }
-            else {
-                // unreachable
-                return memnull;
-            }
-        }
+    // NOTE: the boundary only has to not occur in the body, the
+    // current time in hex is good enough for that
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    u64 seed = (u64)now.tv_sec * 1000000000ull + (u64)now.tv_nsec;
+
+    StringBuilder sb = mkStringBuilder();
+    Stream out = mkStreamSb(&sb);
+    Stream in = mkStreamStr(mkMem(&seed, sizeof(seed)));
+    tryRet(stream_write(&out, mkString(COIL_BOUNDARY_PREFIX)));
+    checkRet(writeBytesToHex(&in, &out, false, false));
+    String boundary = sb_build(sb);
+
+    // NOTE: every part's headers are built upfront, so that
+    // the Content-Length of the whole body is known
+    String partHeaders[HTTP_RANGE_LIMIT];
+    u64 contentLength = 0;
+    for(usz i = 0; i < rangeCount; i++) {
+        partHeaders[i] = Coil_MakeRangePartHeader(file->mediaType, boundary, ranges[i], length);
+        if(isNull(partHeaders[i])) return false;
+        contentLength += partHeaders[i].len + ranges[i].len;
+    }
+    contentLength += boundary.len + 8; // NOTE: CRLF "--" boundary "--" CRLF
+
+    tryRet(stream_write(context->s, mkString("Content-Type: multipart/byteranges; boundary=")));
+    tryRet(stream_write(context->s, boundary));
+    checkRet(Http_writeCRLF(context->s));
+    checkRet(Coil_AddContentLength(context, contentLength));
+    checkRet(Coil_SealHeaders(context));
 
-        return mem;
+    for(usz i = 0; i < rangeCount; i++) {
+        tryRet(stream_write(context->s, partHeaders[i]));
+        checkRet(Coil_WriteFileRange(context, variant->content, fd, ranges[i]));
     }
-    return memnull;
-}
 
-typedef struct {
-    usz id;
+    checkRet(Http_writeCRLF(context->s));
+    tryRet(stream_write(context->s, mkString("--")));
+    tryRet(stream_write(context->s, boundary));
+    tryRet(stream_write(context->s, mkString("--")));
+    checkRet(Http_writeCRLF(context->s));
+    return true;
+}
 
-    struct sockaddr_in addr;
-    int clientSock;
+// NOTE: responds with 206 and the requested ranges of the selected variant,
+// or 416 if none of them are satisfiable. Sets handled to false and sends
+// nothing if the ranges should be ignored in favor of the whole file
+bool Coil_RespondFileRanges(RouteContext *context, File *file, CoilFileVariant *variant, bool *handled) {
+    HttpH_Range *header = memExtractPtr(HttpH_Range, map_get(context->headers, mkString("range")));
+
+    bool fromDisk = isNull(file->data) && !isNull(file->path);
+    u64 length = fromDisk ? file->size : variant->content.len;
+
+    CoilRange ranges[HTTP_RANGE_LIMIT];
+    usz rangeCount = 0;
+    u64 total = 0;
+    dynar_foreach(HttpRange, &header->ranges) {
+        if(rangeCount >= HTTP_RANGE_LIMIT) break;
+        if(!Coil_ResolveRange(loop.it, length, &ranges[rangeCount])) continue;
+        total += ranges[rangeCount].len;
+        rangeCount += 1;
+    }
 
-    Router *router;
-} Connection;
+    // NOTE: overlapping ranges that add up to more than the whole
+    // representation aren't worth it (RFC 9110 14.2)
+    *handled = total <= length;
+    if(!*handled) return true;
+
+    if(rangeCount == 0) {
+        checkRet(Coil_StatusLine(context, 416));
+        tryRet(stream_write(context->s, mkString("Content-Range: bytes */")));
+        checkRet(writeU64ToDecimal(context->s, length));
+        checkRet(Http_writeCRLF(context->s));
+        checkRet(Coil_AddContent(context, memnull));
+        return true;
+    }
 
-void *threadRoutine(void *_connection) {
-    Connection connection = *(Connection *)_connection;
-    Free(_connection);
+    int fd = -1;
+    if(fromDisk) {
+        fd = open(fixchar file->path.s, O_RDONLY);
+        if(fd == -1) return false;
+    }
 
-    Log_format1(LOG_INFO, "<%d> Started thread routine", connection.id);
+    bool result = Coil_StatusLine(context, 206);
+    if(result && !isNull(variant->encoding)) {
+        result = Coil_AddHeader(context, mkString("Content-Encoding"), variant->encoding);
+    }
+    result = result && Coil_AddFileValidators(context, file, variant);
+    result = result && Coil_AddHeader(context, mkString("Accept-Ranges"), mkString("bytes"));
+    result = result && Coil_AddRanges(context, file, variant, fd, ranges, rangeCount, length);
 
-    // https://stackoverflow.com/questions/2876024/linux-is-there-a-read-or-recv-from-socket-with-timeout
-    struct timeval timeout = { .tv_sec = 60 }; // for some bizarre reason this works only half the time
-    setsockopt(connection.clientSock, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout, sizeof(struct timeval));
+    if(fd != -1) close(fd);
+    return result;
+}
 
-    Stream s = mkStreamFd(connection.clientSock);
-    stream_wbufferEnable(&s, 4096);
-    stream_rbufferEnable(&s, 4096);
+// NOTE: responds with the file, unless the request's preconditions
+// say that the client already has it (304), or that it shouldn't (412).
+// If it asks for ranges, only those are sent
+bool Coil_RespondFile(RouteContext *context, File file) {
+    CoilFileVariant variant = Coil_GetFileVariant(context, &file);
+    HttpStatusCode statusCode = Coil_EvaluatePreconditions(context, variant.hasETag ? &variant.etag : null, file.modTime);
+
+    if(statusCode == 304) {
+        checkRet(Coil_StatusLine(context, 304));
+        checkRet(Coil_AddFileValidators(context, &file, &variant));
+        checkRet(Coil_NoContent(context));
+        return true;
+    }
 
-    bool connectionPersists = false;
+    if(statusCode == 412) {
+        checkRet(Coil_StatusLine(context, 412));
+        checkRet(Coil_AddContent(context, memnull));
+        return true;
+    }
 
-    // NOTE: to invert the ALLOC_POP usage, so that it can be put in cleanup
-    ALLOC_PUSH_DUMMY();
+    if(Coil_WantsRanges(context, &variant, file.modTime)) {
+        bool handled = false;
+        checkRet(Coil_RespondFileRanges(context, &file, &variant, &handled));
+        if(handled) return true;
+    }
 
-    do {
-        // Timeout handling
-        MaybeChar any = stream_peekChar(&s);
-        if(isNone(any)) {
-            goto cleanup;
-        }
+    checkRet(Coil_StatusLine(context, 200));
+    checkRet(Coil_AddFile(context, file));
+    return true;
+}
 
-        ALLOC_POP(); // pop dummy
-        ALLOC_PUSH(mkAlloc_LinearExpandableA(ALLOC_GLOBAL));
+// NOTE: writes the identity content of a dynamic response into out, and
+// sets its media type. It can also respond on its own (say, with a 404),
+// by sending a status line, in which case nothing is cached
+typedef bool (CoilContentCallback)(RouteContext *context, Mem arg, Stream *out, HttpMediaType *mediaType);
 
-        RouteContext context = ((RouteContext){
-            .s = &s,
-            .mainRouter = connection.router,
-            .lastRouter = connection.router,
-        });
+typedef struct {
+    // NOTE: null - the content is produced and compressed on every request
+    ResponseCache *cache;
+    CoilContentCallback *callback;
+    Mem argument;
+} CoilCachedRoute;
+
+#define mkCoilCachedRoute(r, c, a) ((CoilCachedRoute){ .cache = (r), .callback = (c), .argument = (a) })
+
+bool Coil_AddCachedValidators(RouteContext *context, CachedResponse *response) {
+    checkRet(Coil_AddHeader(context, mkString("Vary"), mkString("Accept-Encoding")));
+    checkRet(Coil_AddETagS(context, mkMem(response->hash.data, 256 / 8), false, response->encoding));
+    checkRet(Coil_AddLastModified(context, response->created));
+    return true;
+}
 
-        Http11RequestLine requestLine = Http_parseHttp11RequestLine(&s, ALLOC);
-        stream_rlimitDisable(&s);
+bool Coil_SendCachedResponse(RouteContext *context, CachedResponse *response) {
+    HttpEntityTag etag = Coil_MakeETag(mkMem(response->hash.data, 256 / 8), false, response->encoding);
+    HttpStatusCode statusCode = Coil_EvaluatePreconditions(context, isJust(etag) ? &etag : null, response->created);
 
-        if(isNone(requestLine)) {
-            context.error = requestLine.errmsg;
-            Log_format2(LOG_ERROR, "<%d> Couldn't parse request line. errmsg = %d", connection.id, requestLine.errmsg);
+    if(statusCode == 304) {
+        checkRet(Coil_StatusLine(context, 304));
+        checkRet(Coil_AddCachedValidators(context, response));
+        checkRet(Coil_NoContent(context));
+        return true;
+    }
 
-            if(isFail(requestLine, HTTPERR_INTERNAL_ERROR)) {
-                context.statusCode = 500;
-                Handle(&context, connection.router->handler_internalError);
-            }
-            else if(isFail(requestLine, HTTPERR_UNKNOWN_METHOD)) {
-                context.statusCode = 501;
-                Handle(&context, connection.router->handler_notImplemented);
-            }
-            else if(isFail(requestLine, HTTPERR_REQUEST_TARGET_TOO_LONG)) {
-                // NOTE: does this need a separate callback?
-                context.statusCode = 414;
-                Handle(&context, connection.router->handler_badRequest);
-            }
-            else {
-                context.statusCode = 400;
-                Handle(&context, connection.router->handler_badRequest);
-            }
+    if(statusCode == 412) {
+        checkRet(Coil_StatusLine(context, 412));
+        checkRet(Coil_AddContent(context, memnull));
+        return true;
+    }
 
-            goto cleanup;
-        }
+    checkRet(Coil_StatusLine(context, 200));
+    checkRet(Coil_AddContentType(context, response->mediaType));
+    if(!isNull(response->encoding)) {
+        checkRet(Coil_AddHeader(context, mkString("Content-Encoding"), response->encoding));
+    }
+    checkRet(Coil_AddCachedValidators(context, response));
+    checkRet(Coil_AddContent(context, response->content));
+    return true;
+}
 
-        if(requestLine.target.path.segments.len != 0) {
-            if(dynar_peek(String, &requestLine.target.path.segments).len == 0) requestLine.target.path.segments.len -= 1;
-        }
+// NOTE: responds with the representation of a dynamic response that the
+// client prefers, compressed once and then served from the cache until
+// it expires. Only GET and HEAD are cached
+bool Coil_RespondCached(RouteContext *context, CoilCachedRoute *route) {
+    String encoding = Coil_NegotiateEncoding(context, true, true);
+    bool cacheable = route->cache != null && (context->method == HTTP_GET || context->method == HTTP_HEAD);
+
+    String key = memnull;
+    CachedResponse response = none(CachedResponse);
+    if(cacheable) {
+        key = responseCacheKey(context->method, context->originalPath, context->query, encoding, ALLOC);
+        response = getCachedResponse(route->cache, key);
+    }
 
-        if(Log_is1) {
-            StringBuilder sb = mkStringBuilder();
-            dynar_foreach(String, &requestLine.target.path.segments) {
-                sb_appendChar(&sb, '/');
-                sb_appendMem(&sb, loop.it);
-            }
-            if(sb.len == 0) {
-                sb_appendChar(&sb, '/');
-            }
+    if(isNone(response)) {
+        StringBuilder sb = mkStringBuilder();
+        Stream out = mkStreamSb(&sb);
+        HttpMediaType mediaType = mkHttpMediaType("application", "octet-stream");
+        checkRet(route->callback(context, route->argument, &out, &mediaType));
+        if(context->sealedStatus) return true;
 
-            String path = sb_build(sb);
-            Log_format2(LOG_INFO, "<%d> Request at \"%.*s\"", connection.id, path.len, path.s);
-        }
+        if(cacheable) response = putCachedResponse(route->cache, key, sb_build(sb), mediaType, encoding);
+        else response = mkCachedResponse(sb_build(sb), mediaType, encoding, COIL_COMPRESSION_LEVEL, 0, ALLOC);
+        if(isNone(response)) return false;
+    }
 
-        Map headers = mkMap();
+    bool result = Coil_SendCachedResponse(context, &response);
+    releaseCachedResponse(response);
+    return result;
+}
 
-        // TODO: there should probably be a check that we're being trolled by an infinite stream of headers
-        while(true) {
-            HttpError result = Http_parseHeaderField(&s, &headers);
-            bool crlf = Http_parseCRLF(&s);
-            if(!crlf && result == HTTPERR_SUCCESS) { result = HTTPERR_INVALID_HEADER_FIELD; }
+// NOTE: reads the request content a piece at a time, undoing the chunked
+// framing if there is one, so that it doesn't have to be all in memory
+typedef struct {
+    bool chunked;
+    bool finished;
 
-            if(result != HTTPERR_SUCCESS) {
-                context.error = result;
+    // NOTE: what's left of the content, or of the current chunk
+    u64 left;
+    u64 total;
+} CoilContentReader;
 
-                if(result == HTTPERR_INTERNAL_ERROR) {
-                    context.statusCode = 500;
-                    Handle(&context, connection.router->handler_internalError);
-                }
-                else {
-                    context.statusCode = 400;
-                    Handle(&context, connection.router->handler_badRequest);
-                }
+// NOTE: returns false if the request has no content
+bool Coil_ContentReaderInit(RouteContext *context, CoilContentReader *reader) {
+    *reader = (CoilContentReader){0};
 
-                goto cleanup;
-            }
+    if(map_has(context->headers, mkString("transfer-encoding"))) {
+        HttpH_TransferEncoding transferEncoding = memExtract(HttpH_TransferEncoding, map_get(context->headers, mkString("transfer-encoding")));
+        if(transferEncoding.codings.len != 1) return false;
 
-            bool finalCrlf = Http_parseCRLF(&s);
-            if(finalCrlf) break;
-        }
+        // NOTE: chunked is the only transfer coding that requests are allowed to have
+        HttpTransferCoding coding = dynar_peek(HttpTransferCoding, &transferEncoding.codings);
+        if(!mem_eq(coding.coding, mkString("chunked"))) return false;
 
-        if(!map_has(&headers, mkString("host"))) {
-            context.statusCode = 400;
-            context.error = HTTPERR_BAD_HOST;
-            Handle(&context, connection.router->handler_badRequest);
-            goto cleanup;
-        }
+        reader->chunked = true;
+        return true;
+    }
 
-        HttpH_Connection *connectionHeader = memExtractPtr(HttpH_Connection, map_get(&headers, mkString("connection")));
-        bool containsClose = connectionHeader != null
-            ? dynar_containsString(&connectionHeader->connectionOptions, mkString("close")) : false;
-        bool containsKeepalive = connectionHeader != null
-            ? dynar_containsString(&connectionHeader->connectionOptions, mkString("keep-alive")) : false;
-
-        // if(map_has(&headers, mkString("content-length")) && map_has(&headers, mkString("transfer-encoding"))) {
-        //     context.statusCode = 400;
-        //     context.error = HTTPERR_BAD_CONTENT_LENGTH;
-        //     Handle(&context, connection.router->handler_badRequest);
-        //     goto cleanup;
-        // }
-
-        if(map_has(&headers, mkString("transfer-encoding"))) {
-            HttpH_TransferEncoding transferEncoding = memExtract(HttpH_TransferEncoding, map_get(&headers, mkString("transfer-encoding")));
-            dynar_foreach(HttpTransferCoding, &transferEncoding.codings) {
-                if(loop.index == transferEncoding.codings.len - 1 && !mem_eq(loop.it.coding, mkString("chunked"))) {
-                    // printf("BAD A\n");
-                    context.statusCode = 400;
-                    context.error = HTTPERR_BAD_TRANSFER_CODING;
-                    Handle(&context, connection.router->handler_badRequest);
-                    goto cleanup;
-                }
+    if(map_has(context->headers, mkString("content-length"))) {
+        HttpH_ContentLength contentLength = memExtract(HttpH_ContentLength, map_get(context->headers, mkString("content-length")));
+        if(contentLength.length > CONTENT_LIMIT) return false;
+        reader->left = contentLength.length;
+        reader->finished = reader->left == 0;
+        return true;
+    }
 
-                if(loop.index != transferEncoding.codings.len - 1 && mem_eq(loop.it.coding, mkString("chunked"))) {
-                    // printf("BAD B\n");
-                    context.statusCode = 400;
-                    context.error = HTTPERR_BAD_TRANSFER_CODING;
-                    Handle(&context, connection.router->handler_badRequest);
-                    goto cleanup;
-                }
+    return false;
+}
 
-                if(
-                !mem_eq(loop.it.coding, mkString("chunked")) &&
-                // !mem_eq(loop.it.coding, mkString("gzip")) &&
-                true) {
-                    context.statusCode = 501;
-                    context.error = HTTPERR_UNKNOWN_TRANSFER_CODING;
-                    Handle(&context, connection.router->handler_notImplemented);
-                    goto cleanup;
-                }
-            }
-        }
+bool Coil_ContentReaderNextChunk(RouteContext *context, CoilContentReader *reader) {
+    u64 chunkLength;
+    checkRet(parseU64FromHex(context->s, &chunkLength, false));
+    HttpChunkExtensions ext = Http_parseChunkExtensions(context->s, ALLOC);
+    if(isNone(ext)) return false;
+    checkRet(Http_parseCRLF(context->s));
 
-        if(containsClose)
-            { connectionPersists = false; }
-        // NOTE: this seems to be as per RFC-9112, but Firefox automatically starts
-        // a new connection even though I send version 1.1
-
-        // NOTE: huh, now it doesnt?? did i test it wrong or what the hell is happening
-        else if(requestLine.version.value >= Http_getVersion(1, 1) || containsKeepalive)
-            { connectionPersists = true; }
-        else
-            { connectionPersists = false; }
-
-        // TODO: we have the headers, including the Host, now
-        // we reconstruct the target URI and parse it
-
-        // TODO: with the target URI reconstructed, we can now,
-        // *gulp*, convert the path+query back into a string to
-        // feed to the router
-        // Should I extend the Uri/UriPath structs to include a
-        // string representation? I probably should
-
-        Map routeMatches = mkMap();
-        context = ((RouteContext){
-            .s = &s,
-            .clientVersion = requestLine.version,
-            .method = requestLine.method,
-            .headers = &headers,
-
-            .originalPath = requestLine.target.path,
-            .relatedPath = requestLine.target.path,
-
-            .mainRouter = connection.router,
-            .lastRouter = connection.router,
-
-            .persist = true,
-
-            .query = requestLine.target.query,
-
-            .matches = &routeMatches,
-        });
-
-        // MapIter iter = map_iter(&headers);
-        // while(!map_iter_end(&iter)) {
-        //     MapEntry entry = map_iter_next(&iter);
-        //     HttpH_Unknown header = memExtract(HttpH_Unknown, entry.val);
-        //     String value = header.value;
-        //     value = value;
-        //
-        //     // printf("HEADER NAME: %.*s\n", (int)entry.key.len, entry.key.s);
-        //     // printf("HEADER VALUE: %.*s\n", (int)value.len, value.s);
-        //     // printf("-----------\n");
-        // }
-
-        Route route = getRoute(connection.router, &context);
-        if(isNone(route)) {
-            if(isFail(route, ROUTE_ERR_FOUND_URI)) {
-                Log_format2(LOG_ERROR, "<%d> Couldn't find an appropriate route with this method", connection.id);
-
-                context.statusCode = 405;
-                context.allowedMethodMask = route.methodMask;
-                checkDo(Handle(&context, connection.router->handler_badRequest), goto cleanup);
-                tryDo(stream_writeFlush(&s), goto cleanup);
-                continue;
-            }
-            else {
-                Log_format2(LOG_ERROR, "<%d> Couldn't find an appropriate route", connection.id);
+    if(chunkLength > CONTENT_LIMIT) return false;
+    if(reader->total + chunkLength > CONTENT_LIMIT) return false;
 
-                context.statusCode = 404;
-                checkDo(Handle(&context, connection.router->handler_routeNotFound), goto cleanup);
-                tryDo(stream_writeFlush(&s), goto cleanup);
-                continue;
-            }
-        }
+    reader->left = chunkLength;
+    if(chunkLength != 0) return true;
 
-        Log_format2(LOG_INFO, "<%d> Trying to handle the route", connection.id);
-        if(!Handle(&context, route.handler)) {
-            Log_format1(LOG_ERROR, "<%d> Couldn't handle the route", connection.id);
+    // NOTE: final chunk
+    reader->finished = true;
 
-            context.statusCode = 500;
-            Handle(&context, connection.router->handler_internalError);
-            goto cleanup;
-        }
-        Log_format2(LOG_INFO, "<%d> Route handled successfully", connection.id);
+    MaybeChar c = stream_peekChar(context->s);
+    if(isNone(c)) return false;
 
-        if(!context.persist) connectionPersists = false;
+    if(c.value == HTTP_CR) {
+        checkRet(Http_parseCRLF(context->s));
+        return true;
+    }
 
-        if(isNone(stream_writeFlush(&s))) {
-            Log_format1(LOG_ERROR, "<%d> Couldn't flush the buffer", connection.id);
-            goto cleanup;
+    // i fucking hate trailer fields
+    while(true) {
+        HttpError result = Http_parseHeaderField(context->s, context->headers);
+        bool crlf = Http_parseCRLF(context->s);
+        if(!crlf && result == HTTPERR_SUCCESS) { result = HTTPERR_INVALID_HEADER_FIELD; }
+
+        if(result != HTTPERR_SUCCESS) {
+            context->error = result;
+            context->statusCode = 400;
+            Handle(context, context->lastRouter->handler_badRequest);
+            return false;
         }
 
-    } while(connectionPersists);
-
-cleanup:
-    Log_format1(LOG_INFO, "<%d> Closing connection", connection.id);
-    stream_writeFlush(&s);
-    ALLOC_POP();
-    Free(s.wbuffer.s);
-    Free(s.rbuffer.s);
-    close(connection.clientSock);
+        bool finalCrlf = Http_parseCRLF(context->s);
+        if(finalCrlf) break;
+    }
 
-    return null;
+    return true;
 }
 
-#define CoilCallback(name, body) \
-bool name(RouteContext *context, Mem arg) { context = context; arg = arg; { body; } }
+// NOTE: reads at most mem.len bytes of content, 0 means it has all been read
+ResultRead Coil_ContentReaderRead(RouteContext *context, CoilContentReader *reader, Mem mem) {
+    while(!reader->finished && reader->left == 0) {
+        if(!Coil_ContentReaderNextChunk(context, reader)) return none(ResultRead);
+    }
+    if(reader->finished && reader->left == 0) return mkResultRead(mem.len, 0);
 
-#define CoilCallbackStr(name, arg, body) \
-bool name(RouteContext *context, String arg) { context = context; arg = arg; { body; } }
+    if(mem.len > reader->left) mem.len = reader->left;
+    ResultRead r = stream_read(context->s, mem);
+    if(r.error || r.read == 0) return none(ResultRead);
 
-#define CoilCallbackArg(name, argty, argname, body) \
-bool name(RouteContext *context, Mem arg) { context = context; arg = arg; argty *argname = memExtractPtr(argty, arg); { body; } }
+    reader->left -= r.read;
+    reader->total += r.read;
+    if(reader->left == 0) {
+        if(!reader->chunked) reader->finished = true;
+        else if(!Http_parseCRLF(context->s)) return none(ResultRead);
+    }
+    return r;
+}
 
-CoilCallbackArg(CoilCB_fileTree, FileTreeRouter, fileTree, {
-    File file = getFileTree(fileTree, context->relatedPath);
-    if(isNone(file)) {
-        return Coil_NotFound(context);
+// TODO: the result type needs to convey error vs empty content
+Mem Coil_GetContent(RouteContext *context) {
+    CoilContentReader reader;
+    if(!Coil_ContentReaderInit(context, &reader)) return memnull;
+
+    StringBuilder sb = mkStringBuilderCap(reader.chunked ? 1024 : reader.left);
+    while(true) {
+        checkRetVal(sb_reserve(&sb, 4096), memnull);
+        Mem free = mkMem(sb.s.s + sb.len, sb.cap - sb.len);
+        ResultRead r = Coil_ContentReaderRead(context, &reader, free);
+        if(r.error) return memnull;
+        if(r.read == 0) break;
+        sb.len += r.read;
     }
 
-    checkRet(Coil_StatusLine(context, 200));
-    checkRet(Coil_AddFile(context, file));
+    return sb_build(sb);
+}
+
+// NOTE: a content coding that is undone as the content is read
+typedef struct {
+    bool isGzip;
+    GzipDecoder gzip;
+    ZlibDecoder zlib;
+} CoilContentDecoder;
+
+DeflateDecodeResult Coil_ContentDecoderDecode(CoilContentDecoder *decoder, Mem in, Mem out) {
+    if(decoder->isGzip) return Gzip_decoderDecode(&decoder->gzip, in, out);
+    else return Zlib_decoderDecode(&decoder->zlib, in, out);
+}
+
+// NOTE: writes the content into out, undoing its Content-Encoding, so the
+// decoded content is never all in memory. Only a single coding is supported
+bool Coil_GetContentDecoded(RouteContext *context, Stream *out) {
+    CoilContentReader reader;
+    checkRet(Coil_ContentReaderInit(context, &reader));
+
+    String coding = mkString("identity");
+    if(map_has(context->headers, mkString("content-encoding"))) {
+        HttpH_ContentEncoding contentEncoding = memExtract(HttpH_ContentEncoding, map_get(context->headers, mkString("content-encoding")));
+        if(contentEncoding.codings.len > 1) return false;
+        if(contentEncoding.codings.len == 1) coding = dynar_peek(HttpTransferCoding, &contentEncoding.codings).coding;
+    }
+
+    byte input[4096];
+    if(mem_eq(coding, mkString("identity"))) {
+        while(true) {
+            ResultRead r = Coil_ContentReaderRead(context, &reader, mkMem(input, sizeof(input)));
+            if(r.error) return false;
+            if(r.read == 0) return true;
+            tryRet(stream_write(out, mkMem(input, r.read)));
+        }
+    }
+
+    CoilContentDecoder *decoder = (CoilContentDecoder *)AllocateBytes(sizeof(CoilContentDecoder)).s;
+    if(decoder == null) return false;
+
+    decoder->isGzip = mem_eq(coding, mkString("gzip")) || mem_eq(coding, mkString("x-gzip"));
+    if(decoder->isGzip) Gzip_decoderInit(&decoder->gzip);
+    else if(mem_eq(coding, mkString("deflate"))) Zlib_decoderInit(&decoder->zlib);
+    else { Free(decoder); return false; }
+
+    byte output[16384];
+    u64 decoded = 0;
+    bool done = false;
+    bool result = true;
+    while(result) {
+        ResultRead r = Coil_ContentReaderRead(context, &reader, mkMem(input, sizeof(input)));
+        if(r.error) { result = false; break; }
+        if(r.read == 0) break;
+
+        // NOTE: the content can't go on after the coded data has ended
+        if(done) { result = false; break; }
+
+        Mem in = mkMem(input, r.read);
+        while(true) {
+            DeflateDecodeResult d = Coil_ContentDecoderDecode(decoder, in, mkMem(output, sizeof(output)));
+            if(isNone(d)) { result = false; break; }
+
+            in = memIndex(in, d.consumed);
+            decoded += d.produced;
+            if(decoded > CONTENT_LIMIT) { result = false; break; }
+            if(d.produced != 0 && stream_write(out, mkMem(output, d.produced)).error) { result = false; break; }
+
+            done = d.done;
+            if(done && in.len != 0) { result = false; break; }
+            if(done || (in.len == 0 && d.produced < sizeof(output))) break;
+        }
+    }
+
+    Free(decoder);
+    return result && done;
+}
+
+typedef struct {
+    usz id;
+
+    struct sockaddr_in addr;
+    int clientSock;
+
+    Router *router;
+} Connection;
+
+// NOTE: parses and handles a single request on the connection, returns
+// whether the connection should persist afterwards
+bool Coil_HandleRequestInternal(Connection *connection, Stream *s) {
+    bool connectionPersists = false;
+
+    RouteContext context = ((RouteContext){
+        .s = s,
+        .mainRouter = connection->router,
+        .lastRouter = connection->router,
+    });
+
+    Http11RequestLine requestLine = Http_parseHttp11RequestLine(s, ALLOC);
+    stream_rlimitDisable(s);
+
+    if(isNone(requestLine)) {
+        context.error = requestLine.errmsg;
+        Log_format2(LOG_ERROR, "<%d> Couldn't parse request line. errmsg = %d", connection->id, requestLine.errmsg);
+
+        if(isFail(requestLine, HTTPERR_INTERNAL_ERROR)) {
+            context.statusCode = 500;
+            Handle(&context, connection->router->handler_internalError);
+        }
+        else if(isFail(requestLine, HTTPERR_UNKNOWN_METHOD)) {
+            context.statusCode = 501;
+            Handle(&context, connection->router->handler_notImplemented);
+        }
+        else if(isFail(requestLine, HTTPERR_REQUEST_TARGET_TOO_LONG)) {
+            // NOTE: does this need a separate callback?
+            context.statusCode = 414;
+            Handle(&context, connection->router->handler_badRequest);
+        }
+        else {
+            context.statusCode = 400;
+            Handle(&context, connection->router->handler_badRequest);
+        }
+
+        return false;
+    }
+
+    if(requestLine.target.path.segments.len != 0) {
+        if(dynar_peek(String, &requestLine.target.path.segments).len == 0) requestLine.target.path.segments.len -= 1;
+    }
+
+    if(Log_is1) {
+        StringBuilder sb = mkStringBuilder();
+        dynar_foreach(String, &requestLine.target.path.segments) {
+            sb_appendChar(&sb, '/');
+            sb_appendMem(&sb, loop.it);
+        }
+        if(sb.len == 0) {
+            sb_appendChar(&sb, '/');
+        }
+
+        String path = sb_build(sb);
+        Log_format2(LOG_INFO, "<%d> Request at \"%.*s\"", connection->id, path.len, path.s);
+    }
+
+    Map headers = mkMap();
+
+    // TODO: there should probably be a check that we're being trolled by an infinite stream of headers
+    while(true) {
+        HttpError result = Http_parseHeaderField(s, &headers);
+        bool crlf = Http_parseCRLF(s);
+        if(!crlf && result == HTTPERR_SUCCESS) { result = HTTPERR_INVALID_HEADER_FIELD; }
+
+        if(result != HTTPERR_SUCCESS) {
+            context.error = result;
+
+            if(result == HTTPERR_INTERNAL_ERROR) {
+                context.statusCode = 500;
+                Handle(&context, connection->router->handler_internalError);
+            }
+            else {
+                context.statusCode = 400;
+                Handle(&context, connection->router->handler_badRequest);
+            }
+
+            return false;
+        }
+
+        bool finalCrlf = Http_parseCRLF(s);
+        if(finalCrlf) break;
+    }
+
+    if(!map_has(&headers, mkString("host"))) {
+        context.statusCode = 400;
+        context.error = HTTPERR_BAD_HOST;
+        Handle(&context, connection->router->handler_badRequest);
+        return false;
+    }
+
+    HttpH_Connection *connectionHeader = memExtractPtr(HttpH_Connection, map_get(&headers, mkString("connection")));
+    bool containsClose = connectionHeader != null
+        ? dynar_containsString(&connectionHeader->connectionOptions, mkString("close")) : false;
+    bool containsKeepalive = connectionHeader != null
+        ? dynar_containsString(&connectionHeader->connectionOptions, mkString("keep-alive")) : false;
+
+    // if(map_has(&headers, mkString("content-length")) && map_has(&headers, mkString("transfer-encoding"))) {
+    //     context.statusCode = 400;
+    //     context.error = HTTPERR_BAD_CONTENT_LENGTH;
+    //     Handle(&context, connection->router->handler_badRequest);
+    //     return false;
+    // }
+
+    if(map_has(&headers, mkString("transfer-encoding"))) {
+        HttpH_TransferEncoding transferEncoding = memExtract(HttpH_TransferEncoding, map_get(&headers, mkString("transfer-encoding")));
+        dynar_foreach(HttpTransferCoding, &transferEncoding.codings) {
+            if(loop.index == transferEncoding.codings.len - 1 && !mem_eq(loop.it.coding, mkString("chunked"))) {
+                // printf("BAD A\n");
+                context.statusCode = 400;
+                context.error = HTTPERR_BAD_TRANSFER_CODING;
+                Handle(&context, connection->router->handler_badRequest);
+                return false;
+            }
+
+            if(loop.index != transferEncoding.codings.len - 1 && mem_eq(loop.it.coding, mkString("chunked"))) {
+                // printf("BAD B\n");
+                context.statusCode = 400;
+                context.error = HTTPERR_BAD_TRANSFER_CODING;
+                Handle(&context, connection->router->handler_badRequest);
+                return false;
+            }
+
+            if(
+            !mem_eq(loop.it.coding, mkString("chunked")) &&
+            // !mem_eq(loop.it.coding, mkString("gzip")) &&
+            true) {
+                context.statusCode = 501;
+                context.error = HTTPERR_UNKNOWN_TRANSFER_CODING;
+                Handle(&context, connection->router->handler_notImplemented);
+                return false;
+            }
+        }
+    }
+
+    if(containsClose)
+        { connectionPersists = false; }
+    // NOTE: this seems to be as per RFC-9112, but Firefox automatically starts
+    // a new connection even though I send version 1.1
+
+    // NOTE: huh, now it doesnt?? did i test it wrong or what the hell is happening
+    else if(requestLine.version.value >= Http_getVersion(1, 1) || containsKeepalive)
+        { connectionPersists = true; }
+    else
+        { connectionPersists = false; }
+
+    // TODO: we have the headers, including the Host, now
+    // we reconstruct the target URI and parse it
+
+    // TODO: with the target URI reconstructed, we can now,
+    // *gulp*, convert the path+query back into a string to
+    // feed to the router
+    // Should I extend the Uri/UriPath structs to include a
+    // string representation? I probably should
+
+    Map routeMatches = mkMap();
+    context = ((RouteContext){
+        .s = s,
+        .clientVersion = requestLine.version,
+        .method = requestLine.method,
+        .headers = &headers,
+
+        .originalPath = requestLine.target.path,
+        .relatedPath = requestLine.target.path,
+
+        .mainRouter = connection->router,
+        .lastRouter = connection->router,
+
+        .persist = true,
+
+        .query = requestLine.target.query,
+
+        .matches = &routeMatches,
+    });
+
+    // MapIter iter = map_iter(&headers);
+    // while(!map_iter_end(&iter)) {
+    //     MapEntry entry = map_iter_next(&iter);
+    //     HttpH_Unknown header = memExtract(HttpH_Unknown, entry.val);
+    //     String value = header.value;
+    //     value = value;
+    //
+    //     // printf("HEADER NAME: %.*s\n", (int)entry.key.len, entry.key.s);
+    //     // printf("HEADER VALUE: %.*s\n", (int)value.len, value.s);
+    //     // printf("-----------\n");
+    // }
+
+    Route route = getRoute(connection->router, &context);
+    if(isNone(route)) {
+        if(isFail(route, ROUTE_ERR_FOUND_URI)) {
+            Log_format2(LOG_ERROR, "<%d> Couldn't find an appropriate route with this method", connection->id);
+
+            context.statusCode = 405;
+            context.allowedMethodMask = route.methodMask;
+            checkDo(Handle(&context, connection->router->handler_badRequest), return false);
+            tryDo(stream_writeFlush(s), return false);
+            return connectionPersists;
+        }
+        else {
+            Log_format2(LOG_ERROR, "<%d> Couldn't find an appropriate route", connection->id);
+
+            context.statusCode = 404;
+            checkDo(Handle(&context, connection->router->handler_routeNotFound), return false);
+            tryDo(stream_writeFlush(s), return false);
+            return connectionPersists;
+        }
+    }
+
+    Log_format2(LOG_INFO, "<%d> Trying to handle the route", connection->id);
+    if(!Handle(&context, route.handler)) {
+        Log_format1(LOG_ERROR, "<%d> Couldn't handle the route", connection->id);
+
+        context.statusCode = 500;
+        context.persist = false;
+        Handle(&context, connection->router->handler_internalError);
+        return false;
+    }
+    Log_format2(LOG_INFO, "<%d> Route handled successfully", connection->id);
+
+    if(!context.persist) connectionPersists = false;
+
+    if(isNone(stream_writeFlush(s))) {
+        Log_format1(LOG_ERROR, "<%d> Couldn't flush the buffer", connection->id);
+        return false;
+    }
+
+    return connectionPersists;
+}
+
+bool Coil_HandleRequest(Connection *connection, Stream *s) {
+    ALLOC_PUSH(mkAlloc_LinearExpandableA(ALLOC_GLOBAL));
+    bool connectionPersists = Coil_HandleRequestInternal(connection, s);
+    ALLOC_POP();
+    return connectionPersists;
+}
+
+// NOTE: handles requests until the connection is closed, and closes it
+void Coil_ServeConnection(Connection *connection, Stream *s) {
+    bool connectionPersists = false;
+
+    do {
+        // Timeout handling
+        MaybeChar any = stream_peekChar(s);
+        if(isNone(any)) break;
+
+        connectionPersists = Coil_HandleRequest(connection, s);
+    } while(connectionPersists);
+
+    Log_format1(LOG_INFO, "<%d> Closing connection", connection->id);
+    stream_writeFlush(s);
+    stream_writeSettle(s);
+    close(connection->clientSock);
+}
+
+void Coil_SetRecvTimeout(int sock) {
+    // https://stackoverflow.com/questions/2876024/linux-is-there-a-read-or-recv-from-socket-with-timeout
+    struct timeval timeout = { .tv_sec = 60 }; // for some bizarre reason this works only half the time
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout, sizeof(struct timeval));
+}
+
+void *threadRoutine(void *_connection) {
+    Connection connection = *(Connection *)_connection;
+    Free(_connection);
+
+    Log_format1(LOG_INFO, "<%d> Started thread routine", connection.id);
+
+    Coil_SetRecvTimeout(connection.clientSock);
+
+    Stream s = mkStreamFd(connection.clientSock);
+    stream_wbufferEnable(&s, 4096);
+    stream_rbufferEnable(&s, 4096);
+
+    Coil_ServeConnection(&connection, &s);
+
+    Free(s.wbuffer.s);
+    Free(s.rbuffer.s);
+
+    return null;
+}
+
+#define CoilCallback(name, body) \
+bool name(RouteContext *context, Mem arg) { context = context; arg = arg; { body; } }
+
+#define CoilCallbackStr(name, arg, body) \
+bool name(RouteContext *context, String arg) { context = context; arg = arg; { body; } }
+
+#define CoilCallbackArg(name, argty, argname, body) \
+bool name(RouteContext *context, Mem arg) { context = context; arg = arg; argty *argname = memExtractPtr(argty, arg); { body; } }
+
+CoilCallbackArg(CoilCB_fileTree, FileTreeRouter, fileTree, {
+    File file = getFileTree(fileTree, context->relatedPath);
+    if(isNone(file)) {
+        return Coil_NotFound(context);
+    }
+
+    bool result = Coil_RespondFile(context, file);
+    releaseFile(file);
+    checkRet(result);
     // Stream fileStream = mkStreamStr(file.data);
     // Dynar(HttpTransferCoding) codings = mkDynar(HttpTransferCoding);
     // cont(result) Coil_AddContentStream(context, &fileStream, &codings);
@@ -635,8 +1266,7 @@ CoilCallbackStr(CoilCB_file, filePath, {
         return Coil_NotFound(context);
     }
 
-    checkRet(Coil_StatusLine(context, 200));
-    checkRet(Coil_AddFile(context, file));
+    checkRet(Coil_RespondFile(context, file));
 
     return true;
 })
@@ -647,6 +1277,10 @@ CoilCallbackStr(CoilCB_data, data, {
     return true;
 })
 
+CoilCallbackArg(CoilCB_cached, CoilCachedRoute, route, {
+    return Coil_RespondCached(context, route);
+})
+
 CoilCallback(CoilCB_error, {
     HttpStatusCode statusCode = context->statusCode;
     checkRet(Coil_StatusLine(context, statusCode));
@@ -689,6 +1323,9 @@ CoilCallback(CoilCB_error, {
         case 501:
             content = mkString("<html><body><h1>501 Not Implemented</h1><h2>This very cool feature is not implemented here :(</h2></body></html>");
             break;
+        case 503:
+            content = mkString("<html><body><h1>503 Service Unavailable</h1><h2>Too many people here, try again later</h2></body></html>");
+            break;
     }
 
     checkRet(Coil_AddContent(context, content));
@@ -700,7 +1337,10 @@ typedef struct {
     int value;
 } MaybeSocket;
 
-MaybeSocket Coil_GetSocket(u16 port, int backlog) {
+// NOTE: with reusePort, several sockets can listen on the same port,
+// and the kernel balances incoming connections between them
+#define Coil_GetSocket(port, backlog) Coil_GetSocketR((port), (backlog), false)
+MaybeSocket Coil_GetSocketR(u16 port, int backlog, bool reusePort) {
     int result;
 
     int sock = result = socket(AF_INET, SOCK_STREAM, 0);
@@ -712,6 +1352,17 @@ MaybeSocket Coil_GetSocket(u16 port, int backlog) {
 
     Log_format2(LOG_INFO, "Created a socket. fd = %d", sock);
 
+    if(reusePort) {
+        int enable = 1;
+        result = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+
+        if(result == -1) {
+            Log_format0(LOG_ERROR, "Couldn't set SO_REUSEPORT on the socket. errno = %d", errno);
+            close(sock);
+            return none(MaybeSocket);
+        }
+    }
+
     struct sockaddr_in addr = (struct sockaddr_in){
         .sin_family = AF_INET,
         .sin_port = htons(port),
@@ -725,6 +1376,7 @@ MaybeSocket Coil_GetSocket(u16 port, int backlog) {
 
     if(result == -1) {
         Log_format0(LOG_ERROR, "Couldn't bind the socket. errno = %d", errno);
+        close(sock);
         return none(MaybeSocket);
     }
 
@@ -734,6 +1386,7 @@ MaybeSocket Coil_GetSocket(u16 port, int backlog) {
 
     if(result == -1) {
         Log_format0(LOG_ERROR, "Couldn't make the socket listen. errno = %d", errno);
+        close(sock);
         return none(MaybeSocket);
     }
 
@@ -755,73 +1408,812 @@ Router mkRouter() {
     return router;
 }
 
-bool Coil_Run(int sock, Router *router) {
-    // NOTE: if client dies, we likely encounter an error on
-    // our next read() in threadRoutine. We then goto cleanup and
-    // try to flush the stream via write(), causing SIGPIPE
+bool Coil_SpawnDetached(void *(*routine)(void *), void *arg) {
+    pthread_t thread;
+    pthread_attr_t threadAttr;
+    int result = pthread_attr_init(&threadAttr);
+    if(result != 0) return false;
+    result = pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+    if(result == 0) result = pthread_create(&thread, &threadAttr, routine, arg);
+    pthread_attr_destroy(&threadAttr);
+    return result == 0;
+}
+
+// NOTE: if client dies, we likely encounter an error on
+// our next read() in threadRoutine. We then goto cleanup and
+// try to flush the stream via write(), causing SIGPIPE
+void Coil_IgnoreSigpipe(struct sigaction *old) {
     struct sigaction sigHandlerNone = {
         .sa_handler = SIG_IGN,
     };
-    struct sigaction sigHandlerOld;
-    int result = sigaction(SIGPIPE, &sigHandlerNone, &sigHandlerOld);
+    int result = sigaction(SIGPIPE, &sigHandlerNone, old);
     if(result != 0) {
         Log_format0(LOG_WARNING, "Couldn't replace SIGPIPE handler. errno = %d", errno);
         // NOTE: does this really warrant quitting?
-        // return false;
     }
+}
+
+void Coil_LogAccepted(Connection connection) {
+    if(Log_is2) {
+        u32 ip = connection.addr.sin_addr.s_addr;
+        u16 port = connection.addr.sin_port;
+        u8 a = ((ip & 0x000000ff) >> 0);
+        u8 b = ((ip & 0x0000ff00) >> 8);
+        u8 c = ((ip & 0x00ff0000) >> 16);
+        u8 d = ((ip & 0xff000000) >> 24);
+
+        Log_format2(LOG_INFO, "<%d> Accepted client. IP: %d.%d.%d.%d:%d", connection.id, a, b, c, d, port);
+    }
+    else {
+        Log_format0(LOG_INFO, "<%d> Accepted client", connection.id);
+    }
+}
+
+// NOTE: blocks until a client connects, clientSock is -1 if accept() failed.
+// connectionId can be shared by several accept loops, see Coil_RunSharded
+Connection Coil_AcceptConnection(int sock, Router *router, usz *connectionId) {
+    struct sockaddr_in caddr = {0};
+    socklen_t caddrLen = sizeof(struct sockaddr_in);
+    // TODO: figure out if this works for IPv6
+    int csock = accept(sock, (struct sockaddr *)&caddr, &caddrLen);
+
+    Connection connection = {
+        .addr = caddr,
+        .clientSock = csock,
+        .router = router,
+        .id = __atomic_fetch_add(connectionId, 1, __ATOMIC_RELAXED),
+    };
+
+    if(csock == -1) {
+        Log_format0(LOG_ERROR, "<%d> Couldn't accept client. errno = %d", connection.id, errno);
+        return connection;
+    }
+
+    Coil_LogAccepted(connection);
+    return connection;
+}
+
+// NOTE: runs until the socket stops listening, e.g. after shutdown()
+bool Coil_acceptLoop(int sock, Router *router, usz *connectionId) {
+    struct sigaction sigHandlerOld;
+    Coil_IgnoreSigpipe(&sigHandlerOld);
 
     Log_message0(LOG_INFO, "Request loop started");
 
+    while(true) {
+        Connection _connection = Coil_AcceptConnection(sock, router, connectionId);
+        if(_connection.clientSock == -1 && errno == EINVAL) break;
+        if(_connection.clientSock == -1) continue;
+
+        AllocateVarC(Connection, connection, _connection, ALLOC_GLOBAL);
+
+        if(!Coil_SpawnDetached(threadRoutine, connection)) {
+            Log_format0(LOG_ERROR, "<%d> Couldn't start thread routine", _connection.id);
+            FreeC(ALLOC_GLOBAL, connection);
+            close(_connection.clientSock);
+        }
+    }
+
+    int result = sigaction(SIGPIPE, &sigHandlerOld, null);
+    if(result != 0) return false;
+
+    close(sock);
+
+    return true;
+}
+
+bool Coil_Run(int sock, Router *router) {
     usz connectionId = 1000;
+    return Coil_acceptLoop(sock, router, &connectionId);
+}
+
+// ======================
+// Sharded mode
+// ======================
+
+typedef struct {
+    int sock;
+    Router *router;
+    usz *connectionId;
+} CoilShard;
+
+void *Coil_shardRoutine(void *_shard) {
+    CoilShard *shard = _shard;
+    Coil_acceptLoop(shard->sock, shard->router, shard->connectionId);
+    return null;
+}
+
+// NOTE: opens a separate SO_REUSEPORT listener for each of the shardCount
+// routers, each with its own accept loop (see Coil_Run) on its own thread,
+// so accepting connections isn't serialized through a single socket.
+// The connection ids are shared between the shards, so they don't collide
+// in the logs. getCoreCount() is a sensible amount of shards
+bool Coil_RunSharded(u16 port, int backlog, Router **routers, usz shardCount) {
+    if(shardCount == 0) return false;
+
+    CoilShard *shards = (CoilShard *)AllocateBytesC(ALLOC_GLOBAL, sizeof(CoilShard) * shardCount + sizeof(usz)).s;
+    if(shards == null) return false;
+
+    usz *connectionId = (usz *)(shards + shardCount);
+    *connectionId = 1000;
+
+    for(usz i = 0; i < shardCount; i++) {
+        MaybeSocket sockM = Coil_GetSocketR(port, backlog, true);
+        if(isNone(sockM)) {
+            for(usz j = 0; j < i; j++) close(shards[j].sock);
+            FreeC(ALLOC_GLOBAL, shards);
+            return false;
+        }
 
+        shards[i] = (CoilShard){ .sock = sockM.value, .router = routers[i], .connectionId = connectionId };
+    }
+
+    Log_format0(LOG_INFO, "Starting %d shards on port %d", shardCount, port);
+
+    for(usz i = 1; i < shardCount; i++) {
+        if(Coil_SpawnDetached(Coil_shardRoutine, &shards[i])) continue;
+
+        Log_format0(LOG_ERROR, "Couldn't start shard %d", i);
+
+        // NOTE: the shards that did start stop accepting once their socket
+        // is shut down, and close it themselves. They might still be
+        // touching the shards, so those aren't freed
+        for(usz j = 1; j < i; j++) shutdown(shards[j].sock, SHUT_RDWR);
+        for(usz j = i; j < shardCount; j++) close(shards[j].sock);
+        close(shards[0].sock);
+        return false;
+    }
+
+    return Coil_acceptLoop(shards[0].sock, shards[0].router, connectionId);
+}
+
+// ======================
+// Evented mode
+// ======================
+
+#ifndef COIL_IDLE_TIMEOUT
+#define COIL_IDLE_TIMEOUT 60
+#endif
+
+// NOTE: requests are only handled once they've fully arrived, so the
+// read buffer grows to fit them, up to this. A request that doesn't fit
+// is handled anyways, and fails once it runs out of what has arrived
+#ifndef COIL_EVENT_REQUEST_MAX
+#define COIL_EVENT_REQUEST_MAX (8 << 20)
+#endif
+
+#define COIL_EVENT_BUFFER 4096
+#define COIL_EVENTS_MAX 64
+
+typedef struct CoilEventLoop CoilEventLoop;
+typedef struct CoilEventConnection CoilEventConnection;
+struct CoilEventConnection {
+    Connection connection;
+    Stream s;
+    CoilEventLoop *loop;
+
+    // NOTE: what epoll waits for on this connection
+    u32 events;
+    // NOTE: the connection is closed once its output has been sent
+    bool closing;
+
+    time_t lastActive;
+    CoilEventConnection *prev;
+    CoilEventConnection *next;
+};
+
+struct CoilEventLoop {
+    int epoll;
+
+    // NOTE: ordered by last activity, so idle connections are closed from the head
+    pthread_mutex_t lock;
+    CoilEventConnection *head;
+    CoilEventConnection *tail;
+};
+
+void Coil_eventListRemove(CoilEventLoop *loop, CoilEventConnection *ec) {
+    if(ec->prev) ec->prev->next = ec->next;
+    else         loop->head = ec->next;
+    if(ec->next) ec->next->prev = ec->prev;
+    else         loop->tail = ec->prev;
+    ec->prev = null;
+    ec->next = null;
+}
+
+void Coil_eventListAppend(CoilEventLoop *loop, CoilEventConnection *ec) {
+    ec->lastActive = time(null);
+    ec->prev = loop->tail;
+    ec->next = null;
+    if(loop->tail) loop->tail->next = ec;
+    else           loop->head = ec;
+    loop->tail = ec;
+}
+
+// NOTE: for connections that aren't in the list, either because they
+// never made it there, or because they've already been taken out of it
+void Coil_eventFree(CoilEventLoop *loop, CoilEventConnection *ec) {
+    Log_format1(LOG_INFO, "<%d> Closing connection", ec->connection.id);
+
+    epoll_ctl(loop->epoll, EPOLL_CTL_DEL, ec->connection.clientSock, null);
+    stream_wqueueClear(&ec->s);
+    close(ec->connection.clientSock);
+
+    FreeC(ALLOC_GLOBAL, ec->s.wbuffer.s);
+    FreeC(ALLOC_GLOBAL, ec->s.rbuffer.s);
+    FreeC(ALLOC_GLOBAL, ec);
+}
+
+void Coil_eventClose(CoilEventLoop *loop, CoilEventConnection *ec) {
+    pthread_mutex_lock(&loop->lock);
+    Coil_eventListRemove(loop, ec);
+    pthread_mutex_unlock(&loop->lock);
+
+    Coil_eventFree(loop, ec);
+}
+
+// NOTE: how much of mem the chunked content at its start takes up, with
+// the trailer section, or 0 if it hasn't fully arrived. Malformed content
+// counts as complete, for the parser to reject
+usz Coil_ChunkedLength(Mem mem) {
+    Stream s = mkStreamStr(mem);
     while(true) {
-        struct sockaddr_in caddr = {0};
-        socklen_t caddrLen = sizeof(struct sockaddr_in);
-        // TODO: figure out if this works for IPv6
-        int csock = accept(sock, (struct sockaddr *)&caddr, &caddrLen);
-
-        int result;
-
-        Connection _connection = {
-            .addr = caddr,
-            .clientSock = csock,
-            .router = router,
-            .id = connectionId,
-        };
-        connectionId += 1;
-
-        if(Log_is2) {
-            u32 ip = caddr.sin_addr.s_addr;
-            u16 port = caddr.sin_port;
-            u8 a = ((ip & 0x000000ff) >> 0);
-            u8 b = ((ip & 0x0000ff00) >> 8);
-            u8 c = ((ip & 0x00ff0000) >> 16);
-            u8 d = ((ip & 0xff000000) >> 24);
-
-            Log_format2(LOG_INFO, "<%d> Accepted client. IP: %d.%d.%d.%d:%d", _connection.id, a, b, c, d, port);
+        u64 chunkLength;
+        if(s.i == mem.len) return 0;
+        if(!parseU64FromHex(&s, &chunkLength, false)) return mem.len;
+
+        // NOTE: chunk extensions
+        MaybeChar c;
+        while(isJust(c = stream_popChar(&s)) && c.value != HTTP_LF) {}
+        if(isNone(c)) return 0;
+
+        if(chunkLength == 0) break;
+        if(chunkLength > mem.len) return 0;
+        if(s.i + chunkLength + 2 > mem.len) return 0;
+        s.i += chunkLength + 2;
+    }
+
+    // NOTE: the trailer section ends with an empty line
+    while(true) {
+        usz lineStart = s.i;
+        MaybeChar c;
+        while(isJust(c = stream_popChar(&s)) && c.value != HTTP_LF) {}
+        if(isNone(c)) return 0;
+        if(s.i - lineStart <= 2) return s.i;
+    }
+}
+
+// NOTE: whether the buffered bytes contain the whole next request, going by
+// its Content-Length or chunked framing, so that handling it won't have
+// to wait on the client. A head that doesn't make sense counts as complete,
+// for the parser to reject. If the buffer can't grow anymore, we can't wait
+// for more anyways
+bool Coil_HasRequest(Stream *s) {
+    if(s->rbufferConsumed == 0 && s->rbufferSize == s->rbuffer.len && s->rbuffer.len >= COIL_EVENT_REQUEST_MAX) return true;
+
+    stream_rbufferUnpeek(s);
+    Mem buffered = mkMem(s->rbuffer.s + s->rbufferConsumed, s->rbufferSize - s->rbufferConsumed);
+
+    String terminator = mkString("\r\n\r\n");
+    usz headLen = 0;
+    for(usz i = 0; i + terminator.len <= buffered.len; i++) {
+        if(mem_eq(mkMem(buffered.s + i, terminator.len), terminator)) {
+            headLen = i + terminator.len;
+            break;
         }
-        else {
-            Log_format0(LOG_INFO, "<%d> Accepted client", _connection.id);
+    }
+    if(headLen == 0) return false;
+
+    u64 contentLength = 0;
+    bool chunked = false;
+
+    // NOTE: the request-line is skipped, and so is the last, empty, line
+    usz lineStart = 0;
+    for(usz i = 0; i + 1 < headLen; i++) {
+        if(buffered.s[i] != HTTP_CR || buffered.s[i + 1] != HTTP_LF) continue;
+
+        String line = mkMem(buffered.s + lineStart, i - lineStart);
+        lineStart = i + 2;
+
+        usz colon = 0;
+        while(colon < line.len && line.s[colon] != ':') colon += 1;
+        if(colon == line.len) continue;
+
+        byte nameBuffer[32];
+        if(colon > sizeof(nameBuffer)) continue;
+        String name = mkMem(nameBuffer, colon);
+        mem_copy(name, line);
+        toLower(name);
+
+        Stream value = mkStreamStr(memIndex(line, colon + 1));
+        MaybeChar c;
+        while(isJust(c = stream_peekChar(&value)) && (c.value == ' ' || c.value == '\t')) stream_popChar(&value);
+
+        if(mem_eq(name, mkString("content-length"))) {
+            if(!parseU64FromDecimal(&value, &contentLength, false)) return true;
         }
+        else if(mem_eq(name, mkString("transfer-encoding"))) {
+            // NOTE: the content is only chunked if that's the last coding,
+            // and otherwise its length can't be known, see Coil_ContentReaderInit
+            String codings = memIndex(line, colon + 1);
+            usz codingStart = codings.len;
+            while(codingStart > 0 && codings.s[codingStart - 1] != ',') codingStart -= 1;
+
+            String coding = memIndex(codings, codingStart);
+            while(coding.len > 0 && (coding.s[0] == ' ' || coding.s[0] == '\t')) coding = memIndex(coding, 1);
+            while(coding.len > 0 && (coding.s[coding.len - 1] == ' ' || coding.s[coding.len - 1] == '\t')) coding.len -= 1;
+
+            byte codingBuffer[sizeof("chunked") - 1];
+            if(coding.len != sizeof(codingBuffer)) return true;
+            String lower = mkMem(codingBuffer, coding.len);
+            mem_copy(lower, coding);
+            toLower(lower);
+            if(!mem_eq(lower, mkString("chunked"))) return true;
+
+            chunked = true;
+        }
+    }
 
-        AllocateVarC(Connection, connection, _connection, ALLOC_GLOBAL);
+    Mem content = memIndex(buffered, headLen);
+    if(chunked) return Coil_ChunkedLength(content) != 0;
+    return content.len >= contentLength;
+}
+
+// NOTE: reads whatever has arrived, growing the read buffer while
+// there's more, and the request in it isn't complete
+ResultRead Coil_eventFill(Stream *s) {
+    while(true) {
+        ResultRead fill = stream_rbufferFill(s);
+        if(isNone(fill) || fill.partial) return fill;
+        if(s->rbuffer.len >= COIL_EVENT_REQUEST_MAX || Coil_HasRequest(s)) return fill;
+
+        // NOTE: stream_rbufferFill has moved what's unconsumed to the start
+        usz len = s->rbuffer.len * 2;
+        if(len > COIL_EVENT_REQUEST_MAX) len = COIL_EVENT_REQUEST_MAX;
+        Mem rbuffer = AllocateBytesC(ALLOC_GLOBAL, len);
+        if(isNull(rbuffer)) return fill;
+
+        mem_copy(rbuffer, memLimit(s->rbuffer, s->rbufferSize));
+        FreeC(ALLOC_GLOBAL, s->rbuffer.s);
+        s->rbuffer = rbuffer;
+    }
+}
+
+// NOTE: gives back the memory of a read buffer that grew for a large request
+void Coil_eventShrink(Stream *s) {
+    usz unconsumed = s->rbufferSize - s->rbufferConsumed;
+    if(s->rbuffer.len <= COIL_EVENT_BUFFER || unconsumed > COIL_EVENT_BUFFER) return;
 
-        pthread_t thread;
-        pthread_attr_t threadAttr;
-        result = pthread_attr_init(&threadAttr);
-        result = pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
-        result = pthread_create(&thread, &threadAttr, threadRoutine, connection);
-        result = pthread_attr_destroy(&threadAttr);
-        if(result) {}
+    Mem rbuffer = AllocateBytesC(ALLOC_GLOBAL, COIL_EVENT_BUFFER);
+    if(isNull(rbuffer)) return;
+
+    mem_copy(rbuffer, mkMem(s->rbuffer.s + s->rbufferConsumed, unconsumed));
+    FreeC(ALLOC_GLOBAL, s->rbuffer.s);
+    s->rbuffer = rbuffer;
+    s->rbufferSize = unconsumed;
+    s->rbufferConsumed = 0;
+}
+
+// NOTE: sends what's pending, and then handles every request that has fully
+// arrived, until one of the responses can't be sent right away. Nothing
+// here waits on the client. Returns whether the connection should be kept
+bool Coil_eventServe(CoilEventConnection *ec) {
+    if(!stream_wqueueSend(&ec->s)) return false;
+    if(stream_wqueuePending(&ec->s)) return true;
+    if(ec->closing) return false;
+
+    ResultRead fill = Coil_eventFill(&ec->s);
+
+    // NOTE: the client might've closed its side right after sending
+    // its requests, so we still try to handle whatever we've got
+    while(Coil_HasRequest(&ec->s)) {
+        if(!Coil_HandleRequest(&ec->connection, &ec->s)) {
+            // NOTE: an error response is still sent before closing,
+            // what doesn't go out right away is queued
+            stream_writeFlush(&ec->s);
+            ec->closing = true;
+            break;
+        }
+
+        // NOTE: the responses have to go out in order, so the next request
+        // waits until this one's has been sent
+        if(stream_wqueuePending(&ec->s)) break;
+        if(isJust(fill)) fill = Coil_eventFill(&ec->s);
+    }
+
+    Coil_eventShrink(&ec->s);
+    if(stream_wqueuePending(&ec->s)) return true;
+    return !ec->closing && isJust(fill);
+}
+
+// NOTE: while a response is pending, only waits for the socket to become
+// writable, so that the client can't make us buffer more of its requests
+bool Coil_eventWatch(CoilEventLoop *loop, CoilEventConnection *ec) {
+    u32 events = stream_wqueuePending(&ec->s) ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+    if(events == ec->events) return true;
+
+    struct epoll_event event = {
+        .events = events,
+        .data.ptr = ec,
+    };
+
+    if(epoll_ctl(loop->epoll, EPOLL_CTL_MOD, ec->connection.clientSock, &event) == -1) return false;
+    ec->events = events;
+    return true;
+}
+
+// NOTE: the connection is taken out of the list under the same lock
+// that it's checked under, since the accept thread appends to it
+void Coil_eventCloseIdle(CoilEventLoop *loop) {
+    time_t now = time(null);
+    while(true) {
+        pthread_mutex_lock(&loop->lock);
+        CoilEventConnection *ec = loop->head;
+        if(ec != null && ec->lastActive + COIL_IDLE_TIMEOUT <= now) Coil_eventListRemove(loop, ec);
+        else                                                          ec = null;
+        pthread_mutex_unlock(&loop->lock);
+
+        if(ec == null) break;
+        Coil_eventFree(loop, ec);
+    }
+}
+
+void *Coil_eventLoopRoutine(void *_loop) {
+    CoilEventLoop *loop = _loop;
+    struct epoll_event events[COIL_EVENTS_MAX];
+
+    while(true) {
+        int count = epoll_wait(loop->epoll, events, COIL_EVENTS_MAX, 1000);
+        if(count < 0 && errno != EINTR) {
+            Log_format0(LOG_ERROR, "Event loop failed. errno = %d", errno);
+            return null;
+        }
+
+        for(int i = 0; i < count; i++) {
+            CoilEventConnection *ec = events[i].data.ptr;
+
+            if(!Coil_eventServe(ec) || !Coil_eventWatch(loop, ec)) {
+                Coil_eventClose(loop, ec);
+                continue;
+            }
+
+            pthread_mutex_lock(&loop->lock);
+            Coil_eventListRemove(loop, ec);
+            Coil_eventListAppend(loop, ec);
+            pthread_mutex_unlock(&loop->lock);
+        }
+
+        Coil_eventCloseIdle(loop);
     }
 
-    result = sigaction(SIGPIPE, &sigHandlerOld, null);
+    return null;
+}
+
+// NOTE: makes an accepted connection non-blocking, and hands it to the
+// loop. It's only put in the list once epoll has it, and the lock is held
+// in between, so that the loop can't see it half-added. If anything
+// fails, the connection is closed
+void Coil_eventAdd(CoilEventLoop *loop, Connection connection, u32 events) {
+    int flags = fcntl(connection.clientSock, F_GETFL, 0);
+    if(flags == -1 || fcntl(connection.clientSock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        Log_format0(LOG_ERROR, "<%d> Couldn't make the socket non-blocking. errno = %d", connection.id, errno);
+        close(connection.clientSock);
+        return;
+    }
+
+    CoilEventConnection _ec = {
+        .connection = connection,
+        .s = mkStreamFdQueued(connection.clientSock),
+        .loop = loop,
+        .events = events,
+    };
+    stream_wbufferEnableC(&_ec.s, AllocateBytesC(ALLOC_GLOBAL, COIL_EVENT_BUFFER));
+    stream_rbufferEnableC(&_ec.s, AllocateBytesC(ALLOC_GLOBAL, COIL_EVENT_BUFFER));
+
+    AllocateVarC(CoilEventConnection, ec, _ec, ALLOC_GLOBAL);
+
+    struct epoll_event event = {
+        .events = ec->events,
+        .data.ptr = ec,
+    };
+
+    pthread_mutex_lock(&loop->lock);
+    bool registered = epoll_ctl(loop->epoll, EPOLL_CTL_ADD, connection.clientSock, &event) != -1;
+    if(registered) Coil_eventListAppend(loop, ec);
+    pthread_mutex_unlock(&loop->lock);
+
+    if(!registered) {
+        Log_format0(LOG_ERROR, "<%d> Couldn't register the connection. errno = %d", connection.id, errno);
+        Coil_eventFree(loop, ec);
+    }
+}
+
+// NOTE: instead of a thread per connection, a fixed amount of loop threads
+// (loopCount, or one per core if 0) wait on all connections via epoll. A
+// request is only parsed and dispatched once it has fully arrived, and
+// responses that the client doesn't take right away are queued, and sent
+// as the socket becomes writable, so a slow client never holds up a loop
+bool Coil_RunEvented(int sock, Router *router, usz loopCount) {
+    if(loopCount == 0) loopCount = getCoreCount();
+
+    CoilEventLoop *loops = (CoilEventLoop *)AllocateBytesC(ALLOC_GLOBAL, sizeof(CoilEventLoop) * loopCount).s;
+    if(loops == null) return false;
+
+    for(usz i = 0; i < loopCount; i++) {
+        loops[i] = (CoilEventLoop){ .epoll = epoll_create1(0) };
+        if(loops[i].epoll == -1) {
+            Log_format0(LOG_ERROR, "Couldn't create an epoll instance. errno = %d", errno);
+            for(usz j = 0; j < i; j++) close(loops[j].epoll);
+            FreeC(ALLOC_GLOBAL, loops);
+            return false;
+        }
+        pthread_mutex_init(&loops[i].lock, null);
+    }
+
+    // NOTE: loops that were started can't be stopped, so if some fail
+    // to start, we go on with the ones that did
+    usz started = 0;
+    for(; started < loopCount; started++) {
+        if(!Coil_SpawnDetached(Coil_eventLoopRoutine, &loops[started])) {
+            Log_message0(LOG_ERROR, "Couldn't start an event loop thread");
+            break;
+        }
+    }
+
+    for(usz i = started; i < loopCount; i++) {
+        close(loops[i].epoll);
+        pthread_mutex_destroy(&loops[i].lock);
+    }
+
+    if(started == 0) {
+        FreeC(ALLOC_GLOBAL, loops);
+        return false;
+    }
+    loopCount = started;
+
+    struct sigaction sigHandlerOld;
+    Coil_IgnoreSigpipe(&sigHandlerOld);
+
+    Log_format0(LOG_INFO, "Evented request loop started with %d loop threads", loopCount);
+
+    usz connectionId = 1000;
+    usz nextLoop = 0;
+
+    while(true) {
+        Connection connection = Coil_AcceptConnection(sock, router, &connectionId);
+        if(connection.clientSock == -1) continue;
+
+        Coil_eventAdd(&loops[nextLoop], connection, EPOLLIN | EPOLLRDHUP);
+        nextLoop = (nextLoop + 1) % loopCount;
+    }
+
+    int result = sigaction(SIGPIPE, &sigHandlerOld, null);
     if(result != 0) return false;
 
-    int closeResult = close(sock);
-    // printf("CLOSE %d\n", closeResult);
+    close(sock);
 
     return true;
 }
 
+// ======================
+// Pooled mode
+// ======================
+
+#define COIL_PARKED_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLONESHOT)
+
+// NOTE: responds 503 without even reading the request. The context
+// doesn't persist, so the response says the connection gets closed
+void Coil_RefuseConnection(Connection *connection) {
+    byte buffer[1024];
+    Stream s = mkStreamFd(connection->clientSock);
+    stream_wbufferEnableC(&s, mkMem(buffer, 1024));
+
+    RouteContext context = {
+        .s = &s,
+        .mainRouter = connection->router,
+        .lastRouter = connection->router,
+        .statusCode = 503,
+    };
+
+    Handle(&context, connection->router->handler_internalError);
+    stream_writeFlush(&s);
+}
+
+// NOTE: connections that are waiting on the client are parked in an
+// epoll set, and are only handed to a worker once there's something to
+// do, so that idle keep-alive connections and slow clients never hold
+// one up. The workers serve them the same way the event loops do
+typedef struct {
+    CoilEventLoop loop;
+    CoilPool *pool;
+} CoilParking;
+
+// NOTE: the connection goes back into the list and epoll under the lock,
+// like in Coil_eventAdd. EPOLLONESHOT keeps it from being handed to
+// another worker while one is still serving it
+bool Coil_pooledPark(CoilEventConnection *ec) {
+    CoilEventLoop *loop = ec->loop;
+    struct epoll_event event = {
+        .events = stream_wqueuePending(&ec->s) ? EPOLLOUT | EPOLLONESHOT : COIL_PARKED_EVENTS,
+        .data.ptr = ec,
+    };
+
+    pthread_mutex_lock(&loop->lock);
+    bool parked = epoll_ctl(loop->epoll, EPOLL_CTL_MOD, ec->connection.clientSock, &event) != -1;
+    if(parked) Coil_eventListAppend(loop, ec);
+    pthread_mutex_unlock(&loop->lock);
+
+    return parked;
+}
+
+void *Coil_pooledRoutine(void *_ec) {
+    CoilEventConnection *ec = _ec;
+    if(!Coil_eventServe(ec) || !Coil_pooledPark(ec)) Coil_eventFree(ec->loop, ec);
+    return null;
+}
+
+void *Coil_parkingRoutine(void *_parking) {
+    CoilParking *parking = _parking;
+    CoilEventLoop *loop = &parking->loop;
+    struct epoll_event events[COIL_EVENTS_MAX];
+
+    while(true) {
+        int count = epoll_wait(loop->epoll, events, COIL_EVENTS_MAX, 1000);
+        if(count < 0 && errno != EINTR) {
+            Log_format0(LOG_ERROR, "Parking loop failed. errno = %d", errno);
+            return null;
+        }
+
+        for(int i = 0; i < count; i++) {
+            CoilEventConnection *ec = events[i].data.ptr;
+
+            pthread_mutex_lock(&loop->lock);
+            Coil_eventListRemove(loop, ec);
+            pthread_mutex_unlock(&loop->lock);
+
+            if(!CoilPool_push(parking->pool, ec)) {
+                Log_format0(LOG_WARNING, "<%d> Every worker queue is full, refusing the client", ec->connection.id);
+                // NOTE: can't respond in the middle of another response
+                if(!stream_wqueuePending(&ec->s)) Coil_RefuseConnection(&ec->connection);
+                Coil_eventFree(loop, ec);
+            }
+        }
+
+        Coil_eventCloseIdle(loop);
+    }
+
+    return null;
+}
+
+// NOTE: the workers and the parking thread can't be stopped once
+// they're started, so if the latter fails to start, the pool is left idle
+CoilParking *mkCoilParking(usz workerCount) {
+    CoilParking _parking = { .loop = { .epoll = epoll_create1(0) } };
+    if(_parking.loop.epoll == -1) {
+        Log_format0(LOG_ERROR, "Couldn't create an epoll instance. errno = %d", errno);
+        return null;
+    }
+
+    AllocateVarC(CoilParking, parking, _parking, ALLOC_GLOBAL);
+    pthread_mutex_init(&parking->loop.lock, null);
+
+    parking->pool = mkCoilPool(workerCount, Coil_pooledRoutine);
+    if(parking->pool == null) {
+        Log_message0(LOG_ERROR, "Couldn't start the worker pool");
+    }
+    else if(!Coil_SpawnDetached(Coil_parkingRoutine, parking)) {
+        Log_message0(LOG_ERROR, "Couldn't start the parking thread");
+    }
+    else {
+        return parking;
+    }
+
+    close(parking->loop.epoll);
+    pthread_mutex_destroy(&parking->loop.lock);
+    FreeC(ALLOC_GLOBAL, parking);
+    return null;
+}
+
+// NOTE: instead of a thread per connection, connections are served by a
+// fixed pool of workers (workerCount, or one per core if 0), which steal
+// queued connections from each other when idle. A worker only ever gets
+// a connection that's ready, see CoilParking
+bool Coil_RunPooled(int sock, Router *router, usz workerCount) {
+    CoilParking *parking = mkCoilParking(workerCount);
+    if(parking == null) return false;
+
+    struct sigaction sigHandlerOld;
+    Coil_IgnoreSigpipe(&sigHandlerOld);
+
+    Log_format0(LOG_INFO, "Pooled request loop started with %d workers", parking->pool->workerCount);
+
+    usz connectionId = 1000;
+
+    while(true) {
+        Connection connection = Coil_AcceptConnection(sock, router, &connectionId);
+        if(connection.clientSock == -1) continue;
+
+        Coil_eventAdd(&parking->loop, connection, COIL_PARKED_EVENTS);
+    }
+
+    int result = sigaction(SIGPIPE, &sigHandlerOld, null);
+    if(result != 0) return false;
+
+    close(sock);
+
+    return true;
+}
+
+// ======================
+// io_uring mode
+// ======================
+
+// NOTE: how many accepts are kept in flight at once
+#ifndef COIL_URING_ACCEPTS
+#define COIL_URING_ACCEPTS 16
+#endif
+
+// NOTE: same as Coil_RunPooled, except that accepts are batched through
+// an io_uring. Falls back to Coil_RunPooled if io_uring isn't available
+bool Coil_RunUring(int sock, Router *router, usz workerCount) {
+    Uring ring;
+    if(!uring_init(&ring, COIL_URING_ACCEPTS)) {
+        Log_format0(LOG_WARNING, "Couldn't set up an io_uring, falling back to pooled mode. errno = %d", errno);
+        return Coil_RunPooled(sock, router, workerCount);
+    }
+
+    CoilParking *parking = mkCoilParking(workerCount);
+    if(parking == null) {
+        uring_deinit(&ring);
+        return false;
+    }
+
+    struct sigaction sigHandlerOld;
+    Coil_IgnoreSigpipe(&sigHandlerOld);
+
+    Log_format0(LOG_INFO, "io_uring request loop started with %d workers", parking->pool->workerCount);
+
+    struct sockaddr_in addrs[COIL_URING_ACCEPTS];
+    socklen_t addrLens[COIL_URING_ACCEPTS];
+    for(usz i = 0; i < COIL_URING_ACCEPTS; i++) {
+        addrLens[i] = sizeof(struct sockaddr_in);
+        uring_prepAccept(uring_getSqe(&ring), sock, (struct sockaddr *)&addrs[i], &addrLens[i], i);
+    }
+
+    usz connectionId = 1000;
+
+    while(uring_submitAndWait(&ring, 1)) {
+        struct io_uring_cqe cqe;
+        while(uring_popCqe(&ring, &cqe)) {
+            usz slot = cqe.user_data;
+
+            Connection _connection = {
+                .addr = addrs[slot],
+                .clientSock = cqe.res,
+                .router = router,
+                .id = connectionId,
+            };
+            connectionId += 1;
+
+            addrLens[slot] = sizeof(struct sockaddr_in);
+            uring_prepAccept(uring_getSqe(&ring), sock, (struct sockaddr *)&addrs[slot], &addrLens[slot], slot);
+
+            if(cqe.res < 0) {
+                Log_format0(LOG_ERROR, "<%d> Couldn't accept client. errno = %d", _connection.id, -cqe.res);
+                continue;
+            }
+
+            Coil_LogAccepted(_connection);
+            Coil_eventAdd(&parking->loop, _connection, COIL_PARKED_EVENTS);
+        }
+    }
+
+    Log_format0(LOG_ERROR, "io_uring request loop failed. errno = %d", errno);
+    uring_deinit(&ring);
+
+    sigaction(SIGPIPE, &sigHandlerOld, null);
+    close(sock);
+
+    return false;
+}
+
 #endif // __LIB_COIL
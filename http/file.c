@@ -3,6 +3,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
 
 #include <stream.h>
 #include <compression/gzip.c>
@@ -11,6 +15,9 @@
 
 #include <map.h>
 #include <hashmap.h>
+#include <lru.h>
+
+typedef struct FileEntry FileEntry;
 
 typedef struct {
     bool error;
@@ -24,20 +31,80 @@ typedef struct {
 
     Mem gzip;
     Mem zlib;
+
+    // NOTE: files at least FileStorage.sendfileThreshold bytes large aren't
+    // read into memory (data is null), and are sent straight from the disk
+    // by Coil_AddFile. path is NUL-terminated
+    String path;
+    usz size;
+
+    // NOTE: data is a mapping of the file, see getFileMapped
+    bool mapped;
+
+    // NOTE: set if the file came from a FileStorage cache, in which case
+    // it stays valid until releaseFile is called on it
+    FileEntry *entry;
 } File;
 
 typedef struct {
-    Alloc *alloc;
-
     bool disableCaching;
 
     bool doHash;
     bool doGzip;
     bool doZlib;
 
-    HASHMAP(String, File) hm;
+    // NOTE: cached files are compressed once and served many
+    // times, so this defaults to the best (slowest) level
+    u8 compressionLevel;
+    // NOTE: 0 - one per core. Files from DEFLATE_PARALLEL_MIN (256 KiB) up
+    // to sendfileThreshold are compressed on this many threads, see
+    // Deflate_compressParallel. Files past the threshold aren't compressed
+    usz compressionThreads;
+
+    // NOTE: 0 - always read files into memory
+    usz sendfileThreshold;
+
+    // NOTE: promises that the files are never truncated or rewritten in
+    // place while they're served, only replaced (say, by a rename)
+    bool immutable;
+
+    // NOTE: cached files are mapped instead of read (see getFileMapped),
+    // and aren't hashed or compressed, since that would read them in full.
+    // Only takes effect if the storage is immutable, since a mapped file
+    // that gets truncated kills the process with SIGBUS once it's read.
+    // Mapped bytes don't count against the cache's budget: they're the
+    // page cache's, which the kernel evicts on its own, so a mapped entry
+    // only costs its path
+    bool useMmap;
+
+    // NOTE: a file's cost counts all of its variants, except mapped data
+    LruCache lru;
+
+    // NOTE: see watchFileTree. watchDirs maps the paths back to the
+    // watch descriptors, and is guarded by the lock of watches
+    bool watching;
+    int inotify;
+    MAP(int, String) watches;
+    MAP(String, int) watchDirs;
 } FileStorage;
 
+// NOTE: each File handed out by getFileStorage holds a reference
+struct FileEntry {
+    LruEntry lru;
+    File file;
+
+    // NOTE: what stat() said about the file before it was read, which is
+    // what a stat() has to match for the entry to be used
+    struct timespec modTime;
+    usz size;
+
+    // NOTE: the watcher reported a change to the file, so the entry
+    // can't be used without a stat() anymore
+    bool stale;
+    // NOTE: see storageIsWatched
+    bool watched;
+};
+
 typedef struct {
     Alloc *alloc;
     FileStorage *storage;
@@ -99,6 +166,60 @@ String getFileExtension(String path) {
 // TODO: we probably need a getFileStream(), but I'm not sure how to
 // handle close() of the fd
 
+// NOTE: the result is NUL-terminated
+String cloneFilePath(String path, Alloc *alloc) {
+    Mem cpath = AllocateBytesC(alloc, path.len + 1);
+    if(isNull(cpath)) return memnull;
+    mem_copy(cpath, path);
+    cpath.s[path.len] = '\0';
+    return memLimit(cpath, path.len);
+}
+
+// NOTE: doesn't read the contents, only remembers where to find them
+File getFileLazy(String path, struct stat *s, Alloc *alloc) {
+    String cpath = cloneFilePath(path, alloc);
+    if(isNull(cpath)) return none(File);
+
+    String extension = getFileExtension(path);
+
+    return (File){
+        .mediaType = getMediaType(extension),
+        .modTime = s->st_mtime,
+        .path = cpath,
+        .size = s->st_size,
+    };
+}
+
+// NOTE: the contents are a read-only shared mapping of the file, so they
+// live in the page cache instead of the heap, and are only read from the
+// disk once they're touched. Reading the pages of a mapped file past its
+// end raises SIGBUS, so the file mustn't be truncated while it's mapped
+File getFileMapped(String path, struct stat *s, Alloc *alloc) {
+    File file = getFileLazy(path, s, alloc);
+    if(isNone(file) || file.size == 0) return file;
+
+    int fd = open(fixchar file.path.s, O_RDONLY);
+    if(fd == -1) {
+        FreeC(alloc, file.path.s);
+        return none(File);
+    }
+
+    void *data = mmap(null, file.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        FreeC(alloc, file.path.s);
+        return none(File);
+    }
+
+    file.data = mkMem(data, file.size);
+    file.mapped = true;
+    return file;
+}
+
+bool isFileLazy(FileStorage *storage, struct stat *s) {
+    return storage->sendfileThreshold != 0 && (usz)s->st_size >= storage->sendfileThreshold;
+}
+
 File getFile(String path, Alloc *alloc) {
     struct stat s = {0};
     int result = stat(fixchar path.s, &s);
@@ -140,67 +261,382 @@ void storageFillFile(File *file, FileStorage *storage) {
     }
 
     if(storage->doGzip) {
-        file->gzip = Gzip_compress(file->data, storage->alloc);
+        file->gzip = Gzip_compressParallel(file->data, storage->compressionLevel, storage->compressionThreads, storage->lru.alloc);
     }
 
     if(storage->doZlib) {
-        file->zlib = Zlib_compress(file->data, storage->alloc);
+        file->zlib = Zlib_compressParallel(file->data, storage->compressionLevel, storage->compressionThreads, storage->lru.alloc);
+    }
+}
+
+usz fileCost(File *file) {
+    usz data = file->mapped ? 0 : file->data.len;
+    return data + file->gzip.len + file->zlib.len + file->path.len;
+}
+
+void freeFileEntry(LruEntry *lru) {
+    FileEntry *entry = (FileEntry *)lru;
+    Alloc *alloc = lru->cache->alloc;
+    File *file = &entry->file;
+
+    if(file->mapped) munmap(file->data.s, file->data.len);
+    else             FreeC(alloc, file->data.s);
+
+    FreeC(alloc, file->gzip.s);
+    FreeC(alloc, file->zlib.s);
+    FreeC(alloc, file->path.s);
+    FreeC(alloc, entry);
+}
+
+void releaseFile(File file) {
+    if(file.entry != null) lru_unref(&file.entry->lru);
+}
+
+#define getFileStorageStats(storage) lru_stats(&(storage)->lru)
+
+// NOTE: expects the map to be locked
+bool storageTryHit(FileStorage *storage, FileEntry *entry, File *file) {
+    if(!lru_hit(&storage->lru, &entry->lru)) return false;
+    *file = entry->file;
+    return true;
+}
+
+// NOTE: whether the watcher reports changes to the file under this very
+// path, so that the entry can be trusted without a stat. It doesn't for
+// files that are symlinks, or are in directories that aren't watched
+// (like symlinked ones, see storageWatchDir), or when the path isn't
+// spelled the way the watched directories are
+bool storageIsWatched(FileStorage *storage, String path) {
+    if(!__atomic_load_n(&storage->watching, __ATOMIC_ACQUIRE)) return false;
+
+    usz dirLen = 0;
+    for(usz i = 0; i < path.len; i++) {
+        if(path.s[i] == '/') dirLen = i;
     }
+
+    bool watched = false;
+    map_block(&storage->watches) {
+        watched = map_has(&storage->watchDirs, mkMem(path.s, dirLen));
+    }
+    if(!watched) return false;
+
+    struct stat s = {0};
+    return lstat(fixchar path.s, &s) == 0 && !S_ISLNK(s.st_mode);
 }
 
+// NOTE: files from the cache have to be given back with releaseFile
 File getFileStorage(String path, FileStorage *storage) {
     if(storage == null) {
         return getFile(path, ALLOC);
     }
 
+    Map *map = hm_getMap(&storage->lru.hm, path);
+    Alloc *alloc = storage->lru.alloc;
+
+    // NOTE: while the files are watched, entries are fresh until the
+    // watcher says otherwise, so there's no need to stat them
+    if(!storage->disableCaching && __atomic_load_n(&storage->watching, __ATOMIC_ACQUIRE)) {
+        File file = none(File);
+        bool hit = false;
+        map_block(map) {
+            FileEntry *entry = (FileEntry *)lru_find(map, path);
+            hit = entry != null && entry->watched && !__atomic_load_n(&entry->stale, __ATOMIC_ACQUIRE) &&
+                  storageTryHit(storage, entry, &file);
+        }
+        if(hit) return file;
+    }
+
+    // NOTE: if the file has been deleted, we don't look for it (maybe change?)
+    struct stat s = {0};
+    if(stat(fixchar path.s, &s) != 0) return none(File);
+
     if(storage->disableCaching) {
+        if(isFileLazy(storage, &s)) return getFileLazy(path, &s, ALLOC);
+
         File file = getFile(path, ALLOC);
         if(isNone(file)) return none(File);
         storageFillFile(&file, storage);
         return file;
     }
 
-    // NOTE: if the file has been deleted, we don't look for it (maybe change?)
-    time_t modTime = getFileModTime(path);
-    if(modTime == 0) return none(File);
-
-    File file;
-    Map *map = hm_getMap(&storage->hm, path);
+    File file = none(File);
+    LruEntry *replaced = null;
 
-    // TODO: this does not copy memory from hashmap to user, thus the
-    // hashmap can't free old versions of files - which is fine, if the
-    // files modify rarely (or at all), but I'm not sure if this is good
+    // NOTE: the file is read and its entry inserted under the lock that the
+    // watcher needs to mark the entry stale, so a change to the file that's
+    // reported while it's being read marks the new entry. A stale entry
+    // is still used, as long as the file looks the same as when it was read
     map_block(map) {
-        File *supposedFile = (File *)map_get(map, path).s;
-        if(supposedFile != null && supposedFile->modTime == modTime) {
-            file = *supposedFile;
+        FileEntry *entry = (FileEntry *)lru_find(map, path);
+
+        if(entry != null &&
+           entry->modTime.tv_sec == s.st_mtim.tv_sec && entry->modTime.tv_nsec == s.st_mtim.tv_nsec &&
+           entry->size == (usz)s.st_size &&
+           storageTryHit(storage, entry, &file)) {
             continue;
         }
 
-        file = getFile(path, storage->alloc);
-        if(isNone(file)) return none(File);
-        storageFillFile(&file, storage);
+        // NOTE: returning from here would leave the map locked
+        if(isFileLazy(storage, &s)) {
+            file = getFileLazy(path, &s, alloc);
+        }
+        else if(storage->useMmap && storage->immutable) {
+            file = getFileMapped(path, &s, alloc);
+        }
+        else {
+            file = getFile(path, alloc);
+            if(isJust(file)) storageFillFile(&file, storage);
+        }
+        if(isNone(file)) continue;
+
+        FileEntry _newEntry = {
+            .lru = mkLruEntry(&storage->lru, path, fileCost(&file)),
+            .file = file,
+            .modTime = s.st_mtim,
+            .size = s.st_size,
+            .watched = storageIsWatched(storage, path),
+        };
+        AllocateVarC(FileEntry, newEntry, _newEntry, alloc);
+        if(newEntry == null) {
+            FreeC(alloc, _newEntry.lru.key.s);
+            continue;
+        }
+        newEntry->file.entry = newEntry;
+        file = newEntry->file;
 
-        map_set(map, path, memPointer(File, &file));
+        replaced = lru_insert(&storage->lru, map, &newEntry->lru);
     }
 
+    if(replaced != null) lru_unref(replaced);
+    lru_evict(&storage->lru);
+
     return file;
 }
 
+// NOTE: empty segments are skipped, so that every spelling of a path
+// maps to the same file, and to the same cache entry
+String getFileTreePath(UriPath path, Alloc *alloc) {
+    StringBuilder sb = mkStringBuilder();
+    sb.alloc = alloc;
+    dynar_foreach(String, &path.segments) {
+        if(loop.it.len == 0) continue;
+        if(sb.len != 0) sb_appendChar(&sb, '/');
+        sb_appendMem(&sb, loop.it);
+    }
+
+    return sb_build(sb);
+}
+
 File getFileTree(FileTreeRouter *ftrouter, UriPath subPath) {
     UriPath result = Uri_pathMoveRelatively(ftrouter->basePath, subPath, ALLOC);
     if(!Uri_pathHasPrefix(ftrouter->basePath, result)) return none(File);
 
-    StringBuilder sb = mkStringBuilder();
-    dynar_foreach(String, &result.segments) {
-        sb_appendMem(&sb, loop.it);
-        if(loop.index != result.segments.len - 1) {
-            sb_appendChar(&sb, '/');
+    String filePath = getFileTreePath(result, ALLOC);
+    return getFileStorage(filePath, ftrouter->storage);
+}
+
+#define FILE_WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+// NOTE: the result is NUL-terminated
+String storageJoinPath(FileStorage *storage, String dir, String name) {
+    Mem path = AllocateBytesC(storage->lru.alloc, dir.len + 1 + name.len + 1);
+    if(isNull(path)) return memnull;
+    mem_copy(path, dir);
+    path.s[dir.len] = '/';
+    mem_copy(memIndex(path, dir.len + 1), name);
+    path.s[dir.len + 1 + name.len] = '\0';
+    return memLimit(path, dir.len + 1 + name.len);
+}
+
+void storageMarkStale(FileStorage *storage, String path) {
+    Map *map = hm_getMap(&storage->lru.hm, path);
+    map_block(map) {
+        FileEntry *entry = (FileEntry *)lru_find(map, path);
+        if(entry != null) __atomic_store_n(&entry->stale, true, __ATOMIC_RELEASE);
+    }
+}
+
+// NOTE: once the file is gone, its entry won't ever be hit again
+void storageRemove(FileStorage *storage, String path) {
+    Map *map = hm_getMap(&storage->lru.hm, path);
+    LruEntry *removed = null;
+    map_block(map) {
+        LruEntry *entry = lru_find(map, path);
+        if(entry != null && lru_remove(&storage->lru, map, entry)) removed = entry;
+    }
+
+    if(removed != null) lru_unref(removed);
+}
+
+void storageMarkAllStale(FileStorage *storage) {
+    dynar_foreach(Map, &storage->lru.hm.map) {
+        Map *map = &dynar_index(Map, &storage->lru.hm.map, loop.index);
+        map_block(map) {
+            MapIter iter = map_iter(map);
+            while(!map_iter_end(&iter)) {
+                FileEntry *entry = memExtract(FileEntry *, map_iter_next(&iter).val);
+                __atomic_store_n(&entry->stale, true, __ATOMIC_RELEASE);
+            }
         }
     }
+}
 
-    String filePath = sb_build(sb);
-    return getFileStorage(filePath, ftrouter->storage);
+// NOTE: expects the lock of watches to be held
+void storageForgetDir(FileStorage *storage, String dir, int wd) {
+    Mem found = map_get(&storage->watchDirs, dir);
+    if(!isNull(found) && memExtract(int, found) == wd) map_remove(&storage->watchDirs, dir);
+}
+
+// NOTE: watches the directory and everything below it, except for symlinked
+// directories, since the same directory could then be reached by several
+// paths, while a watch only reports one. Files in them are checked with
+// stat() instead. dir has to be NUL-terminated, and is owned by the watch
+bool storageWatchDir(FileStorage *storage, String dir) {
+    int wd = inotify_add_watch(storage->inotify, fixchar dir.s, FILE_WATCH_EVENTS);
+    if(wd == -1) {
+        FreeC(storage->lru.alloc, dir.s);
+        return false;
+    }
+
+    // NOTE: a directory that was moved keeps its watch
+    bool moved = false;
+    map_block(&storage->watches) {
+        Mem old = map_get(&storage->watches, memPointer(int, &wd));
+        if(!isNull(old)) {
+            String oldDir = memExtract(String, old);
+            moved = !mem_eq(oldDir, dir);
+            storageForgetDir(storage, oldDir, wd);
+            FreeC(storage->lru.alloc, oldDir.s);
+        }
+        map_set(&storage->watches, memPointer(int, &wd), memPointer(String, &dir));
+        map_set(&storage->watchDirs, dir, memPointer(int, &wd));
+    }
+
+    // NOTE: entries under the old path were trusted to be watched
+    if(moved) storageMarkAllStale(storage);
+
+    DIR *d = opendir(fixchar dir.s);
+    if(d == null) return true;
+
+    struct dirent *dirent;
+    while((dirent = readdir(d)) != null) {
+        String name = mkString(dirent->d_name);
+        if(mem_eq(name, mkString(".")) || mem_eq(name, mkString(".."))) continue;
+
+        String path = storageJoinPath(storage, dir, name);
+        if(isNull(path)) continue;
+
+        struct stat s = {0};
+        bool isDir = dirent->d_type == DT_DIR ||
+                     (dirent->d_type == DT_UNKNOWN && lstat(fixchar path.s, &s) == 0 && S_ISDIR(s.st_mode));
+
+        if(isDir) storageWatchDir(storage, path);
+        else      FreeC(storage->lru.alloc, path.s);
+    }
+
+    closedir(d);
+    return true;
+}
+
+void storageHandleEvent(FileStorage *storage, struct inotify_event *event) {
+    if(event->mask & IN_Q_OVERFLOW) {
+        storageMarkAllStale(storage);
+        return;
+    }
+
+    String dir = memnull;
+    map_block(&storage->watches) {
+        Mem found = map_get(&storage->watches, memPointer(int, &event->wd));
+        if(!isNull(found)) dir = memExtract(String, found);
+        if(!isNull(found) && (event->mask & IN_IGNORED)) {
+            map_remove(&storage->watches, memPointer(int, &event->wd));
+            storageForgetDir(storage, dir, event->wd);
+        }
+    }
+
+    if(isNull(dir)) return;
+    if(event->mask & IN_IGNORED) {
+        FreeC(storage->lru.alloc, dir.s);
+        return;
+    }
+    if(event->len == 0) return;
+
+    String path = storageJoinPath(storage, dir, mkString(event->name));
+    if(isNull(path)) return;
+
+    if(!(event->mask & IN_ISDIR)) {
+        if(event->mask & (IN_DELETE | IN_MOVED_FROM)) storageRemove(storage, path);
+        else                                          storageMarkStale(storage, path);
+        FreeC(storage->lru.alloc, path.s);
+    }
+    else if(event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        storageWatchDir(storage, path);
+    }
+    else {
+        // NOTE: cached files could be anywhere below the directory
+        storageMarkAllStale(storage);
+        FreeC(storage->lru.alloc, path.s);
+    }
+}
+
+void *storageWatchRoutine(void *_storage) {
+    FileStorage *storage = _storage;
+    byte buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while(true) {
+        isz len = read(storage->inotify, buffer, sizeof(buffer));
+        if(len < 0 && errno == EINTR) continue;
+        if(len <= 0) break;
+
+        for(byte *p = buffer; p < buffer + len;) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            storageHandleEvent(storage, event);
+        }
+    }
+
+    // NOTE: back to checking every file with stat()
+    __atomic_store_n(&storage->watching, false, __ATOMIC_RELEASE);
+    return null;
+}
+
+// NOTE: starts a thread that watches the router's directory with inotify,
+// and marks cached files as stale when they change, so that cache hits
+// don't have to stat() the file. Changes made before this returns might
+// go unnoticed
+bool watchFileTree(FileTreeRouter *ftrouter) {
+    FileStorage *storage = ftrouter->storage;
+    if(storage == null || storage->disableCaching) return false;
+
+    bool startThread = false;
+    pthread_mutex_lock(&storage->lru.lock);
+    if(storage->inotify == -1) {
+        storage->inotify = inotify_init1(IN_CLOEXEC);
+        startThread = storage->inotify != -1;
+    }
+    pthread_mutex_unlock(&storage->lru.lock);
+    if(storage->inotify == -1) return false;
+
+    String dir = cloneFilePath(getFileTreePath(ftrouter->basePath, ALLOC), storage->lru.alloc);
+    if(isNull(dir)) return false;
+    if(!storageWatchDir(storage, dir)) return false;
+
+    if(startThread) {
+        pthread_t thread;
+        pthread_attr_t threadAttr;
+        int result = pthread_attr_init(&threadAttr);
+        if(result == 0) result = pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+        if(result == 0) result = pthread_create(&thread, &threadAttr, storageWatchRoutine, storage);
+        pthread_attr_destroy(&threadAttr);
+        if(result != 0) return false;
+    }
+
+    // NOTE: anything cached so far could've changed before the watch began.
+    // Entries from before watching is set aren't trusted anyway, see
+    // storageIsWatched
+    __atomic_store_n(&storage->watching, true, __ATOMIC_RELEASE);
+    storageMarkAllStale(storage);
+    return true;
 }
 
 #define mkFileTreeRouter(p, s) mkFileTreeRouterL(mkString(p), s)
@@ -223,15 +659,19 @@ FileTreeRouter mkFileTreeRouterL(String spath, FileStorage *storage) {
 
 FileStorage mkFileStorage(Alloc *alloc) {
     FileStorage storage = {
-        .alloc = alloc,
-        .hm = mkHashmap(alloc),
-
         .doHash = true,
         .doGzip = true,
         .doZlib = true,
+        .compressionLevel = DEFLATE_LEVEL_BEST,
+
+        .sendfileThreshold = 1 << 20,
+        .lru = mkLruCache(alloc, 128 << 20, freeFileEntry),
+
+        .inotify = -1,
+        .watches = mkMapA(alloc),
+        .watchDirs = mkMapA(alloc),
     };
 
-    hm_fix(&storage.hm);
     return storage;
 }
 
@@ -162,6 +162,7 @@ typedef struct {
 } HttpH_TransferEncoding;
 typedef HttpH_TransferEncoding HttpH_TE;
 typedef HttpH_TransferEncoding HttpH_AcceptEncoding;
+typedef HttpH_TransferEncoding HttpH_ContentEncoding;
 
 typedef struct {
     bool error;
@@ -176,7 +177,7 @@ typedef struct {
     bool any;
     Dynar(HttpEntityTag) etags;
 } HttpH_IfMatch;
-typedef HttpH_IfMatch HttpH_IfNotMatch;
+typedef HttpH_IfMatch HttpH_IfNoneMatch;
 
 typedef struct {
     String value;
@@ -184,6 +185,33 @@ typedef struct {
 } HttpH_IfModifiedSince;
 typedef HttpH_IfModifiedSince HttpH_IfUnmodifiedSince;
 
+// NOTE: if !hasFirst, this is a suffix range, and last is its length
+typedef struct {
+    bool hasFirst;
+    u64 first;
+    bool hasLast;
+    u64 last;
+} HttpRange;
+
+typedef struct {
+    String value;
+    Dynar(HttpRange) ranges;
+} HttpH_Range;
+
+typedef struct {
+    String value;
+
+    bool isDate;
+    HttpEntityTag etag;
+    time_t date;
+} HttpH_IfRange;
+
+// NOTE: as per RFC 9110 8.8.3.2
+bool Http_matchEntityTag(HttpEntityTag a, HttpEntityTag b, bool strong) {
+    if(strong && (a.isWeak || b.isWeak)) return false;
+    return mem_eq(a.value, b.value);
+}
+
 bool Http_isMethodSafe(HttpMethod m) {
     return m == HTTP_GET
         || m == HTTP_HEAD
@@ -241,11 +269,13 @@ HttpEntityTag Http_parseEntityTag(Stream *s, Alloc *alloc) {
 
     while(isJust(c = stream_peekChar(s)) && c.value != '\"' && Http_isFieldVChar(c.value)) {
         sb_appendChar(&sb, c.value);
+        stream_popChar(s);
     }
 
     if(isNone(c)) return none(HttpEntityTag);
     if(c.value != '\"') return none(HttpEntityTag);
-    
+    stream_popChar(s);
+
     return (HttpEntityTag){
         .isWeak = isWeak,
         .value = sb_build(sb),
@@ -259,6 +289,25 @@ f32 Http_matchMediaType(HttpMediaType allowed, HttpMediaType testing) {
     return 0;
 }
 
+// NOTE: the q-value of a content coding, as per RFC 9110 12.5.3.
+// accept == null means there was no Accept-Encoding, in which case we
+// stick with identity. Codings are expected to be lowercase
+f32 Http_matchEncoding(HttpH_AcceptEncoding *accept, String coding) {
+    bool isIdentity = mem_eq(coding, mkString("identity"));
+    if(accept == null) return isIdentity ? 1 : 0;
+
+    f32 wildcard = -1;
+    dynar_foreach(HttpTransferCoding, &accept->codings) {
+        String it = loop.it.coding;
+        if(mem_eq(it, coding)) return loop.it.params.q;
+        if(mem_eq(it, mkString("x-gzip")) && mem_eq(coding, mkString("gzip"))) return loop.it.params.q;
+        if(mem_eq(it, mkString("*"))) wildcard = loop.it.params.q;
+    }
+
+    if(wildcard >= 0) return wildcard;
+    return isIdentity ? 1 : 0;
+}
+
 bool Http_writeMediaType(Stream *s, HttpMediaType mediaType) {
     if(mediaType.typeWildcard)      checkRet(stream_writeChar(s, '*'));
     else                            tryRet(stream_write(s, mediaType.type));
@@ -410,7 +459,7 @@ bool Http_parseDate(Stream *s, time_t *t) {
             .tm_hour = hour,
             .tm_mday = day,
             .tm_mon = month,
-            .tm_year = year,
+            .tm_year = year - 1900,
             .tm_wday = wday,
         };
         time_t tr = timegm(&timeStamp);
@@ -484,7 +533,7 @@ bool Http_parseDate(Stream *s, time_t *t) {
             .tm_hour = hour,
             .tm_mday = day,
             .tm_mon = month,
-            .tm_year = year,
+            .tm_year = year - 1900,
             .tm_wday = wday,
         };
         time_t tr = timegm(&timeStamp);
@@ -568,7 +617,7 @@ bool Http_parseDate(Stream *s, time_t *t) {
             .tm_hour = hour,
             .tm_mday = day,
             .tm_mon = month,
-            .tm_year = year,
+            .tm_year = year - 1900,
             .tm_wday = wday,
         };
         time_t tr = timegm(&timeStamp);
@@ -985,6 +1034,7 @@ Http_generate_parseHeaderList(_TE, str, codings, HttpTransferCoding, { \
     MaybeString coding = Http_parseToken(s, map->alloc, 0); \
     result = result && isJust(coding); \
     if(result) { \
+        toLower(coding.value); \
         HttpParameters params = Http_parseParameters(s, map->alloc); \
         result = result && isJust(params); \
         if(onlyQ) { result = result && params.list.len == 0; } \
@@ -995,6 +1045,7 @@ Http_generate_parseHeaderList(_TE, str, codings, HttpTransferCoding, { \
 Http_generate_parseHeaderTranfer(TE, "te", false)
 Http_generate_parseHeaderTranfer(TransferEncoding, "transfer-encoding", false)
 Http_generate_parseHeaderTranfer(AcceptEncoding, "accept-encoding", true)
+Http_generate_parseHeaderTranfer(ContentEncoding, "content-encoding", true)
 
 #define Http_generate_parseHeaderIfMatch(_IfMatch, str) \
 Http_generate_parseHeaderList(_IfMatch, str, etags, HttpEntityTag, { \
@@ -1012,7 +1063,7 @@ Http_generate_parseHeaderList(_IfMatch, str, etags, HttpEntityTag, { \
 })
 
 Http_generate_parseHeaderIfMatch(IfMatch, "if-match")
-Http_generate_parseHeaderIfMatch(IfNotMatch, "if-not-match")
+Http_generate_parseHeaderIfMatch(IfNoneMatch, "if-none-match")
 
 HttpError Http_parseHeader_Host(Map *map, String value, HttpH_Host *already) {
     if(already != null) return HTTPERR_BAD_HOST;
@@ -1063,6 +1114,87 @@ HttpError Http_parseHeader_##name(Map *map, String value, HttpH_##name *already)
 Http_generate_parseHeaderModified(IfModifiedSince, "if-modified-since")
 Http_generate_parseHeaderModified(IfUnmodifiedSince, "if-unmodified-since")
 
+#ifndef HTTP_RANGE_LIMIT
+#define HTTP_RANGE_LIMIT 32
+#endif
+
+// NOTE: a Range that we can't make sense of (an unknown unit, bad syntax,
+// too many ranges) is ignored as if it wasn't sent, as per RFC 9110 14.2
+HttpError Http_parseHeader_Range(Map *map, String value, HttpH_Range *already) {
+    if(already != null) {
+        map_remove(map, mkString("range"));
+        return HTTPERR_SUCCESS;
+    }
+
+    Stream _s = mkStreamStr(value);
+    Stream *s = &_s;
+
+    MaybeString unit = Http_parseToken(s, map->alloc, 16);
+    if(isNone(unit)) return HTTPERR_SUCCESS;
+    toLower(unit.value);
+    if(!mem_eq(unit.value, mkString("bytes"))) return HTTPERR_SUCCESS;
+    if(!Http_parseOne(s, '=')) return HTTPERR_SUCCESS;
+
+    HttpH_Range header = {
+        .value = value,
+        .ranges = mkDynarA(HttpRange, map->alloc),
+    };
+
+    MaybeChar c;
+    while(true) {
+        Http_parseWS(s);
+        c = stream_peekChar(s);
+        if(isNone(c)) break;
+
+        // NOTE: empty list elements are allowed
+        if(c.value != ',') {
+            HttpRange range = {0};
+            range.hasFirst = parseU64FromDecimal(s, &range.first, false);
+            if(!Http_parseOne(s, '-')) return HTTPERR_SUCCESS;
+            range.hasLast = parseU64FromDecimal(s, &range.last, false);
+
+            if(!range.hasFirst && !range.hasLast) return HTTPERR_SUCCESS;
+            if(range.hasFirst && range.hasLast && range.last < range.first) return HTTPERR_SUCCESS;
+            if(header.ranges.len >= HTTP_RANGE_LIMIT) return HTTPERR_SUCCESS;
+
+            bool result = true;
+            dynar_append(&header.ranges, HttpRange, range, result);
+            if(!result) return HTTPERR_INTERNAL_ERROR;
+
+            Http_parseWS(s);
+            if(isNone(stream_peekChar(s))) break;
+        }
+
+        if(!Http_parseOne(s, ',')) return HTTPERR_SUCCESS;
+    }
+
+    if(header.ranges.len == 0) return HTTPERR_SUCCESS;
+
+    map_set(map, mkString("range"), memPointer(HttpH_Range, &header));
+    return HTTPERR_SUCCESS;
+}
+
+HttpError Http_parseHeader_IfRange(Map *map, String value, HttpH_IfRange *already) {
+    if(already != null) return HTTPERR_INVALID_HEADER_FIELD_VALUE;
+    Stream s = mkStreamStr(value);
+
+    HttpH_IfRange header = { .value = value };
+
+    MaybeChar c = stream_peekChar(&s);
+    if(isJust(c) && (c.value == 'W' || c.value == '\"')) {
+        header.etag = Http_parseEntityTag(&s, map->alloc);
+        checkRetVal(isJust(header.etag), HTTPERR_INVALID_HEADER_FIELD_VALUE);
+    }
+    else {
+        header.isDate = true;
+        checkRetVal(Http_parseDate(&s, &header.date), HTTPERR_INVALID_HEADER_FIELD_VALUE);
+    }
+    if(isJust(stream_peekChar(&s))) return HTTPERR_INVALID_HEADER_FIELD_VALUE;
+
+    map_set(map, mkString("if-range"), memPointer(HttpH_IfRange, &header));
+    return HTTPERR_SUCCESS;
+}
+
 HttpError Http_parseHeaderField(Stream *s, Map *map) {
     Alloc *alloc = map->alloc;
     
@@ -1092,10 +1224,13 @@ HttpError Http_parseHeaderField(Stream *s, Map *map) {
     header(TE, "te")
     header(TransferEncoding, "transfer-encoding")
     header(AcceptEncoding, "accept-encoding")
+    header(ContentEncoding, "content-encoding")
     header(IfMatch, "if-match")
-    header(IfNotMatch, "if-not-match")
+    header(IfNoneMatch, "if-none-match")
     header(IfModifiedSince, "if-modified-since")
     header(IfUnmodifiedSince, "if-unmodified-since")
+    header(Range, "range")
+    header(IfRange, "if-range")
     #undef header
     else {
         HttpH_Unknown header = { .value = fieldValue };
@@ -0,0 +1,198 @@
+#ifndef __LIB_COIL_POOL
+#define __LIB_COIL_POOL
+
+#include <pthread.h>
+
+#include <types.h>
+#include <alloc.h>
+#include <cpu.h>
+
+// NOTE: a fixed amount of pre-started workers, each with its own deque of
+// jobs. Jobs are pushed to the bottom of a deque and taken from its top,
+// by the owner and by idle workers stealing from the others' deques alike,
+// so jobs are taken in the order they were pushed
+
+#ifndef COIL_POOL_QUEUE
+#define COIL_POOL_QUEUE 1024
+#endif
+
+typedef void *(CoilPoolRoutine)(void *);
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    ptr *jobs;
+    usz cap;
+    usz top;
+    usz bottom;
+} CoilDeque;
+
+typedef struct CoilPool CoilPool;
+
+typedef struct {
+    CoilPool *pool;
+    usz index;
+} CoilWorker;
+
+struct CoilPool {
+    CoilPoolRoutine *routine;
+
+    usz workerCount;
+    CoilDeque *deques;
+    CoilWorker *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t hasWork;
+    usz pending;
+
+    usz nextDeque;
+};
+
+bool CoilDeque_pushBottom(CoilDeque *deque, ptr job) {
+    bool result = false;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom - deque->top < deque->cap) {
+        deque->jobs[deque->bottom % deque->cap] = job;
+        deque->bottom += 1;
+        result = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return result;
+}
+
+ptr CoilDeque_popTop(CoilDeque *deque) {
+    ptr job = null;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom != deque->top) {
+        job = deque->jobs[deque->top % deque->cap];
+        deque->top += 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
+
+ptr CoilPool_take(CoilPool *pool, usz index) {
+    ptr job = CoilDeque_popTop(&pool->deques[index]);
+
+    for(usz i = 1; job == null && i < pool->workerCount; i++) {
+        job = CoilDeque_popTop(&pool->deques[(index + i) % pool->workerCount]);
+    }
+
+    return job;
+}
+
+void *CoilPool_workerRoutine(void *_worker) {
+    CoilWorker *worker = _worker;
+    CoilPool *pool = worker->pool;
+
+    while(true) {
+        ptr job = CoilPool_take(pool, worker->index);
+
+        if(job == null) {
+            pthread_mutex_lock(&pool->lock);
+            while(pool->pending == 0) {
+                pthread_cond_wait(&pool->hasWork, &pool->lock);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->pending -= 1;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->routine(job);
+    }
+
+    return null;
+}
+
+// NOTE: fails if every deque is full, which is the cap on how many
+// jobs can be waiting for a worker at once. The job is counted before
+// it's pushed, since a worker can take it as soon as it's in a deque
+bool CoilPool_push(CoilPool *pool, ptr job) {
+    pthread_mutex_lock(&pool->lock);
+    pool->pending += 1;
+    pthread_mutex_unlock(&pool->lock);
+
+    bool pushed = false;
+    for(usz i = 0; !pushed && i < pool->workerCount; i++) {
+        usz index = pool->nextDeque;
+        pool->nextDeque = (pool->nextDeque + 1) % pool->workerCount;
+        pushed = CoilDeque_pushBottom(&pool->deques[index], job);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if(pushed) pthread_cond_signal(&pool->hasWork);
+    else       pool->pending -= 1;
+    pthread_mutex_unlock(&pool->lock);
+
+    return pushed;
+}
+
+void freeCoilPool(CoilPool *pool) {
+    for(usz i = 0; i < pool->workerCount; i++) {
+        if(pool->deques[i].jobs == null) continue;
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        FreeC(ALLOC_GLOBAL, pool->deques[i].jobs);
+    }
+    FreeC(ALLOC_GLOBAL, pool->deques);
+    FreeC(ALLOC_GLOBAL, pool->workers);
+    FreeC(ALLOC_GLOBAL, pool);
+}
+
+// NOTE: workerCount == 0 means one worker per core. Both the pool and its
+// workers live forever, so everything is allocated in ALLOC_GLOBAL. The
+// workers are only started once everything is allocated. If some of them
+// fail to start, the rest take the jobs from their deques too
+CoilPool *mkCoilPool(usz workerCount, CoilPoolRoutine *routine) {
+    if(workerCount == 0) workerCount = getCoreCount();
+
+    CoilPool _pool = {
+        .routine = routine,
+        .workerCount = workerCount,
+        .deques = (CoilDeque *)AllocateBytesC(ALLOC_GLOBAL, sizeof(CoilDeque) * workerCount).s,
+        .workers = (CoilWorker *)AllocateBytesC(ALLOC_GLOBAL, sizeof(CoilWorker) * workerCount).s,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .hasWork = PTHREAD_COND_INITIALIZER,
+    };
+    AllocateVarC(CoilPool, pool, _pool, ALLOC_GLOBAL);
+    if(pool == null || _pool.deques == null || _pool.workers == null) {
+        FreeC(ALLOC_GLOBAL, _pool.deques);
+        FreeC(ALLOC_GLOBAL, _pool.workers);
+        FreeC(ALLOC_GLOBAL, pool);
+        return null;
+    }
+
+    for(usz i = 0; i < workerCount; i++) {
+        pool->deques[i].cap = COIL_POOL_QUEUE;
+        pool->deques[i].jobs = (ptr *)AllocateBytesC(ALLOC_GLOBAL, sizeof(ptr) * COIL_POOL_QUEUE).s;
+        if(pool->deques[i].jobs == null) {
+            freeCoilPool(pool);
+            return null;
+        }
+        pthread_mutex_init(&pool->deques[i].lock, null);
+    }
+
+    usz started = 0;
+    for(usz i = 0; i < workerCount; i++) {
+        pool->workers[i] = (CoilWorker){ .pool = pool, .index = i };
+
+        pthread_t thread;
+        pthread_attr_t threadAttr;
+        int result = pthread_attr_init(&threadAttr);
+        if(result == 0) result = pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+        if(result == 0) result = pthread_create(&thread, &threadAttr, CoilPool_workerRoutine, &pool->workers[i]);
+        pthread_attr_destroy(&threadAttr);
+        if(result == 0) started += 1;
+    }
+
+    if(started == 0) {
+        freeCoilPool(pool);
+        return null;
+    }
+
+    return pool;
+}
+
+#endif // __LIB_COIL_POOL
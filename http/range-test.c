@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "coil.c"
+
+// NOTE: null if the Range header is ignored, as if it wasn't sent
+HttpH_Range *parseRange(Map *headers, char *value) {
+    *headers = mkMap();
+    if(Http_parseHeader_Range(headers, mkString(value), null) != HTTPERR_SUCCESS) return null;
+    if(!map_has(headers, mkString("range"))) return null;
+    return memExtractPtr(HttpH_Range, map_get(headers, mkString("range")));
+}
+
+bool testParse(char *value, usz rangeCount) {
+    Map headers;
+    HttpH_Range *header = parseRange(&headers, value);
+    if(rangeCount == 0) return header == null;
+    return header != null && header->ranges.len == rangeCount;
+}
+
+bool testResolve(HttpRange range, u64 length, bool satisfiable, u64 start, u64 len) {
+    CoilRange result = {0};
+    if(Coil_ResolveRange(range, length, &result) != satisfiable) return false;
+    return !satisfiable || (result.start == start && result.len == len);
+}
+
+// NOTE: the response to a GET of content with the given Range, or null
+// if the ranges are ignored in favor of the whole content
+String respondRanges(char *value, Mem content) {
+    Map headers;
+    if(parseRange(&headers, value) == null) return memnull;
+
+    StringBuilder sb = mkStringBuilder();
+    Stream s = mkStreamSb(&sb);
+    RouteContext context = {
+        .s = &s,
+        .method = HTTP_GET,
+        .headers = &headers,
+    };
+    File file = {
+        .data = content,
+        .mediaType = mkHttpMediaType("text", "plain"),
+    };
+    CoilFileVariant variant = { .content = content };
+
+    bool handled = false;
+    if(!Coil_RespondFileRanges(&context, &file, &variant, &handled) || !handled) return memnull;
+    return sb_build(sb);
+}
+
+bool contains(String s, char *part) {
+    String p = mkString(part);
+    for(usz i = 0; i + p.len <= s.len; i++) {
+        if(mem_eq(mkMem(s.s + i, p.len), p)) return true;
+    }
+    return false;
+}
+
+// NOTE: checks the status line, a header, and the end of the body
+bool testRespond(char *value, Mem content, char *status, char *header, char *bodyEnd) {
+    String response = respondRanges(value, content);
+    if(isNull(response)) return false;
+
+    String end = mkString(bodyEnd);
+    String statusLine = mkString(status);
+    return response.len >= statusLine.len && mem_eq(memLimit(response, statusLine.len), statusLine) &&
+           contains(response, header) &&
+           response.len >= end.len && mem_eq(memIndex(response, response.len - end.len), end);
+}
+
+int main() {
+    Mem content = mkString("0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ");
+    u64 length = content.len;
+
+    StringBuilder sb = mkStringBuilder();
+    sb_appendMem(&sb, mkString("bytes=0-0"));
+    for(usz i = 1; i < HTTP_RANGE_LIMIT; i++) sb_appendMem(&sb, mkString(", 0-0"));
+    sb_appendChar(&sb, '\0');
+    String atLimit = sb_build(sb);
+
+    sb = mkStringBuilder();
+    sb_appendMem(&sb, memLimit(atLimit, atLimit.len - 1));
+    sb_appendMem(&sb, mkString(", 0-0"));
+    sb_appendChar(&sb, '\0');
+    String overLimit = sb_build(sb);
+
+    int failed = 0;
+#define Test(name, expr) if(!(expr)) { printf("FAILED: %s\n", name); failed += 1; }
+    Test("parse, single range", testParse("bytes=0-9", 1));
+    Test("parse, suffix and open ranges", testParse("bytes=-5, 10-", 2));
+    Test("parse, empty elements", testParse("bytes=, 0-9,,", 1));
+    Test("parse, unknown unit is ignored", testParse("lines=0-9", 0));
+    Test("parse, last before first is ignored", testParse("bytes=9-0", 0));
+    Test("parse, HTTP_RANGE_LIMIT ranges", testParse((char *)atLimit.s, HTTP_RANGE_LIMIT));
+    Test("parse, more than HTTP_RANGE_LIMIT ranges are ignored", testParse((char *)overLimit.s, 0));
+
+    Test("resolve, suffix longer than the file", testResolve((HttpRange){ .hasLast = true, .last = 1000 }, length, true, 0, length));
+    Test("resolve, suffix", testResolve((HttpRange){ .hasLast = true, .last = 2 }, length, true, length - 2, 2));
+    Test("resolve, empty suffix", testResolve((HttpRange){ .hasLast = true, .last = 0 }, length, false, 0, 0));
+    Test("resolve, first past the end", testResolve((HttpRange){ .hasFirst = true, .first = length }, length, false, 0, 0));
+    Test("resolve, last clamped to the end", testResolve((HttpRange){ .hasFirst = true, .first = 60, .hasLast = true, .last = 1000 }, length, true, 60, 2));
+    Test("resolve, zero-length file", testResolve((HttpRange){ .hasFirst = true, .first = 0 }, 0, false, 0, 0));
+    Test("resolve, suffix of a zero-length file", testResolve((HttpRange){ .hasLast = true, .last = 5 }, 0, false, 0, 0));
+
+    Test("respond, single range", testRespond("bytes=10-12", content, "HTTP/1.1 206", "Content-Range: bytes 10-12/62", "abc"));
+    Test("respond, suffix longer than the file", testRespond("bytes=-100", content, "HTTP/1.1 206", "Content-Range: bytes 0-61/62", "XYZ"));
+    Test("respond, last clamped to the end", testRespond("bytes=59-100", content, "HTTP/1.1 206", "Content-Range: bytes 59-61/62", "XYZ"));
+    Test("respond, first past the end", testRespond("bytes=62-", content, "HTTP/1.1 416", "Content-Range: bytes */62", "\r\n\r\n"));
+    Test("respond, unsatisfiable ones are skipped", testRespond("bytes=100-, 0-0", content, "HTTP/1.1 206", "Content-Range: bytes 0-0/62", "0"));
+    Test("respond, several ranges", testRespond("bytes=0-1, 60-", content, "HTTP/1.1 206", "multipart/byteranges", "--\r\n"));
+    Test("respond, zero-length file", testRespond("bytes=0-", mkString(""), "HTTP/1.1 416", "Content-Range: bytes */0", "\r\n\r\n"));
+    Test("respond, overlapping ranges over the length are ignored", isNull(respondRanges("bytes=0-40, 20-61", content)));
+    Test("respond, more than HTTP_RANGE_LIMIT ranges are ignored", isNull(respondRanges((char *)overLimit.s, content)));
+#undef Test
+
+    if(failed == 0) printf("All tests passed\n");
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1 @@
+mkdir -p ./../bin && gcc --std=gnu99 ./range-test.c -o ./../bin/range-test -I../lib -ggdb -Wall -Wextra && ./../bin/range-test
@@ -82,4 +82,126 @@ bool bitstream_writeN(BitStream *bs, u64 val, u8 len) {
     return true;
 }
 
+// NOTE: reads bits LSB-first from memory, keeping up to 64 of them in a
+// buffer, which is refilled 8 bytes at a time. Up to 56 bits can be
+// peeked at once. Past the end, the buffer is padded with zeroes, so
+// peeking there is fine, but consuming them is an overrun
+typedef struct {
+    Mem mem;
+    usz pos;
+
+    u64 bits;
+    u8 count;
+} BitReader;
+
+#define BITREADER_MAX_PEEK 56
+
+#define mkBitReader(_mem) ((BitReader){ .mem = (_mem) })
+
+void bitreader_refill(BitReader *br) {
+    if(br->pos + 8 <= br->mem.len) {
+        u64 word;
+        memcpy(&word, br->mem.s + br->pos, sizeof(u64));
+        br->bits |= word << br->count;
+        br->pos += (63 - br->count) >> 3;
+        br->count |= 56;
+        return;
+    }
+
+    while(br->count <= 56) {
+        if(br->pos < br->mem.len) br->bits |= (u64)br->mem.s[br->pos] << br->count;
+        br->pos += 1;
+        br->count += 8;
+    }
+}
+
+u64 bitreader_peek(BitReader *br, u8 n) {
+    if(br->count < n) bitreader_refill(br);
+    return br->bits & ((1ull << n) - 1);
+}
+
+void bitreader_consume(BitReader *br, u8 n) {
+    br->bits >>= n;
+    br->count -= n;
+}
+
+u64 bitreader_pop(BitReader *br, u8 n) {
+    u64 value = bitreader_peek(br, n);
+    bitreader_consume(br, n);
+    return value;
+}
+
+usz bitreader_bitsConsumed(BitReader *br) {
+    return br->pos * 8 - br->count;
+}
+
+// NOTE: how many bytes of mem have been consumed, counting a partially
+// consumed byte as a whole one
+usz bitreader_bytesConsumed(BitReader *br) {
+    return (bitreader_bitsConsumed(br) + 7) / 8;
+}
+
+bool bitreader_overrun(BitReader *br) {
+    return bitreader_bitsConsumed(br) > br->mem.len * 8;
+}
+
+// NOTE: drops what's left of the current byte, and the
+// buffer, so that mem can be read directly from here on
+usz bitreader_alignToByte(BitReader *br) {
+    usz pos = bitreader_bytesConsumed(br);
+    br->pos = pos;
+    br->bits = 0;
+    br->count = 0;
+    return pos;
+}
+
+// NOTE: writes bits LSB-first into a StringBuilder, collecting them in a
+// 64-bit buffer that's flushed a whole number of bytes at a time. Up to
+// 56 bits can be written at once
+typedef struct {
+    StringBuilder *sb;
+
+    u64 bits;
+    u8 count;
+} BitWriter;
+
+#define BITWRITER_MAX_WRITE 56
+
+#define mkBitWriter(_sb) ((BitWriter){ .sb = (_sb) })
+
+bool bitwriter_flushBytes(BitWriter *bw) {
+    u8 bytes = bw->count >> 3;
+    if(bytes == 0) return true;
+
+    if(!sb_reserve(bw->sb, sizeof(u64))) return false;
+    memcpy(bw->sb->s.s + bw->sb->len, &bw->bits, sizeof(u64));
+    bw->sb->len += bytes;
+
+    bw->bits = bytes == 8 ? 0 : bw->bits >> (bytes * 8);
+    bw->count -= bytes * 8;
+    return true;
+}
+
+bool bitwriter_write(BitWriter *bw, u64 value, u8 n) {
+    if(n == 0) return true;
+    if(bw->count + n > 64) {
+        if(!bitwriter_flushBytes(bw)) return false;
+    }
+
+    bw->bits |= (value & ((1ull << n) - 1)) << bw->count;
+    bw->count += n;
+    return true;
+}
+
+// NOTE: writes out everything, padding the last byte with zeroes
+bool bitwriter_flush(BitWriter *bw) {
+    if(!bitwriter_flushBytes(bw)) return false;
+    if(bw->count == 0) return true;
+
+    if(!sb_appendByte(bw->sb, bw->bits)) return false;
+    bw->bits = 0;
+    bw->count = 0;
+    return true;
+}
+
 #endif // __LIB_BISTREAM
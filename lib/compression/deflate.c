@@ -4,21 +4,21 @@
 // Based on RFC-1951
 // https://datatracker.ietf.org/doc/html/rfc1951
 
+#include <pthread.h>
+#include <unistd.h>
+
 #include "types.h"
 #include "mem.h"
 #include "alloc.h"
 #include "stream.h"
 #include "bitstream.h"
 #include "dynar.h"
+#include "cpu.h"
 
 // TODO: replace magic numbers, prone to off by one errors
 
 // TODO: Add bounds checking and error handling in some places where I haven't yet
 
-// NOTE: this will probably die a horrible death on any bad input, particularly if
-// a file is constructed in a way that the Huffman codes will take more than 32
-// (more than 15 will be bad already) bits
-
 #define DEFLATE_BLOCK_NON_COMPRESSED 0b00
 #define DEFLATE_BLOCK_FIXED_HUFFMAN 0b01
 #define DEFLATE_BLOCK_DYNAMIC_HUFFMAN 0b10
@@ -27,8 +27,10 @@
 #define DEFLATE_HCL_REPEAT_ZERO_3 17
 #define DEFLATE_HCL_REPEAT_ZERO_7 18
 
+#define DEFLATE_MIN_LEN 3
 #define DEFLATE_MAX_LEN 258
 #define DEFLATE_MAX_DIST 32768
+#define DEFLATE_WINDOW_MASK (DEFLATE_MAX_DIST - 1)
 
 // TODO: this is bad, remove
 typedef struct {
@@ -65,62 +67,29 @@ typedef struct {
 #define mkDeflateItemLen(v) mkDeflateItem(v, DEFLATE_ITEM_LEN)
 #define mkDeflateItemDist(v) mkDeflateItem(v, DEFLATE_ITEM_DIST)
 
-typedef struct DeflateTreeNode DeflateTreeNode;
-struct DeflateTreeNode {
-    DeflateTreeNode *lhs;
-    DeflateTreeNode *rhs;
-    u8 *ptr;
-
-    u64 value;
-};
-#define mkDeflateLeaf(p, v) ((DeflateTreeNode){ .lhs = null, .rhs = null, .ptr = (p), .value = (v) })
-#define mkDeflateNode(l, r, v) ((DeflateTreeNode){ .lhs = (l), .rhs = (r), .ptr = null, .value = (v) })
-
-void Deflate_incrementNode(DeflateTreeNode *node) {
-    if(node->ptr != null) {
-        (*node->ptr)++;
-    }
-    else {
-        Deflate_incrementNode(node->lhs);
-        Deflate_incrementNode(node->rhs);
-    }
-}
-
 typedef struct {
     u32 code;
     u8 codeLen;
 } DeflateCompElement;
 
-typedef struct {
-    DeflateCompElement *lit;
-    DeflateCompElement *len;
-    DeflateCompElement *dist;
-} DeflateCompTable;
-
-bool Deflate_writeCompElement(BitStream *bs, DeflateCompElement e) {
-    int offset = 31;
-    for(int i = 0; i < e.codeLen; i++) {
-        bool result = bitstream_write(bs, (e.code >> offset) & 1);
-        offset -= 1;
-        if(!result) return result;
+u16 Deflate_reverseBits(u16 code, u8 len) {
+    u16 result = 0;
+    for(u8 i = 0; i < len; i++) {
+        result = (result << 1) | ((code >> i) & 1);
     }
-    return true;
+    return result;
 }
 
-typedef struct {
-    u32 code;
-    u8 codeLen;
-
-    byte value;
-    bool isDist;
-} DeflateDeCompElement;
-
-typedef struct {
-    bool error;
+// NOTE: takes a code aligned to the top bit, and keeps
+// it bit-reversed, since codes go out MSB-first
+DeflateCompElement Deflate_mkCompElement(u32 code, u8 codeLen) {
+    if(codeLen == 0) return (DeflateCompElement){0};
+    return (DeflateCompElement){ .code = Deflate_reverseBits(code >> (32 - codeLen), codeLen), .codeLen = codeLen };
+}
 
-    DeflateDeCompElement *list;
-    usz len;
-} DeflateDeCompTable;
+bool Deflate_writeCompElement(BitWriter *bw, DeflateCompElement e) {
+    return bitwriter_write(bw, e.code, e.codeLen);
+}
 
 u8 DeflateLitLenExtraBits[30] = {
     0,
@@ -140,14 +109,6 @@ u16 DeflateLinLenValues[30] = {
     67, 83, 99, 115, 131, 163, 195, 227, 258
 };
 
-i16 Deflate_lenToIndex(usz len) {
-    if(len == 258) return 29;
-    for(int i = 0; i < 29; i++) {
-        if(DeflateLinLenValues[i + 1] <= len) continue;
-        return i;
-    }
-    return -1;
-}
 
 u8 DeflateDistExtraBits[30] = {
     0, 0, 0, 0,
@@ -180,17 +141,6 @@ u16 DeflateDistValues[30] = {
     1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
 };
 
-i16 Deflate_distToIndex(usz dist) {
-    if(dist >= 24577) return 29;
-    for(int i = 0; i < 29; i++) {
-        if(DeflateDistValues[i + 1] <= dist) continue;
-        return i;
-    }
-    return -1;
-}
-
-// TODO: precalculate the entire structure
-
 u8 DeflateLitLenLengths[288] = {
     8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
     8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
@@ -215,632 +165,1178 @@ u8 DeflateDistLengths[32] = {
     5, 5, 5, 5, 5, 5, 5, 5
 };
 
-void Deflate_sortDeCompTable(DeflateDeCompTable table) {
-    // TODO: quicksort (too lazy now)
-    for(usz i = 0; i < table.len - 1; i++) {
-        for(usz j = 0; j < table.len - 1 - i; j++) {
-            if(table.list[j].code > table.list[j + 1].code) {
-                DeflateDeCompElement e = table.list[j];
-                table.list[j] = table.list[j + 1];
-                table.list[j + 1] = e;
-            }
-        }
+// NOTE: the decoder looks codes up in a table indexed by the next
+// DeflateDecodeTable.bits bits of input. Codes are read LSB-first, so
+// they're stored bit-reversed. Codes longer than that continue in a
+// subtable, indexed by the bits that follow
+#define DEFLATE_MAX_CODE_LEN 15
+
+#define DEFLATE_LITLEN_TABLE_BITS 10
+#define DEFLATE_DIST_TABLE_BITS 8
+#define DEFLATE_CODELEN_TABLE_BITS 7
+
+// NOTE: the most entries that a table with its subtables
+// can take up for a valid code (see zlib's enough.c)
+#define DEFLATE_LITLEN_TABLE_SIZE 1334
+#define DEFLATE_DIST_TABLE_SIZE 402
+#define DEFLATE_CODELEN_TABLE_SIZE 128
+
+// NOTE: len == 0 means there is no such code. If subBits != 0, value is
+// the offset of the subtable, and len is how many bits lead to it
+typedef struct {
+    u16 value;
+    u8 len;
+    u8 subBits;
+} DeflateDecodeEntry;
+
+typedef struct {
+    u8 bits;
+    usz cap;
+    DeflateDecodeEntry *entries;
+} DeflateDecodeTable;
+
+#define mkDeflateDecodeTable(_bits, _entries) ((DeflateDecodeTable){ .bits = (_bits), .cap = sizeof(_entries) / sizeof(DeflateDecodeEntry), .entries = (_entries) })
+
+bool Deflate_buildDecodeTable(DeflateDecodeTable *table, u8 *lengths, usz count) {
+    if(count > 288) return false;
+
+    u16 blCount[DEFLATE_MAX_CODE_LEN + 1] = {0};
+    for(usz i = 0; i < count; i++) {
+        if(lengths[i] > DEFLATE_MAX_CODE_LEN) return false;
+        blCount[lengths[i]] += 1;
     }
-}
+    blCount[0] = 0;
 
-DeflateDeCompTable Deflate_generateDeCompTable(Dynar(u8) lengths, Alloc *alloc) {
-    u16 blCount[32] = {0};
-    for(usz i = 0; i < lengths.len; i++) {
-        u8 len = dynar_index(u8, &lengths, i);
-        if(len >= 32) return none(DeflateDeCompTable);
-        blCount[len]++;
+    // NOTE: over-subscribed codes are never valid, and incomplete ones only
+    // when there is a single code (RFC 1951 3.2.7, and it's what zlib does)
+    i32 left = 1;
+    u8 maxLen = 0;
+    for(u8 len = 1; len <= DEFLATE_MAX_CODE_LEN; len++) {
+        left = (left << 1) - blCount[len];
+        if(left < 0) return false;
+        if(blCount[len] != 0) maxLen = len;
     }
+    if(left > 0 && maxLen > 1) return false;
 
-    u16 nextCode[32] = {0};
+    u16 nextCode[DEFLATE_MAX_CODE_LEN + 1] = {0};
     u16 code = 0;
-    blCount[0] = 0;
-    for(int i = 1; i < 32; i++) {
-        code = (code + blCount[i - 1]) << 1;
-        nextCode[i] = code;
+    for(u8 len = 1; len <= DEFLATE_MAX_CODE_LEN; len++) {
+        code = (code + blCount[len - 1]) << 1;
+        nextCode[len] = code;
     }
 
-    DeflateDeCompTable table = {
-        .list = (void *)AllocateBytesC(alloc, sizeof(DeflateDeCompElement) * lengths.len).s,
-        .len = lengths.len
-    };
+    usz primary = 1 << table->bits;
+    if(primary > table->cap) return false;
+    memset(table->entries, 0, sizeof(DeflateDecodeEntry) * primary);
+
+    u16 codes[288];
+    u8 subBits[1 << DEFLATE_LITLEN_TABLE_BITS] = {0};
+    for(usz i = 0; i < count; i++) {
+        u8 len = lengths[i];
+        if(len == 0) continue;
+        codes[i] = Deflate_reverseBits(nextCode[len], len);
+        nextCode[len] += 1;
+
+        if(len > table->bits) {
+            usz prefix = codes[i] & (primary - 1);
+            if(len - table->bits > subBits[prefix]) subBits[prefix] = len - table->bits;
+        }
+    }
 
-    u16 value = 0;
-    bool dist = false;
-    for(usz i = 0; i < table.len; i++) {
-        u8 len = dynar_index(u8, &lengths, i);
-        if(len >= 32) return none(DeflateDeCompTable);
-        table.list[i] = (DeflateDeCompElement){
-            .code = nextCode[len] << (32 - len),
-            .codeLen = len,
-            .value = value,
-            .isDist = dist
-        };
-        nextCode[len]++;
+    // NOTE: every subtable is as large as the longest code with its prefix needs
+    usz next = primary;
+    for(usz prefix = 0; prefix < primary; prefix++) {
+        if(subBits[prefix] == 0) continue;
+        usz size = 1 << subBits[prefix];
+        if(next + size > table->cap) return false;
+
+        table->entries[prefix] = (DeflateDecodeEntry){ .value = next, .len = table->bits, .subBits = subBits[prefix] };
+        memset(table->entries + next, 0, sizeof(DeflateDecodeEntry) * size);
+        next += size;
+    }
+
+    for(usz i = 0; i < count; i++) {
+        u8 len = lengths[i];
+        if(len == 0) continue;
 
-        if(value == 255) {
-            dist = true;
-            value = 0;
+        if(len <= table->bits) {
+            for(usz index = codes[i]; index < primary; index += 1 << len) {
+                table->entries[index] = (DeflateDecodeEntry){ .value = i, .len = len };
+            }
         }
         else {
-            value++;
+            DeflateDecodeEntry sub = table->entries[codes[i] & (primary - 1)];
+            u8 subLen = len - table->bits;
+            for(usz index = codes[i] >> table->bits; index < (1u << sub.subBits); index += 1 << subLen) {
+                table->entries[sub.value + index] = (DeflateDecodeEntry){ .value = i, .len = subLen };
+            }
         }
     }
 
-    Deflate_sortDeCompTable(table);
-    return table;
+    return true;
 }
 
-bool Deflate_decompress_block_huffman(
-    BitStream *in,
-    Stream *out, StringBuilder *sbout,
-    DeflateDeCompTable *litlen, DeflateDeCompTable *dist)
-{
-    while(true) {
-        u32 code = 0;
-        u8 offset = 31; // NOTE: because code is u32, and 1 << 31 sets the max bit
-        u8 codeLen = 0;
-        usz index = 0;
+// NOTE: canonical codes from their lengths (RFC-1951 3.2.2)
+void Deflate_compress_assignCodes(u8 *lengths, usz count, DeflateCompElement *codes) {
+    u16 lengthCount[DEFLATE_MAX_CODE_LEN + 1] = {0};
+    for(usz i = 0; i < count; i++) lengthCount[lengths[i]] += 1;
+    lengthCount[0] = 0;
+
+    u32 nextCode[DEFLATE_MAX_CODE_LEN + 1] = {0};
+    u32 code = 0;
+    for(u8 l = 1; l <= DEFLATE_MAX_CODE_LEN; l++) {
+        code = (code + lengthCount[l - 1]) << 1;
+        nextCode[l] = code;
+    }
+
+    for(usz i = 0; i < count; i++) {
+        u8 len = lengths[i];
+        codes[i] = len == 0 ? (DeflateCompElement){0} : Deflate_mkCompElement(nextCode[len]++ << (32 - len), len);
+    }
+}
 
-        while(true) {
-            MaybeBit b = bitstream_pop(in);
-            if(isNone(b)) return false;
+// NOTE: tables that never change, built once by Deflate_initializeTables.
+// DeflateLenIndex maps a length to its index in DeflateLinLenValues.
+// DeflateDistIndex maps dist - 1 to its index in DeflateDistValues below
+// 256, and (dist - 1) >> 7 from 256 onwards, which works since the codes
+// from there on all start at a multiple of 128 plus one (the same trick
+// as zlib's _dist_code). The fixed Huffman code is kept both ways, for
+// decoding and for encoding
+u8 DeflateLenIndex[DEFLATE_MAX_LEN + 1] = {0};
+u8 DeflateDistIndex[512] = {0};
+
+DeflateDecodeEntry DeflateFixedLitLenEntries[1 << DEFLATE_LITLEN_TABLE_BITS] = {0};
+DeflateDecodeEntry DeflateFixedDistEntries[1 << DEFLATE_DIST_TABLE_BITS] = {0};
+DeflateDecodeTable DeflateFixedLitLen = {
+    .bits = DEFLATE_LITLEN_TABLE_BITS,
+    .cap = sizeof(DeflateFixedLitLenEntries) / sizeof(DeflateDecodeEntry),
+    .entries = DeflateFixedLitLenEntries,
+};
+DeflateDecodeTable DeflateFixedDist = {
+    .bits = DEFLATE_DIST_TABLE_BITS,
+    .cap = sizeof(DeflateFixedDistEntries) / sizeof(DeflateDecodeEntry),
+    .entries = DeflateFixedDistEntries,
+};
 
-            code = code | (b.value << offset);
-            codeLen++;
-            offset--;
+DeflateCompElement DeflateFixedLitLenCodes[288] = {0};
+DeflateCompElement DeflateFixedDistCodes[32] = {0};
 
-            while(index < litlen->len && (code > litlen->list[index].code || codeLen > litlen->list[index].codeLen)) {
-                index++;
-            }
-            if(index >= litlen->len) return false;
+pthread_once_t Deflate_tablesOnce = PTHREAD_ONCE_INIT;
 
-            if(litlen->list[index].code == code && litlen->list[index].codeLen == codeLen) {
-                // found the code
-                break;
-            }
+void Deflate_initializeTables() {
+    for(u8 i = 1; i < 29; i++) {
+        for(usz len = DeflateLinLenValues[i]; len < DeflateLinLenValues[i + 1]; len++) {
+            DeflateLenIndex[len] = i;
         }
+    }
+    DeflateLenIndex[DEFLATE_MAX_LEN] = 29;
 
-        DeflateDeCompElement litlenEntry = litlen->list[index];
-
-        if(litlenEntry.isDist && litlenEntry.value == 0) {
-            // 256 = end of the block code
-            return true;
+    for(u8 i = 0; i < 30; i++) {
+        usz end = i == 29 ? DEFLATE_MAX_DIST + 1 : DeflateDistValues[i + 1];
+        for(usz dist = DeflateDistValues[i]; dist < end; dist++) {
+            usz index = dist - 1 < 256 ? dist - 1 : 256 + ((dist - 1) >> 7);
+            DeflateDistIndex[index] = i;
         }
-        else if(litlenEntry.isDist) {
-            u8 extraBits = DeflateLitLenExtraBits[litlenEntry.value];
-            u16 extraLen = 0;
-            for(int i = 0; i < extraBits; i++) {
-                MaybeBit b = bitstream_pop(in);
-                if(isNone(b)) return false;
-                // extraLen = (extraLen << 1) | b.value;
-                extraLen = extraLen | (b.value << i);
-            }
-            u16 len = DeflateLinLenValues[litlenEntry.value] + extraLen;
+    }
 
-            u32 distCode = 0;
-            u8 distOffset = 31;
-            u8 distCodeLen = 0;
-            usz distIndex = 0;
+    Deflate_buildDecodeTable(&DeflateFixedLitLen, DeflateLitLenLengths, 288);
+    Deflate_buildDecodeTable(&DeflateFixedDist, DeflateDistLengths, 32);
 
-            while(true) {
-                if(distCodeLen >= 30) return false;
+    Deflate_compress_assignCodes(DeflateLitLenLengths, 288, DeflateFixedLitLenCodes);
+    Deflate_compress_assignCodes(DeflateDistLengths, 32, DeflateFixedDistCodes);
+}
 
-                MaybeBit b = bitstream_pop(in);
-                if(isNone(b)) return false;
+#define Deflate_initTables() pthread_once(&Deflate_tablesOnce, Deflate_initializeTables)
 
-                distCode = distCode | (b.value << distOffset);
-                distCodeLen++;
-                distOffset--;
+// NOTE: these expect the tables to be initialized
+i16 Deflate_lenToIndex(usz len) {
+    if(len < DEFLATE_MIN_LEN || len > DEFLATE_MAX_LEN) return -1;
+    return DeflateLenIndex[len];
+}
 
-                while(distIndex < dist->len && (distCode > dist->list[distIndex].code || distCodeLen > dist->list[distIndex].codeLen)) {
-                    distIndex++;
-                }
-                if(distIndex >= dist->len) return false;
+i16 Deflate_distToIndex(usz dist) {
+    if(dist == 0 || dist > DEFLATE_MAX_DIST) return -1;
+    return DeflateDistIndex[dist - 1 < 256 ? dist - 1 : 256 + ((dist - 1) >> 7)];
+}
 
-                if(dist->list[distIndex].code == distCode && dist->list[distIndex].codeLen == distCodeLen) {
-                    // found the dist
-                    break;
-                }
-            }
+// NOTE: returns -1 if the input isn't a valid code
+i32 Deflate_decodeSymbol(BitReader *in, const DeflateDecodeTable *table) {
+    u64 bits = bitreader_peek(in, DEFLATE_MAX_CODE_LEN);
+    DeflateDecodeEntry entry = table->entries[bits & ((1u << table->bits) - 1)];
 
-            DeflateDeCompElement distEntry = dist->list[distIndex];
+    if(entry.subBits != 0) {
+        bitreader_consume(in, table->bits);
+        bits >>= table->bits;
+        entry = table->entries[entry.value + (bits & ((1u << entry.subBits) - 1))];
+    }
 
-            u8 extraDistBits = DeflateDistExtraBits[distEntry.value];
-            u16 extraDist = 0;
-            for(int i = 0; i < extraDistBits; i++) {
-                MaybeBit b = bitstream_pop(in);
-                if(isNone(b)) return false;
-                // extraDist = (extraDist << 1) | b.value;
-                extraDist = extraDist | (b.value << i);
-            }
-            u16 fdist = DeflateDistValues[distEntry.value] + extraDist;
-            if(fdist > sbout->len) return false;
+    if(entry.len == 0) return -1;
+    bitreader_consume(in, entry.len);
+    return entry.value;
+}
 
-            usz origin = (sbout->len - fdist);
-            for(usz i = origin; i < origin + len; i++) {
-                bool result = sb_appendChar(sbout, sbout->s.s[i]);
-                if(!result) return false;
-            }
+bool Deflate_decompress_block_huffman(BitReader *in, StringBuilder *out, const DeflateDecodeTable *litlen, const DeflateDecodeTable *dist) {
+    while(true) {
+        i32 symbol = Deflate_decodeSymbol(in, litlen);
+        if(symbol < 0) return false;
+        if(bitreader_overrun(in)) return false;
+
+        if(symbol < 256) {
+            checkRet(sb_reserve(out, 1));
+            out->s.s[out->len] = symbol;
+            out->len += 1;
+            continue;
+        }
+
+        // 256 = end of the block code
+        if(symbol == 256) return true;
+
+        usz lenIndex = symbol - 256;
+        if(lenIndex >= 30) return false;
+        usz len = DeflateLinLenValues[lenIndex] + bitreader_pop(in, DeflateLitLenExtraBits[lenIndex]);
+
+        i32 distIndex = Deflate_decodeSymbol(in, dist);
+        if(distIndex < 0 || distIndex >= 30) return false;
+        usz fdist = DeflateDistValues[distIndex] + bitreader_pop(in, DeflateDistExtraBits[distIndex]);
+
+        if(bitreader_overrun(in)) return false;
+        if(fdist > out->len) return false;
+
+        checkRet(sb_reserve(out, len));
+        byte *dst = out->s.s + out->len;
+        byte *src = dst - fdist;
+        if(fdist >= len) {
+            memcpy(dst, src, len);
         }
         else {
-            bool result = stream_writeChar(out, litlenEntry.value);
-            if(!result) return false;
+            // NOTE: the match overlaps what it's producing
+            for(usz i = 0; i < len; i++) dst[i] = src[i];
         }
+        out->len += len;
     }
 }
 
-bool Deflate_decompress_block_noncomp(Stream *in, Stream *out, Alloc *alloc) {
-    u16 len = 0;
-    u16 nlen = 0;
-    Mem m;
-    ResultRead result;
+bool Deflate_decompress_block_noncomp(BitReader *in, StringBuilder *out) {
+    usz pos = bitreader_alignToByte(in);
+    Mem mem = in->mem;
+    if(pos + 4 > mem.len) return false;
+
+    u16 len = mem.s[pos] | (mem.s[pos + 1] << 8);
+    u16 nlen = mem.s[pos + 2] | (mem.s[pos + 3] << 8);
+    if((len ^ nlen) != 0xFFFF) return false;
+    pos += 4;
+
+    if(pos + len > mem.len) return false;
+    checkRet(sb_appendMem(out, mkMem(mem.s + pos, len)));
+    in->pos = pos + len;
+    return true;
+}
+
+bool Deflate_decompress_readDynamicTables(BitReader *in, DeflateDecodeTable *litlen, DeflateDecodeTable *dist) {
+    usz hlit = bitreader_pop(in, 5) + 257;
+    usz hdist = bitreader_pop(in, 5) + 1;
+    usz hclen = bitreader_pop(in, 4) + 4;
+    if(hlit > 286 || hdist > 30) return false;
 
-    m = mkMem(&len, sizeof(u16));
-    result = stream_read(in, m);
-    if(result.partial || result.error) return false;
+    u8 codeLenLengths[19] = {0};
+    for(usz i = 0; i < hclen; i++) {
+        codeLenLengths[DeflateCodeLenValues[i]] = bitreader_pop(in, 3);
+    }
+
+    DeflateDecodeEntry codeLenEntries[DEFLATE_CODELEN_TABLE_SIZE];
+    DeflateDecodeTable codeLen = mkDeflateDecodeTable(DEFLATE_CODELEN_TABLE_BITS, codeLenEntries);
+    checkRet(Deflate_buildDecodeTable(&codeLen, codeLenLengths, 19));
 
-    m = mkMem(&nlen, sizeof(u16));
-    result = stream_read(in, m);
-    if(result.partial || result.error) return false;
+    u8 lengths[286 + 30] = {0};
+    usz count = 0;
+    while(count < hlit + hdist) {
+        i32 symbol = Deflate_decodeSymbol(in, &codeLen);
+        if(symbol < 0) return false;
+        if(bitreader_overrun(in)) return false;
 
-    if(len != (u16)~nlen) return false;
+        if(symbol <= 15) {
+            lengths[count] = symbol;
+            count += 1;
+            continue;
+        }
+
+        u8 value = 0;
+        usz times = 0;
+        if(symbol == DEFLATE_HCL_COPY_PREVIOUS_2) {
+            if(count == 0) return false;
+            value = lengths[count - 1];
+            times = 3 + bitreader_pop(in, 2);
+        }
+        else if(symbol == DEFLATE_HCL_REPEAT_ZERO_3) {
+            times = 3 + bitreader_pop(in, 3);
+        }
+        else {
+            times = 11 + bitreader_pop(in, 7);
+        }
+
+        if(count + times > hlit + hdist) return false;
+        memset(lengths + count, value, times);
+        count += times;
+    }
 
-    // NOTE: use a variation of stream_route maybe?
-    m = AllocateBytesC(alloc, len);
-    result = stream_read(in, m);
-    if(result.partial || result.error) return false;
+    // NOTE: a block without the end of block code can't end
+    if(lengths[256] == 0) return false;
 
-    stream_write(out, m);
-    FreeC(alloc, m.s);
+    checkRet(Deflate_buildDecodeTable(litlen, lengths, hlit));
+    checkRet(Deflate_buildDecodeTable(dist, lengths + hlit, hdist));
     return true;
 }
 
-DeflateDeCompResult Deflate_decompress(Stream *raw, Alloc *alloc) {
-    BitStream in = mkBitStream(raw);
+// NOTE: decodes the deflate stream at the start of raw, consumed
+// is how many bytes of raw it took up
+// NOTE: dict is a preset dictionary, the data that the stream was compressed
+// against, which comes before the output. It's decoded after it, and is
+// taken out of the output at the end. Only its last DEFLATE_MAX_DIST
+// bytes can be reached, so that's all that's used
+DeflateDeCompResult Deflate_decompressMemDict(Mem raw, Mem dict, Alloc *alloc) {
+    Deflate_initTables();
+    BitReader in = mkBitReader(raw);
 
     StringBuilder sb = mkStringBuilder();
     sb.alloc = alloc;
-    Stream out = mkStreamSb(&sb);
+
+    if(dict.len > DEFLATE_MAX_DIST) dict = memIndex(dict, dict.len - DEFLATE_MAX_DIST);
+    if(dict.len != 0 && !sb_appendMem(&sb, dict)) return DeflateNone;
+
+    DeflateDecodeEntry litlenEntries[DEFLATE_LITLEN_TABLE_SIZE];
+    DeflateDecodeEntry distEntries[DEFLATE_DIST_TABLE_SIZE];
+    DeflateDecodeTable litlen = mkDeflateDecodeTable(DEFLATE_LITLEN_TABLE_BITS, litlenEntries);
+    DeflateDecodeTable dist = mkDeflateDecodeTable(DEFLATE_DIST_TABLE_BITS, distEntries);
 
     bool finalBlock = false;
     do {
-        MaybeBit final = bitstream_pop(&in);
-        if(isNone(final)) return DeflateNone;
-        if(final.value) finalBlock = true;
-
-        MaybeBit a = bitstream_pop(&in);
-        MaybeBit b = bitstream_pop(&in);
-        if(isNone(a) || isNone(b)) return DeflateNone; // shouldn't ever happen
-        
-        byte blockType = a.value | (b.value << 1);
-        if(blockType == DEFLATE_BLOCK_NON_COMPRESSED) {
-            bitstream_discard(&in);
-            bool result = Deflate_decompress_block_noncomp(in.s, &out, ALLOC);
-            if(!result) return DeflateNone;
+        finalBlock = bitreader_pop(&in, 1);
+        byte blockType = bitreader_pop(&in, 2);
+
+        bool result = false;
+        if(bitreader_overrun(&in)) {}
+        else if(blockType == DEFLATE_BLOCK_NON_COMPRESSED) {
+            result = Deflate_decompress_block_noncomp(&in, &sb);
         }
         else if(blockType == DEFLATE_BLOCK_FIXED_HUFFMAN) {
-            Dynar(u8) litlenDynar = mkDynarML(u8, mkMem(DeflateLitLenLengths, 288), 288);
-            Dynar(u8) distDynar = mkDynarML(u8, mkMem(DeflateDistLengths, 32), 32);
+            result = Deflate_decompress_block_huffman(&in, &sb, &DeflateFixedLitLen, &DeflateFixedDist);
+        }
+        else if(blockType == DEFLATE_BLOCK_DYNAMIC_HUFFMAN) {
+            result = Deflate_decompress_readDynamicTables(&in, &litlen, &dist)
+                  && Deflate_decompress_block_huffman(&in, &sb, &litlen, &dist);
+        }
+        if(!result) {
+            if(sb.s.s != null) FreeC(alloc, sb.s.s);
+            return DeflateNone;
+        }
+    } while(!finalBlock);
+
+    if(dict.len != 0) {
+        memmove(sb.s.s, sb.s.s + dict.len, sb.len - dict.len);
+        sb.len -= dict.len;
+    }
+
+    return mkDeflateDeCompResult(sb_build(sb), bitreader_bytesConsumed(&in));
+}
+#define Deflate_decompressMem(raw, alloc) Deflate_decompressMemDict(raw, memnull, alloc)
+
+// NOTE: raw has to be a string stream, since the decoder reads ahead.
+// It's moved past the deflate stream, to whatever follows it
+DeflateDeCompResult Deflate_decompressDict(Stream *raw, Mem dict, Alloc *alloc) {
+    if(raw->type != STREAM_STR) return DeflateNone;
+    if(raw->hasPeek) {
+        raw->hasPeek = false;
+        raw->i -= 1;
+    }
 
-            DeflateDeCompTable litlen = Deflate_generateDeCompTable(litlenDynar, ALLOC);
-            if(isNone(litlen)) return DeflateNone;
-            DeflateDeCompTable dist = Deflate_generateDeCompTable(distDynar, ALLOC);
-            if(isNone(dist)) return DeflateNone;
+    DeflateDeCompResult result = Deflate_decompressMemDict(memIndex(raw->s, raw->i), dict, alloc);
+    if(isJust(result)) raw->i += result.consumed;
+    return result;
+}
+#define Deflate_decompress(raw, alloc) Deflate_decompressDict(raw, memnull, alloc)
+
+// NOTE: a decoder that can be fed the input in pieces of any size, and
+// writes the output into whatever buffer it's given. The input is copied
+// into its own buffer, from which it's decoded one step (block header,
+// symbol) at a time. A step that runs out of input is undone, and picked
+// up again once there's more. The last DEFLATE_MAX_DIST bytes of output
+// are kept in a window, which is what matches are copied from
+#define DEFLATE_DECODER_INPUT 4096
+
+// NOTE: the most input a step can take up. A dynamic block header is at
+// most 3 + 14 + 19 * 3 + 316 * 14 bits, a symbol with its distance 48.
+// A step failing with less than that available is waiting for input,
+// otherwise the input is invalid
+#define DEFLATE_DECODER_HEADER_STEP 576
+#define DEFLATE_DECODER_SYMBOL_STEP 8
+
+#define DEFLATE_DECODER_BLOCK 0
+#define DEFLATE_DECODER_STORED 1
+#define DEFLATE_DECODER_HUFFMAN 2
+#define DEFLATE_DECODER_DONE 3
+#define DEFLATE_DECODER_ERROR 4
+
+typedef struct {
+    u8 state;
+    bool finalBlock;
+    // NOTE: fixed blocks use the shared tables, which are only ever read,
+    // dynamic blocks are built into the ones in here
+    bool fixedBlock;
+
+    byte input[DEFLATE_DECODER_INPUT];
+    usz inputLen;
+    // NOTE: how many bits of input[0] were already used
+    u8 inputBit;
+
+    byte window[DEFLATE_MAX_DIST];
+    u64 total;
+
+    usz storedLeft;
+    // NOTE: what's left of a match that didn't fit into the output
+    usz copyLen;
+    usz copyDist;
+
+    DeflateDecodeEntry litlenEntries[DEFLATE_LITLEN_TABLE_SIZE];
+    DeflateDecodeEntry distEntries[DEFLATE_DIST_TABLE_SIZE];
+} DeflateDecoder;
+
+typedef struct {
+    bool error;
+
+    usz consumed;
+    usz produced;
+    bool done;
+} DeflateDecodeResult;
+
+void Deflate_decoderInit(DeflateDecoder *decoder) {
+    Deflate_initTables();
+    decoder->state = DEFLATE_DECODER_BLOCK;
+    decoder->finalBlock = false;
+    decoder->fixedBlock = false;
+    decoder->inputLen = 0;
+    decoder->inputBit = 0;
+    decoder->total = 0;
+    decoder->storedLeft = 0;
+    decoder->copyLen = 0;
+    decoder->copyDist = 0;
+}
+
+// NOTE: see Deflate_decompressMemDict, has to come before any input
+void Deflate_decoderSetDictionary(DeflateDecoder *decoder, Mem dict) {
+    if(dict.len > DEFLATE_MAX_DIST) dict = memIndex(dict, dict.len - DEFLATE_MAX_DIST);
+    memcpy(decoder->window, dict.s, dict.len);
+    decoder->total = dict.len;
+}
+
+// NOTE: once the decoder is done, the input that came after the deflate stream
+#define Deflate_decoderTrailing(decoder) mkMem((decoder)->input, (decoder)->inputLen)
+
+void Deflate_decoderPutByte(DeflateDecoder *decoder, byte *dst, byte b) {
+    *dst = b;
+    decoder->window[decoder->total & DEFLATE_WINDOW_MASK] = b;
+    decoder->total += 1;
+}
+
+void Deflate_decoderPut(DeflateDecoder *decoder, byte *dst, byte *src, usz len) {
+    memcpy(dst, src, len);
+    for(usz i = 0; i < len; i++) {
+        decoder->window[(decoder->total + i) & DEFLATE_WINDOW_MASK] = src[i];
+    }
+    decoder->total += len;
+}
+
+void Deflate_decoderCopy(DeflateDecoder *decoder, Mem out, usz *produced) {
+    usz len = decoder->copyLen;
+    if(len > out.len - *produced) len = out.len - *produced;
+
+    byte *dst = out.s + *produced;
+    for(usz i = 0; i < len; i++) {
+        byte b = decoder->window[(decoder->total - decoder->copyDist) & DEFLATE_WINDOW_MASK];
+        Deflate_decoderPutByte(decoder, dst + i, b);
+    }
+
+    decoder->copyLen -= len;
+    *produced += len;
+}
+
+// NOTE: decodes a block header, and the tables of a dynamic block into
+// the decoder's own ones (see Deflate_decoderTables)
+bool Deflate_decoderBlockHeader(DeflateDecoder *decoder, BitReader *in, DeflateDecodeTable *litlen, DeflateDecodeTable *dist) {
+    decoder->finalBlock = bitreader_pop(in, 1);
+    byte blockType = bitreader_pop(in, 2);
+
+    if(blockType == DEFLATE_BLOCK_NON_COMPRESSED) {
+        usz pos = bitreader_alignToByte(in);
+        if(pos + 4 > in->mem.len) return false;
+
+        u16 len = in->mem.s[pos] | (in->mem.s[pos + 1] << 8);
+        u16 nlen = in->mem.s[pos + 2] | (in->mem.s[pos + 3] << 8);
+        if((len ^ nlen) != 0xFFFF) return false;
+
+        in->pos = pos + 4;
+        decoder->storedLeft = len;
+        decoder->state = DEFLATE_DECODER_STORED;
+        return true;
+    }
+
+    bool result = false;
+    decoder->fixedBlock = blockType == DEFLATE_BLOCK_FIXED_HUFFMAN;
+    if(decoder->fixedBlock) {
+        result = true;
+    }
+    else if(blockType == DEFLATE_BLOCK_DYNAMIC_HUFFMAN) {
+        result = Deflate_decompress_readDynamicTables(in, litlen, dist);
+    }
+
+    if(!result || bitreader_overrun(in)) return false;
+    decoder->state = DEFLATE_DECODER_HUFFMAN;
+    return true;
+}
+
+// NOTE: the tables that the current block is decoded with
+void Deflate_decoderTables(DeflateDecoder *decoder, DeflateDecodeTable *ownLitlen, DeflateDecodeTable *ownDist,
+                           const DeflateDecodeTable **litlen, const DeflateDecodeTable **dist) {
+    *litlen = decoder->fixedBlock ? &DeflateFixedLitLen : ownLitlen;
+    *dist = decoder->fixedBlock ? &DeflateFixedDist : ownDist;
+}
+
+// NOTE: a symbol, returns false if it's not valid or there wasn't enough input
+bool Deflate_decoderSymbol(DeflateDecoder *decoder, BitReader *in, const DeflateDecodeTable *litlen, const DeflateDecodeTable *dist, Mem out, usz *produced) {
+    i32 symbol = Deflate_decodeSymbol(in, litlen);
+    if(symbol < 0 || bitreader_overrun(in)) return false;
+
+    if(symbol < 256) {
+        Deflate_decoderPutByte(decoder, out.s + *produced, symbol);
+        *produced += 1;
+        return true;
+    }
+
+    if(symbol == 256) {
+        decoder->state = decoder->finalBlock ? DEFLATE_DECODER_DONE : DEFLATE_DECODER_BLOCK;
+        return true;
+    }
+
+    usz lenIndex = symbol - 256;
+    if(lenIndex >= 30) return false;
+    usz len = DeflateLinLenValues[lenIndex] + bitreader_pop(in, DeflateLitLenExtraBits[lenIndex]);
+
+    i32 distIndex = Deflate_decodeSymbol(in, dist);
+    if(distIndex < 0 || distIndex >= 30) return false;
+    usz fdist = DeflateDistValues[distIndex] + bitreader_pop(in, DeflateDistExtraBits[distIndex]);
+
+    if(bitreader_overrun(in)) return false;
+    if(fdist > decoder->total) return false;
+
+    decoder->copyLen = len;
+    decoder->copyDist = fdist;
+    Deflate_decoderCopy(decoder, out, produced);
+    return true;
+}
+
+// NOTE: takes as much of in as fits into the decoder's buffer, and decodes
+// into out until it's full, the input runs out or the stream ends. What's
+// taken but not decoded yet is kept for the next call
+DeflateDecodeResult Deflate_decoderDecode(DeflateDecoder *decoder, Mem in, Mem out) {
+    DeflateDecodeResult result = {0};
+    if(decoder->state == DEFLATE_DECODER_ERROR) return none(DeflateDecodeResult);
+    if(decoder->state == DEFLATE_DECODER_DONE) {
+        result.done = true;
+        return result;
+    }
+
+    usz space = DEFLATE_DECODER_INPUT - decoder->inputLen;
+    result.consumed = in.len < space ? in.len : space;
+    memcpy(decoder->input + decoder->inputLen, in.s, result.consumed);
+    decoder->inputLen += result.consumed;
 
-            bool result = Deflate_decompress_block_huffman(&in, &out, &sb, &litlen, &dist);
-            if(!result) return DeflateNone;
+    BitReader br = mkBitReader(mkMem(decoder->input, decoder->inputLen));
+    bitreader_pop(&br, decoder->inputBit);
+
+    DeflateDecodeTable ownLitlen = mkDeflateDecodeTable(DEFLATE_LITLEN_TABLE_BITS, decoder->litlenEntries);
+    DeflateDecodeTable ownDist = mkDeflateDecodeTable(DEFLATE_DIST_TABLE_BITS, decoder->distEntries);
+    const DeflateDecodeTable *litlen;
+    const DeflateDecodeTable *dist;
+    Deflate_decoderTables(decoder, &ownLitlen, &ownDist, &litlen, &dist);
+
+    while(decoder->state != DEFLATE_DECODER_DONE && decoder->state != DEFLATE_DECODER_ERROR) {
+        if(decoder->copyLen != 0) {
+            Deflate_decoderCopy(decoder, out, &result.produced);
+            if(decoder->copyLen != 0) break;
         }
-        else if(blockType == DEFLATE_BLOCK_DYNAMIC_HUFFMAN) {
-            u16 hlit = 0;
-            for(int i = 0; i < 5; i++) {
-                MaybeBit b = bitstream_pop(&in);
-                if(isNone(b)) return DeflateNone;
-                // hlit = (hlit << 1) | b.value;
-                hlit = hlit | (b.value << i);
+
+        BitReader before = br;
+        usz available = decoder->inputLen - bitreader_bitsConsumed(&br) / 8;
+
+        if(decoder->state == DEFLATE_DECODER_BLOCK) {
+            if(Deflate_decoderBlockHeader(decoder, &br, &ownLitlen, &ownDist)) {
+                Deflate_decoderTables(decoder, &ownLitlen, &ownDist, &litlen, &dist);
+                continue;
             }
-            hlit += 257; 
-
-            u8 hdist = 0;
-            for(int i = 0; i < 5; i++) {
-                MaybeBit b = bitstream_pop(&in);
-                if(isNone(b)) return DeflateNone;
-                // hdist = (hdist << 1) | b.value;
-                hdist = hdist | (b.value << i);
+
+            br = before;
+            if(available < DEFLATE_DECODER_HEADER_STEP) break;
+            decoder->state = DEFLATE_DECODER_ERROR;
+        }
+        else if(decoder->state == DEFLATE_DECODER_STORED) {
+            usz pos = bitreader_alignToByte(&br);
+            usz len = decoder->storedLeft;
+            if(len > decoder->inputLen - pos) len = decoder->inputLen - pos;
+            if(len > out.len - result.produced) len = out.len - result.produced;
+
+            Deflate_decoderPut(decoder, out.s + result.produced, decoder->input + pos, len);
+            result.produced += len;
+            decoder->storedLeft -= len;
+            br.pos = pos + len;
+
+            if(decoder->storedLeft == 0) {
+                decoder->state = decoder->finalBlock ? DEFLATE_DECODER_DONE : DEFLATE_DECODER_BLOCK;
             }
-            hdist += 1;
-
-            u8 hclen = 0;
-            for(int i = 0; i < 4; i++) {
-                MaybeBit b = bitstream_pop(&in);
-                if(isNone(b)) return DeflateNone;
-                // hclen = (hclen << 1) | b.value;
-                hclen = hclen | (b.value << i);
+            else if(len == 0) {
+                break;
             }
-            hclen += 4;
-
+        }
+        else {
+            if(result.produced == out.len) break;
+            if(Deflate_decoderSymbol(decoder, &br, litlen, dist, out, &result.produced)) continue;
 
-            Dynar(u8) hclenLengths = mkDynarCA(u8, 19, ALLOC);
-            hclenLengths.len = 19;
-            for(int i = 0; i < hclen; i++) {
-                MaybeBit a = bitstream_pop(&in);
-                MaybeBit b = bitstream_pop(&in);
-                MaybeBit c = bitstream_pop(&in);
-                if(isNone(a) || isNone(b) || isNone(c)) return DeflateNone;
+            br = before;
+            if(available < DEFLATE_DECODER_SYMBOL_STEP) break;
+            decoder->state = DEFLATE_DECODER_ERROR;
+        }
+    }
 
-                // u8 value = (a.value << 2) | (b.value << 1) | c.value;
-                u8 value = a.value | (b.value << 1) | (c.value << 2);
-                dynar_set(u8, &hclenLengths, DeflateCodeLenValues[i], value);
+    if(decoder->state == DEFLATE_DECODER_ERROR) return none(DeflateDecodeResult);
 
-                // *((u8 *)(hclenLengths.mem.s) + DeflateCodeLenValues[i]) = value;
+    // NOTE: the rest of the last byte is padding
+    usz bits = bitreader_bitsConsumed(&br);
+    if(decoder->state == DEFLATE_DECODER_DONE) bits = (bits + 7) / 8 * 8;
 
-                // bool result;
-                // dynar_append(&hclenLengths, u8, value, result);
-                // if(!result) return memnull;
-            }
+    usz bytes = bits / 8;
+    memmove(decoder->input, decoder->input + bytes, decoder->inputLen - bytes);
+    decoder->inputLen -= bytes;
+    decoder->inputBit = bits % 8;
 
+    result.done = decoder->state == DEFLATE_DECODER_DONE;
+    return result;
+}
 
+// NOTE: the most symbols an alphabet has, which is the literal/length one
+#define DEFLATE_MAX_SYMBOLS 286
 
-            DeflateDeCompTable hclenTable = Deflate_generateDeCompTable(hclenLengths, ALLOC);
-            FreeC(ALLOC, hclenLengths.mem.s);
-
-            Dynar(u8) hlitAndHdistLengths = mkDynarCA(u8, hlit + hdist, ALLOC);
-            u8 last = 0;
-            while(hlitAndHdistLengths.len < hlit + hdist) {
-                u32 code = 0;
-                u32 offset = 31;
-                u32 codeLen = 0;
-                usz index = 0;
-
-                while(true) {
-                    if(codeLen >= 8) return DeflateNone;
-
-                    MaybeBit b = bitstream_pop(&in);
-                    if(isNone(b)) return DeflateNone;
-                    code = code | (b.value << offset);
-
-                    offset--;
-                    codeLen++;
-                    while(index < hclenTable.len && (code > hclenTable.list[index].code || codeLen > hclenTable.list[index].codeLen)) {
-                        index++;
-                    }
-                    if(index >= hclenTable.len) return DeflateNone;
-
-                    if(code == hclenTable.list[index].code && codeLen == hclenTable.list[index].codeLen) {
-                        break;
-                    }
-                }
-
-                DeflateDeCompElement entry = hclenTable.list[index];
-
-                if(entry.value >= 19) return DeflateNone;
-                // byte value = DeflateCodeLenValues[entry.value];
-                byte value = entry.value;
-
-                if(/*value >= 0 &&*/ value <= 15) {
-                    last = value;
-
-                    bool result;
-                    dynar_append(&hlitAndHdistLengths, u8, value, result);
-                    if(!result) return DeflateNone;
-                }
-                else if(value == DEFLATE_HCL_COPY_PREVIOUS_2) {
-                    MaybeBit a = bitstream_pop(&in);
-                    MaybeBit b = bitstream_pop(&in);
-                    if(isNone(a) || isNone(b)) return DeflateNone;
-                    // usz times = (a.value << 1) | b.value;
-                    usz times = a.value | (b.value << 1);
-                    times += 3;
-                    for(usz i = 0; i < times; i++) {
-                        bool result;
-                        dynar_append(&hlitAndHdistLengths, u8, last, result);
-                        if(!result) return DeflateNone;
-                    }
-                }
-                else if(value == DEFLATE_HCL_REPEAT_ZERO_3) {
-                    last = 0;
-                    usz times = 0;
-                    for(int i = 0; i < 3; i++) {
-                        MaybeBit b = bitstream_pop(&in);
-                        if(isNone(b)) return DeflateNone;
-                        // times = (times << 1) | b.value;
-                        times = times | (b.value << i);
-                    }
-                    times += 3;
-                    for(usz i = 0; i < times; i++) {
-                        bool result;
-                        dynar_append(&hlitAndHdistLengths, u8, 0, result);
-                        if(!result) return DeflateNone;
-                    }
-                }
-                else if(value == DEFLATE_HCL_REPEAT_ZERO_7) {
-                    last = 0;
-                    usz times = 0;
-                    for(int i = 0; i < 7; i++) {
-                        MaybeBit b = bitstream_pop(&in);
-                        if(isNone(b)) return DeflateNone;
-                        // times = (times << 1) | b.value;
-                        times = times | (b.value << i);
-                    }
-                    times += 11;
-                    for(usz i = 0; i < times; i++) {
-                        bool result;
-                        dynar_append(&hlitAndHdistLengths, u8, 0, result);
-                        if(!result) return DeflateNone;
-                    }
-                }
-                else { return DeflateNone; }
-            }
+typedef struct {
+    u32 freq;
+    u16 symbol;
+} DeflateHuffmanSymbol;
+
+// NOTE: radix sort by frequency, 8 bits at a time. It's stable,
+// so symbols with the same frequency stay in their order. Bytes
+// above the highest frequency's are all zero, so they're skipped
+void Deflate_sortSymbols(DeflateHuffmanSymbol *symbols, usz count) {
+    DeflateHuffmanSymbol sorted[DEFLATE_MAX_SYMBOLS];
+
+    u32 maxFreq = 0;
+    for(usz i = 0; i < count; i++) {
+        if(symbols[i].freq > maxFreq) maxFreq = symbols[i].freq;
+    }
 
-            Dynar(u8) hlitLengths = hlitAndHdistLengths;
-            hlitLengths.len = hlit;
+    for(u8 shift = 0; shift < 32 && (maxFreq >> shift) != 0; shift += 8) {
+        usz offsets[256] = {0};
+        for(usz i = 0; i < count; i++) {
+            offsets[(symbols[i].freq >> shift) & 0xff] += 1;
+        }
 
-            Dynar(u8) hdistLengths = hlitAndHdistLengths;
-            hdistLengths.mem.s += hlit;
-            hdistLengths.mem.len = hdist;
-            hdistLengths.len = hdist;
+        usz total = 0;
+        for(usz i = 0; i < 256; i++) {
+            usz amount = offsets[i];
+            offsets[i] = total;
+            total += amount;
+        }
 
-            DeflateDeCompTable litlen = Deflate_generateDeCompTable(hlitLengths, ALLOC);
-            DeflateDeCompTable dist = Deflate_generateDeCompTable(hdistLengths, ALLOC);
+        for(usz i = 0; i < count; i++) {
+            sorted[offsets[(symbols[i].freq >> shift) & 0xff]++] = symbols[i];
+        }
+        memcpy(symbols, sorted, count * sizeof(DeflateHuffmanSymbol));
+    }
+}
 
-            bool result = Deflate_decompress_block_huffman(&in, &out, &sb, &litlen, &dist);
-            if(!result) return DeflateNone;
+// NOTE: Moffat and Katajainen's in-place algorithm. weights are sorted
+// ascending, and are replaced with the depth of each of them in a Huffman
+// tree. The tree is never built, the same array first holds the weights
+// of the internal nodes along with their parents, then their depths
+void Deflate_huffmanDepths(u32 *weights, usz count) {
+    usz root = 0;
+    usz leaf = 2;
+    weights[0] += weights[1];
+
+    for(usz next = 1; next < count - 1; next++) {
+        if(leaf >= count || weights[root] < weights[leaf]) {
+            weights[next] = weights[root];
+            weights[root++] = next;
+        }
+        else {
+            weights[next] = weights[leaf++];
+        }
 
-            Free(litlen.list);
-            Free(dist.list);
-            Free(hlitAndHdistLengths.mem.s);
-            Free(hclenTable.list);
+        if(leaf >= count || (root < next && weights[root] < weights[leaf])) {
+            weights[next] += weights[root];
+            weights[root++] = next;
         }
         else {
-            return DeflateNone;
+            weights[next] += weights[leaf++];
         }
-    } while(!finalBlock);
+    }
+
+    weights[count - 2] = 0;
+    for(isz next = count - 3; next >= 0; next--) {
+        weights[next] = weights[weights[next]] + 1;
+    }
 
-    return mkDeflateDeCompResult(sb_build(sb), in.bytesConsumed);
+    usz available = 1;
+    usz used = 0;
+    u32 depth = 0;
+    isz internal = count - 2;
+    isz next = count - 1;
+    while(available > 0) {
+        while(internal >= 0 && weights[internal] == depth) {
+            used += 1;
+            internal -= 1;
+        }
+        while(available > used) {
+            weights[next--] = depth;
+            available -= 1;
+        }
+        available = 2 * used;
+        depth += 1;
+        used = 0;
+    }
 }
 
-bool Deflate_compress_generateCodeLengths(Dynar(DeflateTreeNode *) *nodes, usz len, u32 freq[], u8 codeLen[]) {
+// NOTE: DEFLATE caps code lengths at 15 bits (7 for the code length alphabet).
+// Codes that come out longer are cut to maxCodeLen, which over-subscribes the
+// code, so then codes at maxCodeLen are taken away one at a time, each time
+// moving one of the longest codes shorter than that a level down, until it
+// adds up again, the same as zlib and miniz do. The longest codes then go
+// to the least frequent symbols. It's not optimal like package-merge,
+// but only a handful of codes ever move, and only on skewed inputs
+bool Deflate_compress_generateLimitedCodeLengths(usz len, u32 freq[], u8 codeLen[], u8 maxCodeLen) {
+    if(len > DEFLATE_MAX_SYMBOLS || maxCodeLen > DEFLATE_MAX_CODE_LEN) return false;
+    memset(codeLen, 0, len);
+
+    DeflateHuffmanSymbol symbols[DEFLATE_MAX_SYMBOLS];
+    usz count = 0;
     for(usz i = 0; i < len; i++) {
         if(freq[i] == 0) continue;
-        AllocateVar(DeflateTreeNode, node, mkDeflateLeaf(&codeLen[i], freq[i]));
-
-        bool result;
-        dynar_append(nodes, DeflateTreeNode *, node, result);
-        if(!result) return false;
+        symbols[count++] = (DeflateHuffmanSymbol){ .freq = freq[i], .symbol = i };
     }
 
-    if(nodes->len == 1) {
-        DeflateTreeNode *node = dynar_index(DeflateTreeNode *, nodes, 0);
-        Deflate_incrementNode(node);
+    if(count == 0) return true;
+    if(count == 1) {
+        codeLen[symbols[0].symbol] = 1;
         return true;
     }
 
-    while(nodes->len > 1) {
-        DeflateTreeNode *nodeA = null;
-        DeflateTreeNode *nodeB = null;
-        u64 minValueA = u64max;
-        u64 minValueB = u64max;
-        usz minIndexA = 0;
-        usz minIndexB = 0;
-
-        for(usz i = 0; i < nodes->len; i++) {
-            DeflateTreeNode *node = dynar_index(DeflateTreeNode *, nodes, i);
-            if(node->value < minValueA) {
-                minValueA = node->value;
-                minIndexA = i;
-                nodeA = node;
-            }
-        }
+    Deflate_sortSymbols(symbols, count);
 
-        dynar_remove(DeflateTreeNode *, nodes, minIndexA);
+    u32 depths[DEFLATE_MAX_SYMBOLS];
+    for(usz i = 0; i < count; i++) {
+        depths[i] = symbols[i].freq;
+    }
+    Deflate_huffmanDepths(depths, count);
 
-        for(usz i = 0; i < nodes->len; i++) {
-            DeflateTreeNode *node = dynar_index(DeflateTreeNode *, nodes, i);
-            if(node->value < minValueB) {
-                minValueB = node->value;
-                minIndexB = i;
-                nodeB = node;
-            }
-        }
+    u16 lengthCount[DEFLATE_MAX_CODE_LEN + 1] = {0};
+    for(usz i = 0; i < count; i++) {
+        lengthCount[depths[i] > maxCodeLen ? maxCodeLen : depths[i]] += 1;
+    }
 
-        dynar_remove(DeflateTreeNode *, nodes, minIndexB);
+    u32 kraft = 0;
+    for(u8 l = 1; l <= maxCodeLen; l++) {
+        kraft += (u32)lengthCount[l] << (maxCodeLen - l);
+    }
 
-        AllocateVar(DeflateTreeNode, node, mkDeflateNode(nodeA, nodeB, minValueA + minValueB));
-        Deflate_incrementNode(node);
+    while(kraft > (1u << maxCodeLen)) {
+        lengthCount[maxCodeLen] -= 1;
+        for(u8 l = maxCodeLen - 1; l > 0; l--) {
+            if(lengthCount[l] == 0) continue;
+            lengthCount[l] -= 1;
+            lengthCount[l + 1] += 2;
+            break;
+        }
+        kraft -= 1;
+    }
 
-        bool result;
-        dynar_append(nodes, DeflateTreeNode *, node, result);
-        if(!result) return false;
+    usz i = 0;
+    for(u8 l = maxCodeLen; l > 0; l--) {
+        for(u16 j = 0; j < lengthCount[l]; j++) {
+            codeLen[symbols[i++].symbol] = l;
+        }
     }
 
     return true;
 }
 
-// TODO: maybe implement support for preset dictionaries? seems to be easy
-Mem Deflate_compress(Mem raw, bool useMaxLookupRange, usz maxLookupRange, Alloc *alloc) {
-    if(!useMaxLookupRange) maxLookupRange = DEFLATE_MAX_DIST;
+// NOTE: LZ77 matching is done zlib-style: head holds the last position
+// (+ 1, 0 means none) whose first 3 bytes hash to a given value, and prev
+// chains every position to the previous one with the same hash, within
+// the window. Walking a chain is then only visiting plausible candidates,
+// instead of every position in the window
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+
+#define DEFLATE_LEVEL_NONE 0
+#define DEFLATE_LEVEL_FASTEST 1
+#define DEFLATE_LEVEL_DEFAULT 6
+#define DEFLATE_LEVEL_BEST 9
+
+// NOTE: 3 byte matches this far away usually take more bits than literals
+#define DEFLATE_TOO_FAR 4096
+
+// NOTE: the same trade-offs as zlib's levels. maxChain is how many candidates
+// are checked at most, and niceLen is the length after which we stop looking
+// for a better one. Greedy levels take the first match they find, and don't
+// index the insides of matches longer than lazyLen. Lazy levels check if
+// the next position has a longer match before committing to one shorter
+// than lazyLen, and only check a quarter of the chain once they have
+// a match of at least goodLen
+typedef struct {
+    u16 goodLen;
+    u16 lazyLen;
+    u16 niceLen;
+    u16 maxChain;
+    bool lazy;
+} DeflateLevel;
+
+DeflateLevel DeflateLevels[10] = {
+    { 0,   0,   0,    0,    false },
+    { 4,   4,   8,    4,    false },
+    { 4,   5,   16,   8,    false },
+    { 4,   6,   32,   32,   false },
+    { 4,   4,   16,   16,   true },
+    { 8,   16,  32,   32,   true },
+    { 8,   16,  128,  128,  true },
+    { 8,   32,  128,  256,  true },
+    { 32,  128, 258,  1024, true },
+    { 32,  258, 258,  4096, true },
+};
 
-    // NOTE: turns out this is comically slow with maxLookupRange at max
-    // I should probably learn how LZ77-ish algorithms are supposed to be
-    // implemented, rather than bruteforcing it (works fine for smaller
-    // windows though)
+typedef struct {
+    u32 *head;
+    u32 *prev;
+    DeflateLevel level;
+} DeflateMatcher;
+
+u32 Deflate_hash(byte *s) {
+    u32 v = (u32)s[0] | ((u32)s[1] << 8) | ((u32)s[2] << 16);
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
 
-    StringBuilder sb = mkStringBuilder();
-    sb.alloc = alloc;
-    Stream outByte = mkStreamSb(&sb);
-    BitStream out = mkBitStream(&outByte);
-
-    Dynar(DeflatePrepareValue) values = mkDynar(DeflatePrepareValue);
-    for(usz thisPos = 0; thisPos < raw.len;) {
-        usz thisLen = 1;
-
-        usz lookupPos = 0;
-        if(thisPos > maxLookupRange) lookupPos = thisPos - maxLookupRange;
-        usz lookupLen = 1;
-
-        usz foundPos = 0;
-        usz foundLen = 0;
-
-        bool condition = raw.len - thisPos > 1;
-        while(lookupPos < thisPos && condition) {
-            if(thisPos >= raw.len - 2) break;
-            Mem a = mkMem(raw.s + thisPos, thisLen);
-            Mem b = mkMem(raw.s + lookupPos, lookupLen);
-
-            if(!mem_eq(a, b)) {
-                lookupLen -= 1;
-                if(lookupLen > foundLen && lookupLen > 3) {
-                    foundPos = lookupPos;
-                    foundLen = lookupLen;
-                }
-
-                lookupPos += 1;
-                lookupLen = 1;
-                thisLen = 1;
-                continue;
-            }
+void Deflate_insert(DeflateMatcher *matcher, Mem raw, usz pos) {
+    if(pos + DEFLATE_MIN_LEN > raw.len) return;
+    u32 hash = Deflate_hash(raw.s + pos);
+    matcher->prev[pos & DEFLATE_WINDOW_MASK] = matcher->head[hash];
+    matcher->head[hash] = pos + 1;
+}
 
-            if(lookupLen == DEFLATE_MAX_LEN || thisLen == raw.len - thisPos) {
-                foundPos = lookupPos;
-                foundLen = lookupLen;
-                break;
+usz Deflate_matchLength(byte *a, byte *b, usz maxLen) {
+    usz len = 0;
+    while(len + 8 <= maxLen) {
+        u64 x, y;
+        memcpy(&x, a + len, sizeof(u64));
+        memcpy(&y, b + len, sizeof(u64));
+        if(x != y) return len + (__builtin_ctzll(x ^ y) >> 3);
+        len += 8;
+    }
+    while(len < maxLen && a[len] == b[len]) len += 1;
+    return len;
+}
+
+void Deflate_insertRange(DeflateMatcher *matcher, Mem raw, usz from, usz to) {
+    if(matcher->head == null) return;
+    for(usz pos = from; pos < to; pos++) {
+        Deflate_insert(matcher, raw, pos);
+    }
+}
+
+// NOTE: raw is compressed from start onwards. The last 2 bytes before start
+// couldn't be hashed when they were inserted, since the 3rd byte wasn't
+// there yet, so it's done now
+void Deflate_insertTail(DeflateMatcher *matcher, Mem raw, usz start) {
+    usz from = start >= DEFLATE_MIN_LEN - 1 ? start - (DEFLATE_MIN_LEN - 1) : 0;
+    Deflate_insertRange(matcher, raw, from, start);
+}
+
+// NOTE: expects pos to be inserted already, and only returns matches longer
+// than prevLen. window has to be less than DEFLATE_MAX_DIST, otherwise a
+// chain could lead to a slot that was already overwritten by a newer position
+usz Deflate_longestMatch(DeflateMatcher *matcher, Mem raw, usz pos, usz window, usz prevLen, usz *matchPos) {
+    usz maxLen = raw.len - pos;
+    if(maxLen > DEFLATE_MAX_LEN) maxLen = DEFLATE_MAX_LEN;
+    if(maxLen < DEFLATE_MIN_LEN || maxLen <= prevLen) return 0;
+
+    usz maxChain = matcher->level.maxChain;
+    if(prevLen >= matcher->level.goodLen) maxChain >>= 2;
+    usz niceLen = matcher->level.niceLen;
+    if(niceLen > maxLen) niceLen = maxLen;
+
+    usz bestLen = prevLen;
+    u32 candidate = matcher->prev[pos & DEFLATE_WINDOW_MASK];
+    for(usz chain = 0; candidate != 0 && chain < maxChain; chain++) {
+        usz candidatePos = candidate - 1;
+        if(pos - candidatePos > window) break;
+
+        // NOTE: a candidate can only be better if it
+        // matches at the current best length
+        if(raw.s[candidatePos + bestLen] == raw.s[pos + bestLen]) {
+            usz len = Deflate_matchLength(raw.s + candidatePos, raw.s + pos, maxLen);
+            if(len > bestLen) {
+                bestLen = len;
+                *matchPos = candidatePos;
+                if(len >= niceLen) break;
             }
+        }
+
+        u32 next = matcher->prev[candidatePos & DEFLATE_WINDOW_MASK];
+        if(next >= candidate) break;
+        candidate = next;
+    }
 
-            lookupLen += 1;
-            thisLen += 1;
+    if(bestLen == prevLen || bestLen < DEFLATE_MIN_LEN) return 0;
+    if(bestLen == DEFLATE_MIN_LEN && pos - *matchPos > DEFLATE_TOO_FAR) return 0;
+    return bestLen;
+}
+
+bool Deflate_compress_appendMatch(Dynar(DeflatePrepareValue) *values, usz len, usz dist) {
+    bool result;
+    dynar_append(values, DeflatePrepareValue, mkDeflateItemLen(len), result);
+    if(!result) return false;
+    dynar_append(values, DeflatePrepareValue, mkDeflateItemDist(dist), result);
+    return result;
+}
+
+bool Deflate_compress_appendLiteral(Dynar(DeflatePrepareValue) *values, byte value) {
+    bool result;
+    dynar_append(values, DeflatePrepareValue, mkDeflateItemLit(value), result);
+    return result;
+}
+
+bool Deflate_compress_tokenizeGreedy(DeflateMatcher *matcher, Mem raw, usz from, usz window, Dynar(DeflatePrepareValue) *values) {
+    for(usz pos = from; pos < raw.len;) {
+        Deflate_insert(matcher, raw, pos);
+
+        usz matchPos = 0;
+        usz len = Deflate_longestMatch(matcher, raw, pos, window, 0, &matchPos);
+        if(len == 0) {
+            checkRet(Deflate_compress_appendLiteral(values, raw.s[pos]));
+            pos += 1;
             continue;
         }
 
-        bool found = foundLen >= 3;
-        if(found) {
-            thisLen = foundLen;
+        checkRet(Deflate_compress_appendMatch(values, len, pos - matchPos));
+        if(len <= matcher->level.lazyLen) {
+            for(usz i = 1; i < len; i++) {
+                Deflate_insert(matcher, raw, pos + i);
+            }
+        }
+        pos += len;
+    }
+    return true;
+}
+
+bool Deflate_compress_tokenizeLazy(DeflateMatcher *matcher, Mem raw, usz from, usz window, Dynar(DeflatePrepareValue) *values) {
+    // NOTE: the match found at the previous position, which
+    // is only emitted if this one doesn't find a longer one
+    usz prevLen = 0;
+    usz prevMatchPos = 0;
+    bool hasPrev = false;
+
+    for(usz pos = from; pos < raw.len;) {
+        Deflate_insert(matcher, raw, pos);
+
+        usz matchPos = 0;
+        usz len = 0;
+        if(prevLen < matcher->level.lazyLen) {
+            len = Deflate_longestMatch(matcher, raw, pos, window, prevLen, &matchPos);
+        }
+
+        if(prevLen >= DEFLATE_MIN_LEN && len == 0) {
+            usz start = pos - 1;
+            checkRet(Deflate_compress_appendMatch(values, prevLen, start - prevMatchPos));
+            for(usz i = 2; i < prevLen; i++) {
+                Deflate_insert(matcher, raw, start + i);
+            }
+            pos = start + prevLen;
+            prevLen = 0;
+            hasPrev = false;
+            continue;
+        }
 
-            usz len = foundLen;
-            usz dist = thisPos - foundPos;
+        if(hasPrev) {
+            checkRet(Deflate_compress_appendLiteral(values, raw.s[pos - 1]));
+        }
 
-            bool result;
-            dynar_append(&values, DeflatePrepareValue, mkDeflateItemLen(len), result);
-            if(!result) return memnull;
-            dynar_append(&values, DeflatePrepareValue, mkDeflateItemDist(dist), result);
-            if(!result) return memnull;
+        hasPrev = true;
+        if(len != 0) {
+            prevLen = len;
+            prevMatchPos = matchPos;
         }
         else {
-            usz value = raw.s[thisPos];
-            bool result;
-            dynar_append(&values, DeflatePrepareValue, mkDeflateItemLit(value), result);
-            if(!result) return memnull;
+            prevLen = 0;
         }
+        pos += 1;
+    }
 
-        thisPos += thisLen;
+    if(hasPrev) {
+        checkRet(Deflate_compress_appendLiteral(values, raw.s[raw.len - 1]));
     }
+    return true;
+}
+
+bool Deflate_initMatcher(DeflateMatcher *matcher, u8 level, Alloc *alloc) {
+    if(level > DEFLATE_LEVEL_BEST) level = DEFLATE_LEVEL_BEST;
+    *matcher = (DeflateMatcher){ .level = DeflateLevels[level] };
+    if(level == DEFLATE_LEVEL_NONE) return true;
+
+    matcher->head = (u32 *)AllocateBytesC(alloc, sizeof(u32) * DEFLATE_HASH_SIZE).s;
+    matcher->prev = (u32 *)AllocateBytesC(alloc, sizeof(u32) * DEFLATE_MAX_DIST).s;
+    if(matcher->head == null || matcher->prev == null) return false;
+    memset(matcher->head, 0, sizeof(u32) * DEFLATE_HASH_SIZE);
+    return true;
+}
+
+void Deflate_deinitMatcher(DeflateMatcher *matcher, Alloc *alloc) {
+    if(matcher->prev != null) FreeC(alloc, matcher->prev);
+    if(matcher->head != null) FreeC(alloc, matcher->head);
+    matcher->prev = null;
+    matcher->head = null;
+}
 
-    {
-        bool result;
-        dynar_append(&values, DeflatePrepareValue, mkDeflateItemLen(0), result); // end
-        if(!result) return memnull;
+// NOTE: for when the first shift bytes of the buffer are dropped,
+// positions that fall out of it are forgotten
+void Deflate_slideMatcher(DeflateMatcher *matcher, u32 shift) {
+    if(matcher->head == null) return;
+    for(usz i = 0; i < DEFLATE_HASH_SIZE; i++) {
+        matcher->head[i] = matcher->head[i] > shift ? matcher->head[i] - shift : 0;
     }
+    for(usz i = 0; i < DEFLATE_MAX_DIST; i++) {
+        matcher->prev[i] = matcher->prev[i] > shift ? matcher->prev[i] - shift : 0;
+    }
+}
+
+// NOTE: tokenizing can't give more values than there are bytes, so values
+// made for the most bytes ever tokenized at once never grow
+Dynar(DeflatePrepareValue) Deflate_mkValues(usz bytes, Alloc *alloc) {
+    return mkDynarCA(DeflatePrepareValue, bytes + 1, alloc);
+}
+
+// NOTE: tokenizes raw from start onwards, anything before
+// start is only there to be matched against
+bool Deflate_compress_tokenizeFrom(DeflateMatcher *matcher, Mem raw, usz start, Dynar(DeflatePrepareValue) *values) {
+    if(raw.len >= u32max) return false;
+
+    if(matcher->head == null) {
+        for(usz pos = start; pos < raw.len; pos++) {
+            checkRet(Deflate_compress_appendLiteral(values, raw.s[pos]));
+        }
+        return true;
+    }
+
+    usz window = DEFLATE_MAX_DIST - 1;
+    return matcher->level.lazy
+        ? Deflate_compress_tokenizeLazy(matcher, raw, start, window, values)
+        : Deflate_compress_tokenizeGreedy(matcher, raw, start, window, values);
+}
 
-    u32 litlenFreq[286] = {0};
-    u32 distFreq[30] = {0};
+// NOTE: the encoder doesn't write all of its values as one block. They're
+// cut into segments of DEFLATE_BLOCK_SEGMENT values, and each one is added
+// to the block before it only if that isn't more expensive than starting a
+// new block, so blocks end where the statistics of the data change. Every
+// block is then written as whichever of stored, fixed or dynamic Huffman
+// takes the fewest bits. No block is longer than DEFLATE_BLOCK_SEGMENTS
+// segments, so codes keep up with slow changes too
+#define DEFLATE_BLOCK_SEGMENT 4096
+#define DEFLATE_BLOCK_SEGMENTS 16
 
-    for(usz i = 0; i < values.len; i++) {
-        DeflatePrepareValue v = dynar_index(DeflatePrepareValue, &values, i);
+#define DEFLATE_STORED_MAX 65535
+
+// NOTE: what a run of values is made of. The extra bits of lengths
+// and distances cost the same however the block is written
+typedef struct {
+    u32 litlenFreq[DEFLATE_MAX_SYMBOLS];
+    u32 distFreq[30];
+    usz extraBits;
+    usz bytes;
+} DeflateBlockStats;
+
+bool Deflate_compress_countValues(Dynar(DeflatePrepareValue) *values, usz from, usz to, DeflateBlockStats *stats) {
+    for(usz i = from; i < to; i++) {
+        DeflatePrepareValue v = dynar_index(DeflatePrepareValue, values, i);
         if(false){}
         else if(v.type == DEFLATE_ITEM_LIT) {
-            litlenFreq[v.value] += 1;
+            stats->litlenFreq[v.value] += 1;
+            stats->bytes += 1;
         }
         else if(v.type == DEFLATE_ITEM_LEN) {
             i16 lenIndex = Deflate_lenToIndex(v.value);
-            if(lenIndex == -1) return memnull;
-            litlenFreq[lenIndex + 256] += 1;
+            if(lenIndex <= 0) return false;
+            stats->litlenFreq[lenIndex + 256] += 1;
+            stats->extraBits += DeflateLitLenExtraBits[lenIndex];
+            stats->bytes += v.value;
         }
         else if(v.type == DEFLATE_ITEM_DIST) {
             i16 distIndex = Deflate_distToIndex(v.value);
-            if(distIndex == -1) return memnull;
-            distFreq[distIndex] += 1;
+            if(distIndex == -1) return false;
+            stats->distFreq[distIndex] += 1;
+            stats->extraBits += DeflateDistExtraBits[distIndex];
         }
     }
+    return true;
+}
 
-    u8 litlenCodeLen[286] = {0};
-    u8 distCodeLen[30] = {0};
+void Deflate_compress_mergeStats(DeflateBlockStats *stats, DeflateBlockStats *other) {
+    for(usz i = 0; i < DEFLATE_MAX_SYMBOLS; i++) stats->litlenFreq[i] += other->litlenFreq[i];
+    for(usz i = 0; i < 30; i++) stats->distFreq[i] += other->distFreq[i];
+    stats->extraBits += other->extraBits;
+    stats->bytes += other->bytes;
+}
 
-    Dynar(DeflateTreeNode *) nodes = mkDynar(DeflateTreeNode *);
+// NOTE: the code lengths of a dynamic block, and how they're
+// written, run-length encoded with the code length alphabet
+typedef struct {
+    u8 litlenLen[DEFLATE_MAX_SYMBOLS];
+    u8 distLen[30];
+    u16 litlenCount;
+    u16 distCount;
 
-    bool result;
-    result = Deflate_compress_generateCodeLengths(&nodes, 286, litlenFreq, litlenCodeLen);
-    if(!result) return memnull;
-    nodes.len = 0;
-    result = Deflate_compress_generateCodeLengths(&nodes, 30, distFreq, distCodeLen);
-    if(!result) return memnull;
-
-    u16 litlenCodeLenLen = 0;
-    for(int i = 0; i < 286; i++) {
-        if(litlenCodeLen[i] != 0) litlenCodeLenLen = i;
-    }
-    litlenCodeLenLen++;
-    if(litlenCodeLenLen < 257) litlenCodeLenLen = 257;
-
-    u16 distCodeLenLen = 0;
-    for(int i = 0; i < 30; i++) {
-        if(distCodeLen[i] != 0) distCodeLenLen = i;
-    }
-    distCodeLenLen++;
-    if(distCodeLenLen < 1) distCodeLenLen = 1;
-
-    u8 totalCodeLen[316] = {0};
-    mem_copy(mkMem((byte *)totalCodeLen, litlenCodeLenLen),
-             mkMem((byte *)litlenCodeLen, litlenCodeLenLen));
-    mem_copy(mkMem((byte *)totalCodeLen + litlenCodeLenLen, distCodeLenLen),
-             mkMem((byte *)distCodeLen, distCodeLenLen));
-    u16 totalCodeLenLen = litlenCodeLenLen + distCodeLenLen;
-
-    Dynar(u8) litlenDynar = (Dynar(u8)){ .mem = mkMem((void *)litlenCodeLen, 286), .len = 286 };
-    Dynar(u8) distDynar = (Dynar(u8)){ .mem = mkMem((void *)distCodeLen, 30), .len = 30 };
-
-    DeflateDeCompTable litlen = Deflate_generateDeCompTable(litlenDynar, ALLOC);
-    if(isNone(litlen)) return memnull;
-    DeflateDeCompTable dist = Deflate_generateDeCompTable(distDynar, ALLOC);
-    if(isNone(dist)) return memnull;
-
-    DeflateCompTable table = {
-        .lit = (void *)AllocateBytes(sizeof(DeflateCompElement) * 256).s,
-        .len = (void *)AllocateBytes(sizeof(DeflateCompElement) * 30).s,
-        .dist = (void *)AllocateBytes(sizeof(DeflateCompElement) * 30).s,
-    };
+    DeflateHclenValue items[DEFLATE_MAX_SYMBOLS + 30];
+    usz itemCount;
 
-    for(int i = 0; i < 286; i++) {
-        bool isDist = i >= 256;
-        int fix = isDist ? i - 256 : i;
-        for(usz j = 0; j < litlen.len; j++) {
-            if(litlen.list[j].value == fix && (litlen.list[j].isDist == isDist)) {
-                if(isDist) {
-                    table.len[fix].code = litlen.list[j].code;
-                    table.len[fix].codeLen = litlen.list[j].codeLen;
-                }
-                else {
-                    table.lit[i].code = litlen.list[j].code;
-                    table.lit[i].codeLen = litlen.list[j].codeLen;
-                }
-                break;
-            }
-        }
+    u8 hclenLen[19];
+    u8 hclenCount;
+} DeflateDynamicHeader;
+
+bool Deflate_compress_buildDynamicHeader(DeflateBlockStats *stats, DeflateDynamicHeader *header) {
+    u32 litlenFreq[DEFLATE_MAX_SYMBOLS];
+    memcpy(litlenFreq, stats->litlenFreq, sizeof(litlenFreq));
+    litlenFreq[256] = 1; // end
+
+    checkRet(Deflate_compress_generateLimitedCodeLengths(DEFLATE_MAX_SYMBOLS, litlenFreq, header->litlenLen, DEFLATE_MAX_CODE_LEN));
+    checkRet(Deflate_compress_generateLimitedCodeLengths(30, stats->distFreq, header->distLen, DEFLATE_MAX_CODE_LEN));
+
+    header->litlenCount = 257;
+    for(usz i = 257; i < DEFLATE_MAX_SYMBOLS; i++) {
+        if(header->litlenLen[i] != 0) header->litlenCount = i + 1;
     }
 
-    for(int i = 0; i < 30; i++) {
-        for(usz j = 0; j < dist.len; j++) {
-            if(dist.list[j].value == i) {
-                table.dist[i].code = dist.list[j].code;
-                table.dist[i].codeLen = dist.list[j].codeLen;
-                break;
-            }
-        }
+    header->distCount = 1;
+    for(usz i = 1; i < 30; i++) {
+        if(header->distLen[i] != 0) header->distCount = i + 1;
     }
 
-    Dynar(DeflateHclenValue) hclenLenCodes = mkDynar(DeflateHclenValue);
+    u8 totalCodeLen[DEFLATE_MAX_SYMBOLS + 30];
+    memcpy(totalCodeLen, header->litlenLen, header->litlenCount);
+    memcpy(totalCodeLen + header->litlenCount, header->distLen, header->distCount);
+    u16 totalCodeLenLen = header->litlenCount + header->distCount;
+
+    header->itemCount = 0;
     for(int i = 0; i < totalCodeLenLen; i++) {
         u8 len = totalCodeLen[i];
         u8 amount = 1;
@@ -848,155 +1344,606 @@ Mem Deflate_compress(Mem raw, bool useMaxLookupRange, usz maxLookupRange, Alloc
 
         if((len == 0 && amount < 3) || (len != 0 && amount < 4)) {
             for(int j = 0; j < amount; j++) {
-                bool result;
-                dynar_append(&hclenLenCodes, DeflateHclenValue, mkDeflateHItemCode(len), result);
-                if(!result) return memnull;
+                header->items[header->itemCount++] = mkDeflateHItemCode(len);
             }
-            continue;
         }
-
-        if(len != 0) {
-            bool result;
-            dynar_append(&hclenLenCodes, DeflateHclenValue, mkDeflateHItemCode(len), result);
-            if(!result) return memnull;
-
-            dynar_append(&hclenLenCodes, DeflateHclenValue, mkDeflateHItemCopy(amount - 1), result);
-            if(!result) return memnull;
+        else if(len != 0) {
+            header->items[header->itemCount++] = mkDeflateHItemCode(len);
+            header->items[header->itemCount++] = mkDeflateHItemCopy(amount - 1);
+        }
+        else if(amount >= 11) {
+            header->items[header->itemCount++] = mkDeflateHItemZero7(amount);
         }
         else {
-            if(amount >= 11) {
-                dynar_append(&hclenLenCodes, DeflateHclenValue, mkDeflateHItemZero7(amount), result);
-            }
-            else {
-                dynar_append(&hclenLenCodes, DeflateHclenValue, mkDeflateHItemZero3(amount), result);
-            }
+            header->items[header->itemCount++] = mkDeflateHItemZero3(amount);
         }
     }
 
     u32 hclenFreq[19] = {0};
-    for(usz i = 0; i < hclenLenCodes.len; i++) {
-        DeflateHclenValue val = dynar_index(DeflateHclenValue, &hclenLenCodes, i);
-        if(val.type == DEFLATE_HCLEN_ITEM_CODE) {
-            hclenFreq[val.value] += 1;
-        }
-        else {
-            hclenFreq[val.type] += 1;
-        }
+    for(usz i = 0; i < header->itemCount; i++) {
+        DeflateHclenValue val = header->items[i];
+        hclenFreq[val.type == DEFLATE_HCLEN_ITEM_CODE ? val.value : val.type] += 1;
     }
 
-    u8 hclenLen[19] = {0};
-    nodes.len = 0;
-    result = Deflate_compress_generateCodeLengths(&nodes, 19, hclenFreq, hclenLen);
-    if(!result) return memnull;
+    checkRet(Deflate_compress_generateLimitedCodeLengths(19, hclenFreq, header->hclenLen, 7));
 
-    u8 hclenLenLen = 0;
-    for(usz i = 0; i < 19; i++) {
-        u8 index = DeflateCodeLenValues[i];
-        if(hclenLen[index] != 0) hclenLenLen = i;
+    header->hclenCount = 4;
+    for(usz i = 4; i < 19; i++) {
+        if(header->hclenLen[DeflateCodeLenValues[i]] != 0) header->hclenCount = i + 1;
     }
-    hclenLenLen++;
-    if(hclenLenLen < 4) hclenLenLen = 4;
 
-    Dynar(u8) hclenDynar = (Dynar(u8)){ .mem = mkMem((void *)hclenLen, 19), .len = 19 };
-    DeflateDeCompTable hclen = Deflate_generateDeCompTable(hclenDynar, ALLOC);
-    if(isNone(hclen)) return memnull;
+    return true;
+}
 
-    DeflateCompElement *hclenTable = (void *)AllocateBytes(sizeof(DeflateCompElement) * 19).s;
-    for(int i = 0; i < 19; i++) {
-        for(usz j = 0; j < hclen.len; j++) {
-            if(hclen.list[j].value == i) {
-                hclenTable[i].code = hclen.list[j].code;
-                hclenTable[i].codeLen = hclen.list[j].codeLen;
-                break;
-            }
+u8 Deflate_compress_hclenExtraBits(byte type) {
+    if(type == DEFLATE_HCLEN_ITEM_COPY_2) return 2;
+    if(type == DEFLATE_HCLEN_ITEM_ZERO_3) return 3;
+    if(type == DEFLATE_HCLEN_ITEM_ZERO_7) return 7;
+    return 0;
+}
+
+usz Deflate_compress_dynamicHeaderBits(DeflateDynamicHeader *header) {
+    usz bits = 3 + 5 + 5 + 4 + 3 * header->hclenCount;
+    for(usz i = 0; i < header->itemCount; i++) {
+        DeflateHclenValue val = header->items[i];
+        if(val.type == DEFLATE_HCLEN_ITEM_CODE) {
+            bits += header->hclenLen[val.value];
+        }
+        else {
+            bits += header->hclenLen[val.type] + Deflate_compress_hclenExtraBits(val.type);
         }
     }
+    return bits;
+}
 
-    // final block
-    bitstream_write(&out, 1);
+// NOTE: the size of the values and the end of block code, with these codes
+usz Deflate_compress_symbolBits(DeflateBlockStats *stats, u8 *litlenLen, u8 *distLen) {
+    usz bits = stats->extraBits + litlenLen[256];
+    for(usz i = 0; i < DEFLATE_MAX_SYMBOLS; i++) bits += (usz)stats->litlenFreq[i] * litlenLen[i];
+    for(usz i = 0; i < 30; i++) bits += (usz)stats->distFreq[i] * distLen[i];
+    return bits;
+}
 
-    // dynamic huffman
-    bitstream_write(&out, 0);
-    bitstream_write(&out, 1);
+// NOTE: every stored block is padded to a byte, which is counted as half of one
+usz Deflate_compress_storedBits(usz bytes) {
+    usz blocks = bytes == 0 ? 1 : (bytes + DEFLATE_STORED_MAX - 1) / DEFLATE_STORED_MAX;
+    return blocks * (3 + 4 + 32) + bytes * 8;
+}
 
-    for(int i = 0; i < 5; i++) {
-        bitstream_write(&out, ((litlenCodeLenLen - 257) >> i) & 1);
-    }
+// NOTE: picks the cheapest way to write a block with these stats. header
+// is built along the way, and is what a dynamic block should be written with
+bool Deflate_compress_chooseBlock(DeflateBlockStats *stats, DeflateDynamicHeader *header, u8 *type, usz *bits) {
+    checkRet(Deflate_compress_buildDynamicHeader(stats, header));
 
-    for(int i = 0; i < 5; i++) {
-        bitstream_write(&out, ((distCodeLenLen - 1) >> i) & 1);
+    *type = DEFLATE_BLOCK_DYNAMIC_HUFFMAN;
+    *bits = Deflate_compress_dynamicHeaderBits(header)
+          + Deflate_compress_symbolBits(stats, header->litlenLen, header->distLen);
+
+    usz fixedBits = 3 + Deflate_compress_symbolBits(stats, DeflateLitLenLengths, DeflateDistLengths);
+    if(fixedBits <= *bits) {
+        *type = DEFLATE_BLOCK_FIXED_HUFFMAN;
+        *bits = fixedBits;
     }
 
-    for(int i = 0; i < 4; i++) {
-        bitstream_write(&out, ((hclenLenLen - 4) >> i) & 1);
+    usz storedBits = Deflate_compress_storedBits(stats->bytes);
+    if(storedBits < *bits) {
+        *type = DEFLATE_BLOCK_NON_COMPRESSED;
+        *bits = storedBits;
     }
 
-    for(int i = 0; i < hclenLenLen; i++) {
-        u8 index = DeflateCodeLenValues[i];
-        u8 len = hclenLen[index];
-        bitstream_writeN(&out, len, 3);
+    return true;
+}
+
+bool Deflate_compress_writeDynamicHeader(BitWriter *out, DeflateDynamicHeader *header, bool final) {
+    checkRet(bitwriter_write(out, final, 1));
+    checkRet(bitwriter_write(out, DEFLATE_BLOCK_DYNAMIC_HUFFMAN, 2));
+    checkRet(bitwriter_write(out, header->litlenCount - 257, 5));
+    checkRet(bitwriter_write(out, header->distCount - 1, 5));
+    checkRet(bitwriter_write(out, header->hclenCount - 4, 4));
+
+    for(usz i = 0; i < header->hclenCount; i++) {
+        checkRet(bitwriter_write(out, header->hclenLen[DeflateCodeLenValues[i]], 3));
     }
 
-    for(usz i = 0; i < hclenLenCodes.len; i++) {
-        DeflateHclenValue val = dynar_index(DeflateHclenValue, &hclenLenCodes, i);
+    DeflateCompElement hclenCodes[19];
+    Deflate_compress_assignCodes(header->hclenLen, 19, hclenCodes);
 
+    for(usz i = 0; i < header->itemCount; i++) {
+        DeflateHclenValue val = header->items[i];
         if(val.type == DEFLATE_HCLEN_ITEM_CODE) {
-            DeflateCompElement ce = hclenTable[val.value];
-            bool result = Deflate_writeCompElement(&out, ce);
-            if(!result) return memnull;
+            checkRet(Deflate_writeCompElement(out, hclenCodes[val.value]));
+            continue;
         }
-        else {
-            DeflateCompElement ce = hclenTable[val.type];
-            bool result = Deflate_writeCompElement(&out, ce);
-            if(!result) return memnull;
 
-            if(val.type == DEFLATE_HCLEN_ITEM_COPY_2) {
-                result = bitstream_writeN(&out, val.value - 3, 2);
-            }
-            else if(val.type == DEFLATE_HCL_REPEAT_ZERO_3) {
-                result = bitstream_writeN(&out, val.value - 3, 3);
-            }
-            else if(val.type == DEFLATE_HCL_REPEAT_ZERO_7) {
-                result = bitstream_writeN(&out, val.value - 11, 7);
-            }
-
-            if(!result) return memnull;
-        }
+        checkRet(Deflate_writeCompElement(out, hclenCodes[val.type]));
+        u8 base = val.type == DEFLATE_HCLEN_ITEM_ZERO_7 ? 11 : 3;
+        checkRet(bitwriter_write(out, val.value - base, Deflate_compress_hclenExtraBits(val.type)));
     }
 
-    for(usz i = 0; i < values.len; i++) {
-        DeflatePrepareValue v = dynar_index(DeflatePrepareValue, &values, i);
-        bool result;
+    return true;
+}
+
+// NOTE: writes values[from, to) and the end of block code
+bool Deflate_compress_writeValues(BitWriter *out, Dynar(DeflatePrepareValue) *values, usz from, usz to, DeflateCompElement *litlen, DeflateCompElement *dist) {
+    for(usz i = from; i < to; i++) {
+        DeflatePrepareValue v = dynar_index(DeflatePrepareValue, values, i);
+        bool result = true;
         if(false) {}
         else if(v.type == DEFLATE_ITEM_LIT) {
-            DeflateCompElement ce = table.lit[v.value];
-            result = Deflate_writeCompElement(&out, ce);
+            result = Deflate_writeCompElement(out, litlen[v.value]);
         }
         else if(v.type == DEFLATE_ITEM_LEN) {
             u16 lenIndex = Deflate_lenToIndex(v.value);
-            DeflateCompElement ce = table.len[lenIndex];
-
-            result = Deflate_writeCompElement(&out, ce);
+            result = Deflate_writeCompElement(out, litlen[lenIndex + 256]);
             u8 ebLen = DeflateLitLenExtraBits[lenIndex];
             u16 eb = v.value - DeflateLinLenValues[lenIndex];
-            result = result && bitstream_writeN(&out, eb, ebLen);
+            result = result && bitwriter_write(out, eb, ebLen);
         }
         else if(v.type == DEFLATE_ITEM_DIST) {
             u16 distIndex = Deflate_distToIndex(v.value);
-            DeflateCompElement ce = table.dist[distIndex];
-    
-            result = Deflate_writeCompElement(&out, ce);
+            result = Deflate_writeCompElement(out, dist[distIndex]);
             u8 ebLen = DeflateDistExtraBits[distIndex];
             u16 eb = v.value - DeflateDistValues[distIndex];
-            result = result && bitstream_writeN(&out, eb, ebLen);
+            result = result && bitwriter_write(out, eb, ebLen);
         }
 
-        if(!result) return memnull;
+        if(!result) return false;
     }
 
-    bitstream_flush(&out);
+    return Deflate_writeCompElement(out, litlen[256]);
+}
 
+// NOTE: raw is copied as it is, in as many blocks as it takes
+bool Deflate_compress_writeStored(BitWriter *out, Mem raw, bool final) {
+    do {
+        usz len = raw.len < DEFLATE_STORED_MAX ? raw.len : DEFLATE_STORED_MAX;
+        checkRet(bitwriter_write(out, final && len == raw.len, 1));
+        checkRet(bitwriter_write(out, DEFLATE_BLOCK_NON_COMPRESSED, 2));
+        checkRet(bitwriter_flush(out));
+        checkRet(bitwriter_write(out, len | ((~len & 0xffff) << 16), 32));
+        checkRet(bitwriter_flush(out));
+        checkRet(sb_appendMem(out->sb, mkMem(raw.s, len)));
+        raw = memIndex(raw, len);
+    } while(raw.len != 0);
+
+    return true;
+}
+
+// NOTE: writes values[from, to), which make up raw, as a single block
+bool Deflate_compress_writeBlock(BitWriter *out, Dynar(DeflatePrepareValue) *values, usz from, usz to, Mem raw, DeflateBlockStats *stats, bool final) {
+    DeflateDynamicHeader header;
+    u8 type;
+    usz bits;
+    checkRet(Deflate_compress_chooseBlock(stats, &header, &type, &bits));
+
+    if(type == DEFLATE_BLOCK_NON_COMPRESSED) {
+        return Deflate_compress_writeStored(out, raw, final);
+    }
+
+    if(type == DEFLATE_BLOCK_FIXED_HUFFMAN) {
+        checkRet(bitwriter_write(out, final, 1));
+        checkRet(bitwriter_write(out, DEFLATE_BLOCK_FIXED_HUFFMAN, 2));
+        return Deflate_compress_writeValues(out, values, from, to, DeflateFixedLitLenCodes, DeflateFixedDistCodes);
+    }
+
+    DeflateCompElement litlen[DEFLATE_MAX_SYMBOLS];
+    DeflateCompElement dist[30];
+    checkRet(Deflate_compress_writeDynamicHeader(out, &header, final));
+    Deflate_compress_assignCodes(header.litlenLen, DEFLATE_MAX_SYMBOLS, litlen);
+    Deflate_compress_assignCodes(header.distLen, 30, dist);
+    return Deflate_compress_writeValues(out, values, from, to, litlen, dist);
+}
+
+// NOTE: writes values, which make up raw, as one or more blocks. Only
+// the last one is marked final, if final is set
+bool Deflate_compress_writeBlocks(BitWriter *out, Dynar(DeflatePrepareValue) *values, Mem raw, bool final) {
+    Deflate_initTables();
+
+    DeflateDynamicHeader header;
+    u8 type;
+
+    DeflateBlockStats block = {0};
+    usz blockFrom = 0;
+    usz blockBits = 0;
+    usz blockSegments = 0;
+    usz rawPos = 0;
+
+    for(usz from = 0; from < values->len;) {
+        usz to = from + DEFLATE_BLOCK_SEGMENT;
+        if(to >= values->len) to = values->len;
+        else if(dynar_index(DeflatePrepareValue, values, to).type == DEFLATE_ITEM_DIST) to += 1;
+
+        DeflateBlockStats segment = {0};
+        usz segmentBits;
+        checkRet(Deflate_compress_countValues(values, from, to, &segment));
+        checkRet(Deflate_compress_chooseBlock(&segment, &header, &type, &segmentBits));
+
+        if(blockSegments != 0 && blockSegments < DEFLATE_BLOCK_SEGMENTS) {
+            DeflateBlockStats merged = block;
+            usz mergedBits;
+            Deflate_compress_mergeStats(&merged, &segment);
+            checkRet(Deflate_compress_chooseBlock(&merged, &header, &type, &mergedBits));
+
+            if(mergedBits <= blockBits + segmentBits) {
+                block = merged;
+                blockBits = mergedBits;
+                blockSegments += 1;
+                from = to;
+                continue;
+            }
+        }
+
+        if(blockSegments != 0) {
+            if(rawPos + block.bytes > raw.len) return false;
+            checkRet(Deflate_compress_writeBlock(out, values, blockFrom, from, mkMem(raw.s + rawPos, block.bytes), &block, false));
+            rawPos += block.bytes;
+        }
+
+        block = segment;
+        blockFrom = from;
+        blockBits = segmentBits;
+        blockSegments = 1;
+        from = to;
+    }
+
+    if(rawPos + block.bytes != raw.len) return false;
+    return Deflate_compress_writeBlock(out, values, blockFrom, values->len, mkMem(raw.s + rawPos, block.bytes), &block, final);
+}
+
+// NOTE: ends the current block and aligns to a byte with an empty non-compressed
+// block (the same as zlib's Z_SYNC_FLUSH), after which another deflate
+// stream's blocks can simply be appended
+bool Deflate_compress_writeSyncFlush(BitWriter *out) {
+    checkRet(bitwriter_write(out, 0, 1));
+    checkRet(bitwriter_write(out, DEFLATE_BLOCK_NON_COMPRESSED, 2));
+    checkRet(bitwriter_flush(out));
+    return bitwriter_write(out, 0xffff0000, 32);
+}
+
+// NOTE: the input is tokenized this much at a time, so the values
+// of a large input are never all held at once
+#define DEFLATE_COMPRESS_PIECE (1 << 20)
+
+// NOTE: dict is a preset dictionary, see Deflate_decompressMemDict. It's
+// put in front of raw, and matched against, as if it had come before
+Mem Deflate_compressDict(Mem raw, Mem dict, u8 level, Alloc *alloc) {
+    StringBuilder sb = mkStringBuilder();
+    sb.alloc = alloc;
+    BitWriter out = mkBitWriter(&sb);
+
+    if(dict.len > DEFLATE_MAX_DIST) dict = memIndex(dict, dict.len - DEFLATE_MAX_DIST);
+    Mem buffer = raw;
+    if(dict.len != 0) {
+        buffer = AllocateBytes(dict.len + raw.len);
+        if(isNull(buffer)) return memnull;
+        memcpy(buffer.s, dict.s, dict.len);
+        memcpy(buffer.s + dict.len, raw.s, raw.len);
+    }
+
+    Dynar(DeflatePrepareValue) values = Deflate_mkValues(raw.len < DEFLATE_COMPRESS_PIECE ? raw.len : DEFLATE_COMPRESS_PIECE, ALLOC);
+
+    DeflateMatcher matcher;
+    bool result = Deflate_initMatcher(&matcher, level, ALLOC);
+
+    // NOTE: the dictionary is indexed as if it was the previous piece
+    usz start = dict.len;
+    if(result) Deflate_insertRange(&matcher, mkMem(buffer.s, start), 0, start);
+
+    while(result) {
+        usz end = buffer.len - start > DEFLATE_COMPRESS_PIECE ? start + DEFLATE_COMPRESS_PIECE : buffer.len;
+        Mem piece = mkMem(buffer.s, end);
+        Deflate_insertTail(&matcher, piece, start);
+
+        values.len = 0;
+        result = Deflate_compress_tokenizeFrom(&matcher, piece, start, &values)
+              && Deflate_compress_writeBlocks(&out, &values, memIndex(piece, start), end == buffer.len);
+        start = end;
+        if(start == buffer.len) break;
+    }
+
+    Deflate_deinitMatcher(&matcher, ALLOC);
+    if(dynar_isInit(&values)) Free(values.mem.s);
+    if(dict.len != 0) Free(buffer.s);
+
+    if(!result || !bitwriter_flush(&out)) return memnull;
     return sb_build(sb);
 }
+#define Deflate_compress(raw, level, alloc) Deflate_compressDict(raw, memnull, level, alloc)
+
+// NOTE: compresses input as it's pushed, instead of all at once. The input
+// is collected in a buffer, which keeps the last DEFLATE_MAX_DIST bytes
+// before it for matching, and every DEFLATE_ENCODER_BLOCK bytes it's
+// written to out as a block. So at most DEFLATE_ENCODER_BUFFER bytes
+// of the input are held at a time, no matter how long it is
+#define DEFLATE_ENCODER_BLOCK (2 * DEFLATE_MAX_DIST)
+#define DEFLATE_ENCODER_BUFFER (DEFLATE_MAX_DIST + DEFLATE_ENCODER_BLOCK)
+
+typedef struct {
+    Stream *out;
+    Alloc *alloc;
+
+    DeflateMatcher matcher;
+    Dynar(DeflatePrepareValue) values;
+
+    Mem buffer;
+    usz len;
+    // NOTE: where the part that hasn't been compressed yet begins
+    usz start;
+
+    StringBuilder sb;
+    BitWriter bits;
+
+    bool finished;
+} DeflateEncoder;
+
+// NOTE: the encoder points into itself, so it can't be moved after this
+bool Deflate_encoderInit(DeflateEncoder *encoder, Stream *out, u8 level, Alloc *alloc) {
+    *encoder = (DeflateEncoder){
+        .out = out,
+        .alloc = alloc,
+        .values = Deflate_mkValues(DEFLATE_ENCODER_BUFFER, alloc),
+        .buffer = AllocateBytesC(alloc, DEFLATE_ENCODER_BUFFER),
+        .sb = mkStringBuilder(),
+    };
+    encoder->sb.alloc = alloc;
+    encoder->bits = mkBitWriter(&encoder->sb);
+
+    if(isNull(encoder->buffer)) return false;
+    return Deflate_initMatcher(&encoder->matcher, level, alloc);
+}
+
+// NOTE: see Deflate_compressDict, has to come before anything is pushed
+bool Deflate_encoderSetDictionary(DeflateEncoder *encoder, Mem dict) {
+    if(encoder->len != 0) return false;
+    if(dict.len > DEFLATE_MAX_DIST) dict = memIndex(dict, dict.len - DEFLATE_MAX_DIST);
+
+    memcpy(encoder->buffer.s, dict.s, dict.len);
+    encoder->len = dict.len;
+    encoder->start = dict.len;
+
+    Deflate_insertRange(&encoder->matcher, mkMem(encoder->buffer.s, dict.len), 0, dict.len);
+    return true;
+}
+
+void Deflate_encoderDeinit(DeflateEncoder *encoder) {
+    Alloc *alloc = encoder->alloc;
+    Deflate_deinitMatcher(&encoder->matcher, alloc);
+    if(!isNull(encoder->buffer)) FreeC(alloc, encoder->buffer.s);
+    if(dynar_isInit(&encoder->values)) FreeC(alloc, encoder->values.mem.s);
+    if(encoder->sb.s.s != null) FreeC(alloc, encoder->sb.s.s);
+    *encoder = (DeflateEncoder){0};
+}
+
+// NOTE: writes out the whole bytes that are ready, the bits
+// of the last partial one wait for what comes after them
+bool Deflate_encoderEmit(DeflateEncoder *encoder) {
+    checkRet(bitwriter_flushBytes(&encoder->bits));
+    if(encoder->sb.len == 0) return true;
+
+    ResultWrite result = stream_write(encoder->out, mkMem(encoder->sb.s.s, encoder->sb.len));
+    if(result.error || result.partial) return false;
+    encoder->sb.len = 0;
+    return true;
+}
+
+bool Deflate_encoderWriteBlock(DeflateEncoder *encoder, bool final) {
+    Mem raw = mkMem(encoder->buffer.s, encoder->len);
+    Deflate_insertTail(&encoder->matcher, raw, encoder->start);
+
+    encoder->values.len = 0;
+    checkRet(Deflate_compress_tokenizeFrom(&encoder->matcher, raw, encoder->start, &encoder->values));
+    checkRet(Deflate_compress_writeBlocks(&encoder->bits, &encoder->values, memIndex(raw, encoder->start), final));
+    encoder->start = encoder->len;
+    return Deflate_encoderEmit(encoder);
+}
+
+bool Deflate_encoderPush(DeflateEncoder *encoder, Mem mem) {
+    if(encoder->finished) return false;
+
+    while(mem.len != 0) {
+        usz space = encoder->buffer.len - encoder->len;
+        usz amount = mem.len < space ? mem.len : space;
+        memcpy(encoder->buffer.s + encoder->len, mem.s, amount);
+        encoder->len += amount;
+        mem = memIndex(mem, amount);
+
+        if(encoder->len < encoder->buffer.len) continue;
+
+        checkRet(Deflate_encoderWriteBlock(encoder, false));
+
+        // NOTE: the shift is a multiple of DEFLATE_MAX_DIST,
+        // so the positions in prev stay in their slots
+        usz shift = encoder->len - DEFLATE_MAX_DIST;
+        memmove(encoder->buffer.s, encoder->buffer.s + shift, DEFLATE_MAX_DIST);
+        Deflate_slideMatcher(&encoder->matcher, shift);
+        encoder->len = DEFLATE_MAX_DIST;
+        encoder->start = DEFLATE_MAX_DIST;
+    }
+
+    return true;
+}
+
+// NOTE: makes everything pushed so far decodable from what was written to
+// out, by ending the current block and aligning to a byte with an empty
+// non-compressed block (the same as zlib's Z_SYNC_FLUSH). It costs some
+// ratio, so it's only worth it when the output has to get somewhere now
+bool Deflate_encoderFlush(DeflateEncoder *encoder) {
+    if(encoder->finished) return false;
+    if(encoder->start < encoder->len) {
+        checkRet(Deflate_encoderWriteBlock(encoder, false));
+    }
+
+    checkRet(Deflate_compress_writeSyncFlush(&encoder->bits));
+    return Deflate_encoderEmit(encoder);
+}
+
+bool Deflate_encoderFinish(DeflateEncoder *encoder) {
+    if(encoder->finished) return false;
+    checkRet(Deflate_encoderWriteBlock(encoder, true));
+    checkRet(bitwriter_flush(&encoder->bits));
+    encoder->finished = true;
+    return Deflate_encoderEmit(encoder);
+}
+
+// NOTE: compresses large inputs on several threads, the way pigz does. The
+// input is cut into DEFLATE_PARALLEL_CHUNK sized chunks, each compressed on
+// its own, with the DEFLATE_MAX_DIST bytes before it as a dictionary, so
+// matches can still reach back into the previous chunk. Every chunk but the
+// last ends with a sync flush, so they add up to a single deflate stream.
+// The checksum of each chunk is taken on the same thread, and the results
+// are combined, so the caller doesn't have to go over the input again
+#define DEFLATE_PARALLEL_CHUNK (2 * DEFLATE_ENCODER_BLOCK)
+
+// NOTE: below this, threads cost more than they save. It's well below
+// FileStorage's default sendfileThreshold, so that the files it caches
+// (and compresses) can actually get compressed in parallel
+#define DEFLATE_PARALLEL_MIN (2 * DEFLATE_PARALLEL_CHUNK)
+
+// NOTE: a checksum that can be taken in pieces, and put back together
+// from them. combine(a, b, lenB) is the checksum of A followed by B
+typedef struct {
+    u32 initial;
+    u32 (*update)(u32 check, Mem mem);
+    u32 (*combine)(u32 checkA, u32 checkB, usz lenB);
+} DeflateChecksum;
+
+typedef struct {
+    Mem raw;
+    usz start;
+    bool final;
+
+    StringBuilder out;
+    u32 check;
+    bool ok;
+} DeflateParallelChunk;
+
+typedef struct {
+    DeflateParallelChunk *chunks;
+    usz chunkCount;
+    usz next;
+
+    u8 level;
+    DeflateChecksum checksum;
+} DeflateParallelJob;
+
+// NOTE: the output goes into chunk->out, everything else comes from ALLOC
+bool Deflate_compressChunk(DeflateParallelChunk *chunk, u8 level) {
+    Dynar(DeflatePrepareValue) values = Deflate_mkValues(chunk->raw.len - chunk->start, ALLOC);
+    BitWriter out = mkBitWriter(&chunk->out);
+
+    DeflateMatcher matcher;
+    bool result = Deflate_initMatcher(&matcher, level, ALLOC);
+    if(result) Deflate_insertRange(&matcher, chunk->raw, 0, chunk->start);
+
+    result = result && Deflate_compress_tokenizeFrom(&matcher, chunk->raw, chunk->start, &values);
+    result = result && Deflate_compress_writeBlocks(&out, &values, memIndex(chunk->raw, chunk->start), chunk->final);
+    result = result && (chunk->final || Deflate_compress_writeSyncFlush(&out));
+    return result && bitwriter_flush(&out);
+}
+
+void *Deflate_parallelRoutine(void *data) {
+    DeflateParallelJob *job = data;
+
+    while(true) {
+        usz index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if(index >= job->chunkCount) break;
+
+        // NOTE: whatever compressing a chunk allocates is thrown away with it
+        DeflateParallelChunk *chunk = &job->chunks[index];
+        ALLOC_PUSH(mkAlloc_LinearExpandableAC(ALLOC_GLOBAL, 1 << 20));
+        chunk->ok = Deflate_compressChunk(chunk, job->level);
+        ALLOC_POP();
+
+        chunk->check = job->checksum.update(job->checksum.initial, memIndex(chunk->raw, chunk->start));
+    }
+
+    return null;
+}
+
+// NOTE: threads == 0 means one per core. *check receives the checksum of
+// the whole input. Small inputs, and ones with a preset dictionary, which
+// only the first chunk could use, are compressed as usual
+Mem Deflate_compressParallel(Mem raw, Mem dict, u8 level, usz threads, DeflateChecksum checksum, u32 *check, Alloc *alloc) {
+    if(threads == 0) threads = getCoreCount();
+
+    if(threads == 1 || raw.len < DEFLATE_PARALLEL_MIN || dict.len != 0) {
+        *check = checksum.update(checksum.initial, raw);
+        return Deflate_compressDict(raw, dict, level, alloc);
+    }
+
+    usz chunkCount = (raw.len + DEFLATE_PARALLEL_CHUNK - 1) / DEFLATE_PARALLEL_CHUNK;
+    if(threads > chunkCount) threads = chunkCount;
+
+    DeflateParallelChunk *chunks = (DeflateParallelChunk *)AllocateBytesC(ALLOC_GLOBAL, sizeof(DeflateParallelChunk) * chunkCount).s;
+    pthread_t *workers = (pthread_t *)AllocateBytesC(ALLOC_GLOBAL, sizeof(pthread_t) * threads).s;
+    if(chunks == null || workers == null) {
+        FreeC(ALLOC_GLOBAL, chunks);
+        FreeC(ALLOC_GLOBAL, workers);
+        return memnull;
+    }
+
+    for(usz i = 0; i < chunkCount; i++) {
+        usz begin = i * DEFLATE_PARALLEL_CHUNK;
+        usz end = begin + DEFLATE_PARALLEL_CHUNK < raw.len ? begin + DEFLATE_PARALLEL_CHUNK : raw.len;
+        usz dictionary = begin < DEFLATE_MAX_DIST ? begin : DEFLATE_MAX_DIST;
+
+        chunks[i] = (DeflateParallelChunk){
+            .raw = mkMem(raw.s + begin - dictionary, end - begin + dictionary),
+            .start = dictionary,
+            .final = i == chunkCount - 1,
+            .out = mkStringBuilderCap(DEFLATE_PARALLEL_CHUNK / 2),
+        };
+        chunks[i].out.alloc = ALLOC_GLOBAL;
+    }
+
+    DeflateParallelJob job = {
+        .chunks = chunks,
+        .chunkCount = chunkCount,
+        .level = level,
+        .checksum = checksum,
+    };
+
+    // NOTE: this thread does its share too
+    usz started = 0;
+    for(; started < threads - 1; started++) {
+        if(pthread_create(&workers[started], null, Deflate_parallelRoutine, &job) != 0) break;
+    }
+    Deflate_parallelRoutine(&job);
+    for(usz i = 0; i < started; i++) {
+        pthread_join(workers[i], null);
+    }
+
+    StringBuilder sb = mkStringBuilderCap(raw.len / 2);
+    sb.alloc = alloc;
+    bool result = true;
+    *check = checksum.initial;
+    for(usz i = 0; i < chunkCount; i++) {
+        DeflateParallelChunk *chunk = &chunks[i];
+        result = result && chunk->ok && sb_appendMem(&sb, mkMem(chunk->out.s.s, chunk->out.len));
+        *check = checksum.combine(*check, chunk->check, chunk->raw.len - chunk->start);
+        if(chunk->out.s.s != null) FreeC(ALLOC_GLOBAL, chunk->out.s.s);
+    }
+
+    FreeC(ALLOC_GLOBAL, workers);
+    FreeC(ALLOC_GLOBAL, chunks);
+
+    if(!result) {
+        if(sb.s.s != null) FreeC(alloc, sb.s.s);
+        return memnull;
+    }
+    return sb_build(sb);
+}
+
+// NOTE: pushes everything that can be read from in
+bool Deflate_encoderPushStream(DeflateEncoder *encoder, Stream *in) {
+    byte buffer[4096];
+    ResultRead r;
+    while(isJust(r = stream_read(in, mkMem(buffer, sizeof(buffer))))) {
+        if(r.read == 0) return true;
+        checkRet(Deflate_encoderPush(encoder, mkMem(buffer, r.read)));
+        if(r.partial) return true;
+    }
+    return false;
+}
 
 #endif // __LIB_DEFLATE
@@ -4,6 +4,8 @@
 // Based on RFC-1952
 // https://datatracker.ietf.org/doc/html/rfc1952
 
+#include <pthread.h>
+
 #include <types.h>
 #include <stream.h>
 #include "deflate.c"
@@ -35,35 +37,223 @@
 #define GZIP_OS_ACORN_RISCOS 13
 #define GZIP_OS_UNKNOWN 255
 
-u32 Gzip_crcTable[256] = {0};
-bool Gzip_crcTableInitialized = false;
+// NOTE: the CRC is reflected, so the polynomial is bit-reversed too
+#define GZIP_CRC_POLY 0xedb88320L
+
+// NOTE: Gzip_crcTable[k][n] is the CRC of byte n followed by k zero bytes,
+// which lets slice-by-8 take 8 bytes in one step. Gzip_crcPowers[n] is
+// x^(2^n) modulo the polynomial, for Gzip_combineCrc
+u32 Gzip_crcTable[8][256] = {0};
+u32 Gzip_crcPowers[32] = {0};
+pthread_once_t Gzip_crcOnce = PTHREAD_ONCE_INIT;
+bool Gzip_crcHasClmul = false;
+
+// NOTE: a * b modulo the polynomial, both reflected
+u32 Gzip_crcMultiply(u32 a, u32 b) {
+    u32 m = 1u << 31;
+    u32 product = 0;
+    while(true) {
+        if(a & m) {
+            product ^= b;
+            if((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ GZIP_CRC_POLY : b >> 1;
+    }
+    return product;
+}
+
 void Gzip_initializeCrcTable() {
     for(u32 n = 0; n < 256; n++) {
         u32 c = n;
         for(u32 k = 0; k < 8; k++) {
             if(c & 1) {
-                c = 0xedb88320L ^ (c >> 1);
+                c = GZIP_CRC_POLY ^ (c >> 1);
             }
             else {
                 c = c >> 1;
             }
         }
-        Gzip_crcTable[n] = c;
+        Gzip_crcTable[0][n] = c;
+    }
+
+    for(u32 n = 0; n < 256; n++) {
+        for(u32 k = 1; k < 8; k++) {
+            u32 c = Gzip_crcTable[k - 1][n];
+            Gzip_crcTable[k][n] = (c >> 8) ^ Gzip_crcTable[0][c & 0xff];
+        }
+    }
+
+    // NOTE: x^1, then squared over and over
+    u32 power = 1u << 30;
+    Gzip_crcPowers[0] = power;
+    for(usz n = 1; n < 32; n++) {
+        power = Gzip_crcMultiply(power, power);
+        Gzip_crcPowers[n] = power;
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    Gzip_crcHasClmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+// NOTE: c is the inverted CRC, as it's kept during the computation
+u32 Gzip_updateCrcTable(u32 c, Mem mem) {
+    byte *s = mem.s;
+    usz len = mem.len;
+
+    // NOTE: assumes little-endian, like everything else here
+    while(len >= 8) {
+        u32 lo, hi;
+        memcpy(&lo, s, sizeof(u32));
+        memcpy(&hi, s + 4, sizeof(u32));
+        lo ^= c;
+
+        c = Gzip_crcTable[7][lo & 0xff]
+          ^ Gzip_crcTable[6][(lo >> 8) & 0xff]
+          ^ Gzip_crcTable[5][(lo >> 16) & 0xff]
+          ^ Gzip_crcTable[4][lo >> 24]
+          ^ Gzip_crcTable[3][hi & 0xff]
+          ^ Gzip_crcTable[2][(hi >> 8) & 0xff]
+          ^ Gzip_crcTable[1][(hi >> 16) & 0xff]
+          ^ Gzip_crcTable[0][hi >> 24];
+
+        s += 8;
+        len -= 8;
+    }
+
+    while(len > 0) {
+        c = Gzip_crcTable[0][(c ^ *s) & 0xff] ^ (c >> 8);
+        s += 1;
+        len -= 1;
+    }
+
+    return c;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+#define GZIP_CRC_CLMUL_MIN 64
+
+// NOTE: folds 64 bytes at a time with carry-less multiplication, then
+// reduces what's left to 32 bits with Barrett reduction, following Intel's
+// "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ". The
+// constants are powers of x modulo the polynomial, for its reflected form.
+// Takes at least GZIP_CRC_CLMUL_MIN bytes, and a multiple of 16
+__attribute__((target("pclmul,sse4.1")))
+u32 Gzip_updateCrcClmul(u32 c, byte *s, usz len) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128((__m128i *)(s + 0x00));
+    __m128i x2 = _mm_loadu_si128((__m128i *)(s + 0x10));
+    __m128i x3 = _mm_loadu_si128((__m128i *)(s + 0x20));
+    __m128i x4 = _mm_loadu_si128((__m128i *)(s + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+    s += 64;
+    len -= 64;
+
+    while(len >= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((__m128i *)(s + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((__m128i *)(s + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((__m128i *)(s + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((__m128i *)(s + 0x30)));
+
+        s += 64;
+        len -= 64;
     }
-    Gzip_crcTableInitialized = true;
+
+    // NOTE: 4 lanes into 1
+    __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while(len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((__m128i *)s)), x5);
+        s += 16;
+        len -= 16;
+    }
+
+    // NOTE: 128 bits into 64
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, low32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // NOTE: Barrett reduction into 32
+    x2 = _mm_and_si128(x1, low32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, low32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
 }
+#endif
 
 u32 Gzip_updateCrc(u32 crc, Mem mem) {
+    pthread_once(&Gzip_crcOnce, Gzip_initializeCrcTable);
     u32 c = crc ^ 0xffffffffL;
-    if(!Gzip_crcTableInitialized) Gzip_initializeCrcTable();
-    for(usz n = 0; n < mem.len; n++) {
-        c = Gzip_crcTable[(c ^ mem.s[n]) & 0xff] ^ (c >> 8);
+
+#if defined(__x86_64__)
+    if(Gzip_crcHasClmul && mem.len >= GZIP_CRC_CLMUL_MIN) {
+        usz len = mem.len & ~(usz)15;
+        c = Gzip_updateCrcClmul(c, mem.s, len);
+        mem = memIndex(mem, len);
     }
+#endif
+
+    c = Gzip_updateCrcTable(c, mem);
     return c ^ 0xffffffffL;
 }
 
 #define Gzip_crc(mem) Gzip_updateCrc(0L, (mem))
 
+// NOTE: the CRC of A followed by B, from the CRCs of each of them. Appending
+// lenB zero bytes to A multiplies its CRC by x^(8 * lenB), which is put
+// together from the precomputed x^(2^n) powers, the same way zlib does it
+u32 Gzip_combineCrc(u32 crcA, u32 crcB, usz lenB) {
+    pthread_once(&Gzip_crcOnce, Gzip_initializeCrcTable);
+
+    // NOTE: x^0, and lenB is in bytes, so the powers start at x^(2^3)
+    u32 shift = 1u << 31;
+    for(usz n = 3; lenB != 0; n++, lenB >>= 1) {
+        if(lenB & 1) shift = Gzip_crcMultiply(Gzip_crcPowers[n & 31], shift);
+    }
+
+    return Gzip_crcMultiply(shift, crcA) ^ crcB;
+}
+
+#define GZIP_CHECKSUM ((DeflateChecksum){ .initial = 0, .update = Gzip_updateCrc, .combine = Gzip_combineCrc })
+
 // NOTE: Can be modified to work on Stream (do I care tho?)
 bool Gzip_verifyCrc(Mem mem, u32 supposedCrc) {
     u32 crc = Gzip_crc(mem);
@@ -80,35 +270,45 @@ typedef struct __attribute__((packed)) {
     byte operatingSystem;
 } GzipMember;
 
-#define Gzip_compress(m, a) Gzip_compressM(m, true, 512, a)
-Mem Gzip_compressM(Mem mem, bool useMaxLookupRange, usz maxLookupRange, Alloc *alloc) {
-    StringBuilder sb = mkStringBuilder();
-    sb.alloc = alloc;
-    Stream out_ = mkStreamSb(&sb);
-    Stream *out = &out_;
+#define GZIP_XFL_BEST 2
+#define GZIP_XFL_FASTEST 4
 
+GzipMember Gzip_mkMember(u8 level) {
     u8 flags = {0};
 
-    GzipMember member = {
+    return (GzipMember){
         .id1 = GZIP_ID1,
         .id2 = GZIP_ID2,
         .compressionMethod = GZIP_COMPRESSION_METHOD_DEFLATE,
         .flags = flags,
         .modificationTime = 0,
-        .extraFlags = 4,
+        .extraFlags = level >= DEFLATE_LEVEL_BEST ? GZIP_XFL_BEST : level <= DEFLATE_LEVEL_FASTEST ? GZIP_XFL_FASTEST : 0,
         .operatingSystem = GZIP_OS_UNIX,
     };
+}
+
+#define Gzip_compress(m, a) Gzip_compressM(m, DEFLATE_LEVEL_DEFAULT, a)
+#define Gzip_compressM(m, l, a) Gzip_compressParallel(m, l, 1, a)
+
+// NOTE: see Deflate_compressParallel, threads == 0 means one per core
+Mem Gzip_compressParallel(Mem mem, u8 level, usz threads, Alloc *alloc) {
+    StringBuilder sb = mkStringBuilder();
+    sb.alloc = alloc;
+    Stream out_ = mkStreamSb(&sb);
+    Stream *out = &out_;
 
+    GzipMember member = Gzip_mkMember(level);
     ResultWrite result = stream_write(out, mkMem((byte *)&member, sizeof(GzipMember)));
     if(result.error || result.partial) return memnull;
 
-    Mem compressed = Deflate_compress(mem, useMaxLookupRange, maxLookupRange, ALLOC);
-    if(isNull(compressed)) return memnull; 
+    u32 crc = 0;
+    Mem compressed = Deflate_compressParallel(mem, memnull, level, threads, GZIP_CHECKSUM, &crc, alloc);
+    if(isNull(compressed)) return memnull;
 
     result = stream_write(out, compressed);
+    FreeC(alloc, compressed.s);
     if(result.error || result.partial) return memnull;
 
-    u32 crc = Gzip_crc(mem);
     result = stream_write(out, mkMem((byte *)&crc, sizeof(u32)));
     if(result.error || result.partial) return memnull;
 
@@ -119,81 +319,201 @@ Mem Gzip_compressM(Mem mem, bool useMaxLookupRange, usz maxLookupRange, Alloc *a
     return sb_build(sb);
 }
 
-Mem Gzip_decompress(Mem mem, Alloc *alloc) {
-    Stream in_ = mkStreamStr(mem);
-    Stream *in = &in_;
+// NOTE: a gzip member written to out as the input is pushed, see DeflateEncoder
+typedef struct {
+    DeflateEncoder deflate;
+    u32 crc;
+    u32 isize;
+} GzipEncoder;
 
-    GzipMember member = {0};
+bool Gzip_encoderInit(GzipEncoder *encoder, Stream *out, u8 level, Alloc *alloc) {
+    encoder->crc = 0;
+    encoder->isize = 0;
+    checkRet(Deflate_encoderInit(&encoder->deflate, out, level, alloc));
 
-    ResultRead result = stream_read(in, mkMem((byte *)&member, sizeof(GzipMember)));
-    if(result.error || result.partial) return memnull;
+    GzipMember member = Gzip_mkMember(level);
+    ResultWrite result = stream_write(out, mkMem((byte *)&member, sizeof(GzipMember)));
+    return !result.error && !result.partial;
+}
 
-    if(member.id1 != GZIP_ID1 || member.id2 != GZIP_ID2) return memnull;
-    if(member.compressionMethod != GZIP_COMPRESSION_METHOD_DEFLATE) return memnull;
+#define Gzip_encoderDeinit(encoder) Deflate_encoderDeinit(&(encoder)->deflate)
+#define Gzip_encoderFlush(encoder) Deflate_encoderFlush(&(encoder)->deflate)
 
-    printf("%x %x\n", member.id1, member.id2);
+bool Gzip_encoderPush(GzipEncoder *encoder, Mem mem) {
+    encoder->crc = Gzip_updateCrc(encoder->crc, mem);
+    encoder->isize += mem.len & 0xffffffffL;
+    return Deflate_encoderPush(&encoder->deflate, mem);
+}
 
-    bool flagText = (member.flags >> GZIP_FLAG_TEXT) & 1;
-    bool flagCrc16 = (member.flags >> GZIP_FLAG_CRC16) & 1;
-    bool flagExtra = (member.flags >> GZIP_FLAG_EXTRA) & 1;
-    bool flagName = (member.flags >> GZIP_FLAG_NAME) & 1;
-    bool flagComment = (member.flags >> GZIP_FLAG_COMMENT) & 1;
-    printf("%d %d %d %d %d\n", flagText, flagCrc16, flagExtra, flagName, flagComment);
-    printf("%d\n", member.flags);
+bool Gzip_encoderFinish(GzipEncoder *encoder) {
+    checkRet(Deflate_encoderFinish(&encoder->deflate));
 
-    if(flagExtra) {
-        u16 xlen = 0;
-        result = stream_read(in, mkMem((byte *)&xlen, sizeof(u16)));
-        if(result.error || result.partial) return memnull;
+    Stream *out = encoder->deflate.out;
+    ResultWrite result = stream_write(out, mkMem((byte *)&encoder->crc, sizeof(u32)));
+    if(result.error || result.partial) return false;
 
-        for(int i = 0; i < xlen; i++) {
-            stream_popChar(in);
-        }
+    result = stream_write(out, mkMem((byte *)&encoder->isize, sizeof(u32)));
+    return !result.error && !result.partial;
+}
+
+// NOTE: the length of the member header at the start of mem, 0 if mem
+// doesn't have all of it yet, or -1 if it's not a valid header
+isz Gzip_parseHeader(Mem mem) {
+    if(mem.len < sizeof(GzipMember)) return 0;
+
+    GzipMember member;
+    memcpy(&member, mem.s, sizeof(GzipMember));
+    if(member.id1 != GZIP_ID1 || member.id2 != GZIP_ID2) return -1;
+    if(member.compressionMethod != GZIP_COMPRESSION_METHOD_DEFLATE) return -1;
+
+    usz len = sizeof(GzipMember);
+
+    if((member.flags >> GZIP_FLAG_EXTRA) & 1) {
+        if(len + 2 > mem.len) return 0;
+        u16 xlen = mem.s[len] | (mem.s[len + 1] << 8);
+        len += 2 + xlen;
+        if(len > mem.len) return 0;
     }
 
-    StringBuilder nameSb = mkStringBuilder();
-    if(flagName) {
-        MaybeChar c;
-        while(isJust(c = stream_popChar(in)) && c.value != 0) {
-            sb_appendChar(&nameSb, c.value);
-        }
+    // NOTE: the name and the comment are zero-terminated
+    for(u8 flag = GZIP_FLAG_NAME; flag <= GZIP_FLAG_COMMENT; flag++) {
+        if(((member.flags >> flag) & 1) == 0) continue;
+        while(len < mem.len && mem.s[len] != 0) len++;
+        if(len >= mem.len) return 0;
+        len += 1;
     }
 
-    StringBuilder commentSb = mkStringBuilder();
-    if(flagComment) {
-        MaybeChar c;
-        while(isJust(c = stream_popChar(in)) && c.value != 0) {
-            sb_appendChar(&commentSb, c.value);
-        }
+    // NOTE: the lower 16 bits of the CRC-32 of the header before it
+    if((member.flags >> GZIP_FLAG_CRC16) & 1) {
+        if(len + 2 > mem.len) return 0;
+        u16 crc = mem.s[len] | (mem.s[len + 1] << 8);
+        if((Gzip_crc(mkMem(mem.s, len)) & 0xffff) != crc) return -1;
+        len += 2;
     }
 
-    if(flagCrc16) {
-        u16 crc = 0;
-        result = stream_read(in, mkMem((byte *)&crc, sizeof(u16)));
-        if(result.error || result.partial) return memnull;
+    return len;
+}
 
-        // TODO: this is bad, need to improve stream.pos
-        usz len = in_.i;
-        Mem header = mkMem(mem.s, len);
-        if(!Gzip_verifyCrc(header, crc)) return memnull;
-    }
+Mem Gzip_decompress(Mem mem, Alloc *alloc) {
+    isz parsed = Gzip_parseHeader(mem);
+    if(parsed <= 0) return memnull;
+    usz headerLen = parsed;
 
-    DeflateDeCompResult dresult = Deflate_decompress(in, alloc);
+    DeflateDeCompResult dresult = Deflate_decompressMem(memIndex(mem, headerLen), alloc);
     if(isNone(dresult)) return memnull;
 
-    u32 crc = 0;
-    result = stream_read(in, mkMem((byte *)&crc, sizeof(u32)));
-    if(result.error || result.partial) return memnull;
+    Mem trailer = memIndex(mem, headerLen + dresult.consumed);
+    if(trailer.len < 2 * sizeof(u32)) return memnull;
 
+    u32 crc = 0;
+    memcpy(&crc, trailer.s, sizeof(u32));
     if(!Gzip_verifyCrc(dresult.mem, crc)) return memnull;
 
     u32 isize = 0;
-    result = stream_read(in, mkMem((byte *)&isize, sizeof(u32)));
-    if(result.error || result.partial) return memnull;
-
+    memcpy(&isize, trailer.s + sizeof(u32), sizeof(u32));
     if(isize != (dresult.mem.len & 0xffffffffL)) return memnull;
 
     return dresult.mem;
 }
 
+// NOTE: decodes a gzip member that comes in pieces, see DeflateDecoder.
+// Only the first member is decoded, anything after it is ignored
+#define GZIP_DECODER_HEADER 0
+#define GZIP_DECODER_BODY 1
+#define GZIP_DECODER_TRAILER 2
+#define GZIP_DECODER_DONE 3
+
+#ifndef GZIP_HEADER_LIMIT
+#define GZIP_HEADER_LIMIT 1024
+#endif
+
+typedef struct {
+    u8 state;
+
+    byte header[GZIP_HEADER_LIMIT];
+    usz headerLen;
+
+    byte trailer[2 * sizeof(u32)];
+    usz trailerLen;
+
+    u32 crc;
+    u32 isize;
+
+    DeflateDecoder deflate;
+} GzipDecoder;
+
+void Gzip_decoderInit(GzipDecoder *decoder) {
+    decoder->state = GZIP_DECODER_HEADER;
+    decoder->headerLen = 0;
+    decoder->trailerLen = 0;
+    decoder->crc = 0;
+    decoder->isize = 0;
+    Deflate_decoderInit(&decoder->deflate);
+}
+
+usz Gzip_decoderTakeTrailer(GzipDecoder *decoder, Mem mem) {
+    usz len = sizeof(decoder->trailer) - decoder->trailerLen;
+    if(len > mem.len) len = mem.len;
+    memcpy(decoder->trailer + decoder->trailerLen, mem.s, len);
+    decoder->trailerLen += len;
+    return len;
+}
+
+DeflateDecodeResult Gzip_decoderDecode(GzipDecoder *decoder, Mem in, Mem out) {
+    DeflateDecodeResult result = {0};
+
+    if(decoder->state == GZIP_DECODER_HEADER) {
+        usz len = GZIP_HEADER_LIMIT - decoder->headerLen;
+        if(len > in.len) len = in.len;
+        memcpy(decoder->header + decoder->headerLen, in.s, len);
+
+        isz headerLen = Gzip_parseHeader(mkMem(decoder->header, decoder->headerLen + len));
+        if(headerLen < 0) return none(DeflateDecodeResult);
+        if(headerLen == 0) {
+            decoder->headerLen += len;
+            if(decoder->headerLen == GZIP_HEADER_LIMIT) return none(DeflateDecodeResult);
+            result.consumed = len;
+            return result;
+        }
+
+        result.consumed = headerLen - decoder->headerLen;
+        in = memIndex(in, result.consumed);
+        decoder->state = GZIP_DECODER_BODY;
+    }
+
+    if(decoder->state == GZIP_DECODER_BODY) {
+        DeflateDecodeResult body = Deflate_decoderDecode(&decoder->deflate, in, out);
+        if(isNone(body)) return body;
+
+        result.consumed += body.consumed;
+        result.produced = body.produced;
+        in = memIndex(in, body.consumed);
+
+        Mem produced = mkMem(out.s, body.produced);
+        decoder->crc = Gzip_updateCrc(decoder->crc, produced);
+        decoder->isize += produced.len & 0xffffffffL;
+
+        if(!body.done) return result;
+
+        // NOTE: the decoder may have taken some of the trailer already
+        Gzip_decoderTakeTrailer(decoder, Deflate_decoderTrailing(&decoder->deflate));
+        decoder->state = GZIP_DECODER_TRAILER;
+    }
+
+    if(decoder->state == GZIP_DECODER_TRAILER) {
+        result.consumed += Gzip_decoderTakeTrailer(decoder, in);
+        if(decoder->trailerLen < sizeof(decoder->trailer)) return result;
+
+        u32 crc = 0;
+        u32 isize = 0;
+        memcpy(&crc, decoder->trailer, sizeof(u32));
+        memcpy(&isize, decoder->trailer + sizeof(u32), sizeof(u32));
+        if(crc != decoder->crc || isize != decoder->isize) return none(DeflateDecodeResult);
+        decoder->state = GZIP_DECODER_DONE;
+    }
+
+    result.done = decoder->state == GZIP_DECODER_DONE;
+    return result;
+}
+
 #endif // __LIB_GZIP
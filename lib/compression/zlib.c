@@ -22,36 +22,156 @@ typedef struct __attribute__((packed)) {
     byte flags;
 } ZlibStream;
 
-u32 Zlib_adler32(Mem mem) {
-    u16 adlerS1 = 1;
-    u16 adlerS2 = 0;
-    for(usz i = 0; i < mem.len; i++) {
-        adlerS1 = (adlerS1 + mem.s[i]) % ZLIB_ADLER_BASE;
-        adlerS2 = (adlerS2 + adlerS1) % ZLIB_ADLER_BASE;
+// NOTE: the most bytes that can be summed before s2 could overflow 32 bits,
+// the largest n with 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1. Both sums are
+// only reduced once per this many bytes, instead of on every byte
+#define ZLIB_ADLER_NMAX 5552
+
+u32 Zlib_updateAdler32Scalar(u32 s1, u32 s2, byte *s, usz len) {
+    while(len > 0) {
+        usz n = len < ZLIB_ADLER_NMAX ? len : ZLIB_ADLER_NMAX;
+        len -= n;
+
+        while(n >= 8) {
+            s1 += s[0]; s2 += s1;
+            s1 += s[1]; s2 += s1;
+            s1 += s[2]; s2 += s1;
+            s1 += s[3]; s2 += s1;
+            s1 += s[4]; s2 += s1;
+            s1 += s[5]; s2 += s1;
+            s1 += s[6]; s2 += s1;
+            s1 += s[7]; s2 += s1;
+            s += 8;
+            n -= 8;
+        }
+        while(n > 0) {
+            s1 += *s++; s2 += s1;
+            n -= 1;
+        }
+
+        s1 %= ZLIB_ADLER_BASE;
+        s2 %= ZLIB_ADLER_BASE;
     }
 
-    u32 result = ((adlerS2 >> 8) & 0xff)
-               | (((adlerS2 >> 0) & 0xff) << 8)
-               | (((adlerS1 >> 8) & 0xff) << 16)
-               | (((adlerS1 >> 0) & 0xff) << 24);
-   
-    return result;
+    return (s2 << 16) | s1;
 }
 
-#define Zlib_compress(m, a) Zlib_compressM(m, true, 512, a)
-Mem Zlib_compressM(Mem mem, bool useMaxLookupRange, usz maxLookupRange, Alloc *alloc) {
-    StringBuilder sb = mkStringBuilder();
-    sb.alloc = alloc;
-    Stream out_ = mkStreamSb(&sb);
-    Stream *out = &out_;
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+#define ZLIB_ADLER_BLOCK 32
+
+// NOTE: takes 32 bytes per step. s1 gets their plain sum (psadbw against
+// zero), and s2 gets them weighted by 32..1 (pmaddubsw), plus 32 times
+// s1 from before the step, which is collected in ps and added at the
+// end. Returns the state after the whole blocks, the rest is left over
+__attribute__((target("ssse3")))
+u32 Zlib_updateAdler32Simd(u32 s1, u32 s2, byte *s, usz blocks) {
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    while(blocks > 0) {
+        usz n = ZLIB_ADLER_NMAX / ZLIB_ADLER_BLOCK;
+        if(n > blocks) n = blocks;
+        blocks -= n;
+
+        __m128i vps = _mm_set_epi32(0, 0, 0, s1 * n);
+        __m128i vs2 = _mm_set_epi32(0, 0, 0, s2);
+        __m128i vs1 = _mm_setzero_si128();
+
+        for(; n > 0; n--) {
+            __m128i bytes1 = _mm_loadu_si128((__m128i *)s);
+            __m128i bytes2 = _mm_loadu_si128((__m128i *)(s + 16));
+
+            vps = _mm_add_epi32(vps, vs1);
+            vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(bytes1, zero));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+            vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(bytes2, zero));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+
+            s += ZLIB_ADLER_BLOCK;
+        }
+
+        vs2 = _mm_add_epi32(vs2, _mm_slli_epi32(vps, 5));
+
+        vs1 = _mm_add_epi32(vs1, _mm_shuffle_epi32(vs1, _MM_SHUFFLE(2, 3, 0, 1)));
+        vs1 = _mm_add_epi32(vs1, _mm_shuffle_epi32(vs1, _MM_SHUFFLE(1, 0, 3, 2)));
+        vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(2, 3, 0, 1)));
+        vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(1, 0, 3, 2)));
+
+        s1 = (s1 + (u32)_mm_cvtsi128_si32(vs1)) % ZLIB_ADLER_BASE;
+        s2 = (u32)_mm_cvtsi128_si32(vs2) % ZLIB_ADLER_BASE;
+    }
+
+    return (s2 << 16) | s1;
+}
+#endif
+
+// NOTE: adler is kept the usual way (s2 << 16 | s1), starting from 1
+u32 Zlib_updateAdler32(u32 adler, Mem mem) {
+    u32 s1 = adler & 0xffff;
+    u32 s2 = adler >> 16;
 
+#if defined(__x86_64__)
+    usz blocks = mem.len / ZLIB_ADLER_BLOCK;
+    if(blocks > 0 && __builtin_cpu_supports("ssse3")) {
+        adler = Zlib_updateAdler32Simd(s1, s2, mem.s, blocks);
+        s1 = adler & 0xffff;
+        s2 = adler >> 16;
+        mem = memIndex(mem, blocks * ZLIB_ADLER_BLOCK);
+    }
+#endif
+
+    return Zlib_updateAdler32Scalar(s1, s2, mem.s, mem.len);
+}
+
+// NOTE: the stream stores it big-endian, this is that when read as a u32
+u32 Zlib_adler32Stored(u32 adler) {
+    return ((adler >> 24) & 0xff)
+         | (((adler >> 16) & 0xff) << 8)
+         | (((adler >> 8) & 0xff) << 16)
+         | (((adler >> 0) & 0xff) << 24);
+}
+
+#define Zlib_adler32(mem) Zlib_adler32Stored(Zlib_updateAdler32(1, (mem)))
+
+// NOTE: the adler of A followed by B, from the adlers of each of them.
+// Every byte of A is counted lenB more times in s2, and s1 of B is
+// offset by what s1 of A was past the initial 1
+u32 Zlib_combineAdler32(u32 adlerA, u32 adlerB, usz lenB) {
+    u32 rem = lenB % ZLIB_ADLER_BASE;
+    u32 s1 = adlerA & 0xffff;
+    u32 s2 = (u32)(((u64)rem * s1) % ZLIB_ADLER_BASE);
+
+    s1 += (adlerB & 0xffff) + ZLIB_ADLER_BASE - 1;
+    s2 += (adlerA >> 16) + (adlerB >> 16) + ZLIB_ADLER_BASE - rem;
+
+    if(s1 >= ZLIB_ADLER_BASE) s1 -= ZLIB_ADLER_BASE;
+    if(s1 >= ZLIB_ADLER_BASE) s1 -= ZLIB_ADLER_BASE;
+    if(s2 >= 2 * ZLIB_ADLER_BASE) s2 -= 2 * ZLIB_ADLER_BASE;
+    if(s2 >= ZLIB_ADLER_BASE) s2 -= ZLIB_ADLER_BASE;
+    return (s2 << 16) | s1;
+}
+
+#define ZLIB_CHECKSUM ((DeflateChecksum){ .initial = 1, .update = Zlib_updateAdler32, .combine = Zlib_combineAdler32 })
+
+// NOTE: FLEVEL is only informative, and maps the deflate levels the same way zlib does
+byte Zlib_compressionLevel(u8 level) {
+    if(level < 2) return ZLIB_LEVEL_FASTEST;
+    if(level < 6) return ZLIB_LEVEL_FAST;
+    if(level == 6) return ZLIB_LEVEL_DEFAULT;
+    return ZLIB_LEVEL_SLOWEST;
+}
+
+ZlibStream Zlib_mkStream(u8 level, bool presetDictionary) {
     byte compressionMethod = ZLIB_METHOD_DEFLATE;
     byte compressionInfo = 7; // compression window
     byte cmf = (compressionMethod & 0b1111) 
              | ((compressionInfo & 0b1111) << 4);
 
-    byte compressionLevel = ZLIB_LEVEL_DEFAULT;
-    byte presetDictionary = 0; // false
+    byte compressionLevel = Zlib_compressionLevel(level);
     byte flags = ((presetDictionary & 0b1) << 5)
                | ((compressionLevel & 0b11) << 6);
 
@@ -63,28 +183,88 @@ Mem Zlib_compressM(Mem mem, bool useMaxLookupRange, usz maxLookupRange, Alloc *a
                + ((u16)flags * 1);
     }
 
-    ZlibStream zs = {
+    return (ZlibStream){
         .cmf = cmf,
         .flags = flags
     };
+}
 
+// NOTE: with a preset dictionary, the header is followed
+// by its adler32 (DICTID), so the decoder can tell which one it was
+bool Zlib_writeHeader(Stream *out, u8 level, Mem dict) {
+    ZlibStream zs = Zlib_mkStream(level, dict.len != 0);
     ResultWrite result = stream_write(out, mkMem((byte *)&zs, sizeof(ZlibStream)));
-    if(result.error || result.partial) return memnull;
+    if(result.error || result.partial) return false;
+    if(dict.len == 0) return true;
+
+    u32 dictid = Zlib_adler32(dict);
+    result = stream_write(out, mkMem((byte *)&dictid, sizeof(u32)));
+    return !result.error && !result.partial;
+}
+
+#define Zlib_compress(m, a) Zlib_compressM(m, DEFLATE_LEVEL_DEFAULT, a)
+#define Zlib_compressM(m, l, a) Zlib_compressParallel(m, l, 1, a)
+#define Zlib_compressParallel(m, l, t, a) Zlib_compressDictParallel(m, memnull, l, t, a)
+#define Zlib_compressDict(m, d, l, a) Zlib_compressDictParallel(m, d, l, 1, a)
+
+// NOTE: see Deflate_compressParallel, threads == 0 means one per core.
+// dict is a preset dictionary, see Deflate_compressDict
+Mem Zlib_compressDictParallel(Mem mem, Mem dict, u8 level, usz threads, Alloc *alloc) {
+    StringBuilder sb = mkStringBuilder();
+    sb.alloc = alloc;
+    Stream out_ = mkStreamSb(&sb);
+    Stream *out = &out_;
+
+    if(!Zlib_writeHeader(out, level, dict)) return memnull;
 
-    Mem compressed = Deflate_compress(mem, useMaxLookupRange, maxLookupRange, alloc);
+    u32 adler = 1;
+    Mem compressed = Deflate_compressParallel(mem, dict, level, threads, ZLIB_CHECKSUM, &adler, alloc);
     if(isNull(compressed)) return memnull;
 
-    result = stream_write(out, compressed);
+    ResultWrite result = stream_write(out, compressed);
+    FreeC(alloc, compressed.s);
     if(result.error || result.partial) return memnull;
 
-    u32 adler32 = Zlib_adler32(mem);
+    u32 adler32 = Zlib_adler32Stored(adler);
     result = stream_write(out, mkMem((byte *)&adler32, sizeof(u32)));
     if(result.error || result.partial) return memnull;
 
     return sb_build(sb);
 }
 
-Mem Zlib_decompress(Mem mem, Alloc *alloc) {
+// NOTE: a zlib stream written to out as the input is pushed, see DeflateEncoder
+typedef struct {
+    DeflateEncoder deflate;
+    u32 adler;
+} ZlibEncoder;
+
+bool Zlib_encoderInitDict(ZlibEncoder *encoder, Stream *out, u8 level, Mem dict, Alloc *alloc) {
+    encoder->adler = 1;
+    checkRet(Deflate_encoderInit(&encoder->deflate, out, level, alloc));
+    checkRet(Deflate_encoderSetDictionary(&encoder->deflate, dict));
+    return Zlib_writeHeader(out, level, dict);
+}
+#define Zlib_encoderInit(encoder, out, level, alloc) Zlib_encoderInitDict(encoder, out, level, memnull, alloc)
+
+#define Zlib_encoderDeinit(encoder) Deflate_encoderDeinit(&(encoder)->deflate)
+#define Zlib_encoderFlush(encoder) Deflate_encoderFlush(&(encoder)->deflate)
+
+bool Zlib_encoderPush(ZlibEncoder *encoder, Mem mem) {
+    encoder->adler = Zlib_updateAdler32(encoder->adler, mem);
+    return Deflate_encoderPush(&encoder->deflate, mem);
+}
+
+bool Zlib_encoderFinish(ZlibEncoder *encoder) {
+    checkRet(Deflate_encoderFinish(&encoder->deflate));
+
+    u32 adler32 = Zlib_adler32Stored(encoder->adler);
+    ResultWrite result = stream_write(encoder->deflate.out, mkMem((byte *)&adler32, sizeof(u32)));
+    return !result.error && !result.partial;
+}
+
+// NOTE: a stream with a preset dictionary can only be
+// decompressed with the same dictionary it was compressed with
+Mem Zlib_decompressDict(Mem mem, Mem dict, Alloc *alloc) {
     Stream in_ = mkStreamStr(mem);
     Stream *in = &in_;
 
@@ -107,9 +287,13 @@ Mem Zlib_decompress(Mem mem, Alloc *alloc) {
         u32 dictid = 0;
         result = stream_read(in, mkMem((byte *)&dictid, sizeof(u32)));
         if(result.error || result.partial) return memnull;
+        if(dict.len == 0 || dictid != Zlib_adler32(dict)) return memnull;
+    }
+    else {
+        dict = memnull;
     }
 
-    DeflateDeCompResult decompressed = Deflate_decompress(in, alloc);
+    DeflateDeCompResult decompressed = Deflate_decompressDict(in, dict, alloc);
     if(isNone(decompressed)) return memnull;
 
     u32 adler32 = 0;
@@ -120,5 +304,120 @@ Mem Zlib_decompress(Mem mem, Alloc *alloc) {
 
     return decompressed.mem;
 }
+#define Zlib_decompress(mem, alloc) Zlib_decompressDict(mem, memnull, alloc)
+
+// NOTE: decodes a zlib stream that comes in pieces, see DeflateDecoder.
+// Streams with a preset dictionary need it set with Zlib_decoderSetDictionary
+#define ZLIB_DECODER_HEADER 0
+#define ZLIB_DECODER_BODY 1
+#define ZLIB_DECODER_TRAILER 2
+#define ZLIB_DECODER_DONE 3
+
+typedef struct {
+    u8 state;
+
+    // NOTE: with room for the DICTID
+    byte header[sizeof(ZlibStream) + sizeof(u32)];
+    usz headerLen;
+
+    bool hasDictionary;
+    u32 dictid;
+
+    byte trailer[sizeof(u32)];
+    usz trailerLen;
+
+    u32 adler;
+
+    DeflateDecoder deflate;
+} ZlibDecoder;
+
+void Zlib_decoderInit(ZlibDecoder *decoder) {
+    decoder->state = ZLIB_DECODER_HEADER;
+    decoder->headerLen = 0;
+    decoder->hasDictionary = false;
+    decoder->dictid = 0;
+    decoder->trailerLen = 0;
+    decoder->adler = 1;
+    Deflate_decoderInit(&decoder->deflate);
+}
+
+// NOTE: has to come right after Zlib_decoderInit
+void Zlib_decoderSetDictionary(ZlibDecoder *decoder, Mem dict) {
+    decoder->hasDictionary = true;
+    decoder->dictid = Zlib_adler32(dict);
+    Deflate_decoderSetDictionary(&decoder->deflate, dict);
+}
+
+usz Zlib_decoderTake(byte *dst, usz *taken, usz size, Mem mem) {
+    usz len = size - *taken;
+    if(len > mem.len) len = mem.len;
+    memcpy(dst + *taken, mem.s, len);
+    *taken += len;
+    return len;
+}
+
+DeflateDecodeResult Zlib_decoderDecode(ZlibDecoder *decoder, Mem in, Mem out) {
+    DeflateDecodeResult result = {0};
+
+    if(decoder->state == ZLIB_DECODER_HEADER) {
+        if(decoder->headerLen < sizeof(ZlibStream)) {
+            result.consumed = Zlib_decoderTake(decoder->header, &decoder->headerLen, sizeof(ZlibStream), in);
+            in = memIndex(in, result.consumed);
+            if(decoder->headerLen < sizeof(ZlibStream)) return result;
+        }
+
+        ZlibStream zs;
+        memcpy(&zs, decoder->header, sizeof(ZlibStream));
+        if(((u16)zs.cmf * 256 + (u16)zs.flags) % 31 != 0) return none(DeflateDecodeResult);
+        if((zs.cmf & 0b1111) != ZLIB_METHOD_DEFLATE) return none(DeflateDecodeResult);
+
+        bool presetDictionary = ((zs.flags >> 5) & 0b1) == 1;
+        if(presetDictionary) {
+            usz taken = Zlib_decoderTake(decoder->header, &decoder->headerLen, sizeof(decoder->header), in);
+            result.consumed += taken;
+            in = memIndex(in, taken);
+            if(decoder->headerLen < sizeof(decoder->header)) return result;
+
+            u32 dictid = 0;
+            memcpy(&dictid, decoder->header + sizeof(ZlibStream), sizeof(u32));
+            if(!decoder->hasDictionary || dictid != decoder->dictid) return none(DeflateDecodeResult);
+        }
+        else if(decoder->hasDictionary) {
+            // NOTE: the stream wasn't compressed against it, so it can't reach into it
+            Deflate_decoderInit(&decoder->deflate);
+        }
+
+        decoder->state = ZLIB_DECODER_BODY;
+    }
+
+    if(decoder->state == ZLIB_DECODER_BODY) {
+        DeflateDecodeResult body = Deflate_decoderDecode(&decoder->deflate, in, out);
+        if(isNone(body)) return body;
+
+        result.consumed += body.consumed;
+        result.produced = body.produced;
+        in = memIndex(in, body.consumed);
+        decoder->adler = Zlib_updateAdler32(decoder->adler, mkMem(out.s, body.produced));
+
+        if(!body.done) return result;
+
+        // NOTE: the decoder may have taken some of the trailer already
+        Zlib_decoderTake(decoder->trailer, &decoder->trailerLen, sizeof(decoder->trailer), Deflate_decoderTrailing(&decoder->deflate));
+        decoder->state = ZLIB_DECODER_TRAILER;
+    }
+
+    if(decoder->state == ZLIB_DECODER_TRAILER) {
+        result.consumed += Zlib_decoderTake(decoder->trailer, &decoder->trailerLen, sizeof(decoder->trailer), in);
+        if(decoder->trailerLen < sizeof(decoder->trailer)) return result;
+
+        u32 adler32 = 0;
+        memcpy(&adler32, decoder->trailer, sizeof(u32));
+        if(adler32 != Zlib_adler32Stored(decoder->adler)) return none(DeflateDecodeResult);
+        decoder->state = ZLIB_DECODER_DONE;
+    }
+
+    result.done = decoder->state == ZLIB_DECODER_DONE;
+    return result;
+}
 
 #endif // __LIB_ZLIB
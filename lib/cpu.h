@@ -0,0 +1,14 @@
+#ifndef __LIB_CPU
+#define __LIB_CPU
+
+#include <unistd.h>
+
+#include "types.h"
+
+// NOTE: the amount of cores online, at least 1 even if it can't be told
+usz getCoreCount() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores < 1 ? 1 : (usz)cores;
+}
+
+#endif // __LIB_CPU
@@ -0,0 +1,208 @@
+#ifndef __LIB_LRU
+#define __LIB_LRU
+
+#include <pthread.h>
+
+#include "types.h"
+#include "alloc.h"
+#include "map.h"
+#include "hashmap.h"
+
+// NOTE: a cache of reference counted entries, shared between threads. The
+// entries are the caller's own structs, with an LruEntry as their first
+// member. Once they take up more bytes than the budget, least recently
+// used ones get evicted, and each one is freed once neither the cache
+// nor anyone it was handed out to holds it anymore
+
+typedef struct LruEntry LruEntry;
+
+typedef struct {
+    u64 hits;
+    u64 misses;
+    u64 expirations;
+    u64 evictions;
+} LruStats;
+
+typedef struct {
+    Alloc *alloc;
+
+    // NOTE: 0 - no limit
+    usz budget;
+    usz used;
+
+    // NOTE: guards the LRU list, entry reference counts and stats. Taken
+    // after a hashmap bucket's lock, never before
+    pthread_mutex_t lock;
+    LruEntry *head;
+    LruEntry *tail;
+    LruStats stats;
+
+    // NOTE: frees the caller's struct, the key is already freed by then
+    void (*freeEntry)(LruEntry *entry);
+
+    HASHMAP(String, LruEntry *) hm;
+} LruCache;
+
+// NOTE: the cache holds one reference while the entry is in the hashmap,
+// and each lookup that hits it holds another
+struct LruEntry {
+    LruCache *cache;
+    String key;
+    usz cost;
+
+    usz refs;
+    bool evicted;
+    LruEntry *prev;
+    LruEntry *next;
+};
+
+// NOTE: one reference for the cache, and one for whoever made the entry
+#define mkLruEntry(_cache, _key, _cost) ((LruEntry){ .cache = (_cache), .key = mem_clone((_key), (_cache)->alloc), .cost = (_cost), .refs = 2 })
+
+void lru_unref(LruEntry *entry) {
+    LruCache *cache = entry->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    entry->refs -= 1;
+    bool dead = entry->refs == 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    if(dead) {
+        FreeC(cache->alloc, entry->key.s);
+        cache->freeEntry(entry);
+    }
+}
+
+// NOTE: all of these expect cache->lock to be held
+void lru_unlink(LruCache *cache, LruEntry *entry) {
+    if(entry->prev) entry->prev->next = entry->next;
+    else            cache->head = entry->next;
+    if(entry->next) entry->next->prev = entry->prev;
+    else            cache->tail = entry->prev;
+    entry->prev = null;
+    entry->next = null;
+}
+
+void lru_append(LruCache *cache, LruEntry *entry) {
+    entry->prev = cache->tail;
+    entry->next = null;
+    if(cache->tail) cache->tail->next = entry;
+    else            cache->head = entry;
+    cache->tail = entry;
+}
+
+void lru_detach(LruCache *cache, LruEntry *entry) {
+    lru_unlink(cache, entry);
+    cache->used -= entry->cost;
+    entry->evicted = true;
+}
+
+// NOTE: all of these expect the bucket map of the key to be locked
+LruEntry *lru_find(Map *map, String key) {
+    Mem found = map_get(map, key);
+    return isNull(found) ? null : memExtract(LruEntry *, found);
+}
+
+// NOTE: takes a reference to the entry, unless it was evicted meanwhile
+bool lru_hit(LruCache *cache, LruEntry *entry) {
+    bool hit = false;
+    pthread_mutex_lock(&cache->lock);
+    if(!entry->evicted) {
+        entry->refs += 1;
+        lru_unlink(cache, entry);
+        lru_append(cache, entry);
+        cache->stats.hits += 1;
+        hit = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+// NOTE: puts entry in place of whatever was under its key, and returns
+// that. The cache's reference to it has to be dropped with lru_unref once
+// the map is unlocked, since in-flight lookups may still hold it
+LruEntry *lru_insert(LruCache *cache, Map *map, LruEntry *entry) {
+    LruEntry *old = lru_find(map, entry->key);
+    LruEntry *replaced = null;
+
+    pthread_mutex_lock(&cache->lock);
+    // NOTE: if the old version was already evicted, its evictor drops
+    // the cache's reference to it
+    if(old != null && !old->evicted) {
+        lru_detach(cache, old);
+        replaced = old;
+    }
+    lru_append(cache, entry);
+    cache->used += entry->cost;
+    cache->stats.misses += 1;
+    pthread_mutex_unlock(&cache->lock);
+
+    map_set(map, entry->key, memPointer(LruEntry *, &entry));
+    return replaced;
+}
+
+// NOTE: takes entry out of the cache, and returns whether the caller has
+// to drop the cache's reference to it, the same as with lru_insert
+bool lru_removeCounted(LruCache *cache, Map *map, LruEntry *entry, u64 *count) {
+    bool removed = false;
+    pthread_mutex_lock(&cache->lock);
+    if(!entry->evicted) {
+        lru_detach(cache, entry);
+        if(count != null) *count += 1;
+        removed = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if(removed) map_remove(map, entry->key);
+    return removed;
+}
+#define lru_remove(cache, map, entry) lru_removeCounted((cache), (map), (entry), null)
+#define lru_expire(cache, map, entry) lru_removeCounted((cache), (map), (entry), &(cache)->stats.expirations)
+
+// NOTE: called without any bucket locked, since the evicted entry
+// can be in any of them
+void lru_evict(LruCache *cache) {
+    while(true) {
+        pthread_mutex_lock(&cache->lock);
+        LruEntry *victim = null;
+        if(cache->budget != 0 && cache->used > cache->budget) {
+            victim = cache->head;
+        }
+        if(victim != null) {
+            lru_detach(cache, victim);
+            cache->stats.evictions += 1;
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        if(victim == null) return;
+
+        Map *map = hm_getMap(&cache->hm, victim->key);
+        map_block(map) {
+            if(lru_find(map, victim->key) == victim) map_remove(map, victim->key);
+        }
+
+        lru_unref(victim);
+    }
+}
+
+LruStats lru_stats(LruCache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    LruStats stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+    return stats;
+}
+
+LruCache mkLruCache(Alloc *alloc, usz budget, void (*freeEntry)(LruEntry *entry)) {
+    LruCache cache = {
+        .alloc = alloc,
+        .budget = budget,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .freeEntry = freeEntry,
+        .hm = mkHashmap(alloc),
+    };
+
+    hm_fix(&cache.hm);
+    return cache;
+}
+
+#endif // __LIB_LRU
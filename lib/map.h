@@ -70,6 +70,7 @@ void map_set(Map *map, Mem key, Mem val) {
     val = mem_clone(val, map->alloc);
     if(found) {
         key = dynar_index(MapEntry, &map->map, i).key;
+        FreeC(map->alloc, dynar_index(MapEntry, &map->map, i).val.s);
         dynar_set(MapEntry, &map->map, i, ((MapEntry){ .key = key, .val = val }));
     }
     else {
@@ -91,6 +92,8 @@ void map_remove(Map *map, Mem key) {
         MapEntry entry = dynar_index(MapEntry, &map->map, i);
         if(mem_eq(key, entry.key)) {
             dynar_remove(MapEntry, &map->map, i);
+            FreeC(map->alloc, entry.key.s);
+            FreeC(map->alloc, entry.val.s);
             return;
         }
     }
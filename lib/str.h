@@ -79,6 +79,31 @@ bool sb_appendMem(StringBuilder *sb, Mem m) {
 }
 #define sb_appendString(sb, m) sb_appendMem(sb, m)
 
+// NOTE: makes sure that n more bytes fit, so that they
+// can be written to sb->s directly
+bool sb_reserve(StringBuilder *sb, usz n) {
+    if(sb->s.s == null) {
+        if(sb->cap < n) sb->cap = n;
+        sb->s = AllocateBytesC(sb->alloc, sb->cap);
+        return !isNull(sb->s);
+    }
+
+    if(sb->len + n <= sb->cap) return true;
+    if(sb->dontExpand) return false;
+
+    usz newCap = sb->cap * 2;
+    if(newCap < sb->len + n) newCap = sb->len + n;
+
+    Mem newMem = AllocateBytesC(sb->alloc, newCap);
+    if(isNull(newMem)) return false;
+
+    mem_copy(newMem, mkMem(sb->s.s, sb->len));
+    FreeC(sb->alloc, sb->s.s);
+    sb->cap = newCap;
+    sb->s = newMem;
+    return true;
+}
+
 bool sb_appendByte(StringBuilder *sb, byte b) {
     Mem m = mkMem(&b, 1);
     return sb_appendMem(sb, m);
@@ -2,11 +2,15 @@
 #define __LIB_STREAM
 
 #include <unistd.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <errno.h>
 
 #include "str.h"
 #include "types.h"
 #include "runes.h"
 #include "macros.h"
+#include "uring.h"
 
 typedef u8 StreamType;
 #define STREAM_INVALID 0
@@ -15,6 +19,20 @@ typedef u8 StreamType;
 #define STREAM_FILE 3
 #define STREAM_SB 4
 #define STREAM_NULL 5
+#define STREAM_URING 6
+// NOTE: a write that couldn't go out right away, see stream_wqueueSend.
+// Either memory (fd == -1), which is stored right after this, or
+// a range of a file, whose fd is a dup() owned by the queue
+typedef struct StreamQueued StreamQueued;
+struct StreamQueued {
+    Mem mem;
+    int fd;
+    off_t offset;
+    usz left;
+
+    StreamQueued *next;
+};
+
 typedef struct Stream Stream;
 struct Stream {
     StreamType type;
@@ -52,6 +70,24 @@ struct Stream {
 
         struct {
             int fd;
+            // NOTE: if the fd is non-blocking, how many ms to poll() for it
+            // to become ready, before giving up (0 - don't wait at all).
+            // For STREAM_URING, how many ms a single read may take
+            int fdTimeout;
+
+            // NOTE: STREAM_FD only, for non-blocking fds whose owner waits for
+            // them to become writable. Writes never wait, whatever can't go out
+            // right away is queued, to be sent by stream_wqueueSend later
+            bool wqueueEnabled;
+            StreamQueued *wqueueHead;
+            StreamQueued *wqueueTail;
+
+            // NOTE: STREAM_URING only. A send is queued but not submitted
+            // until the next read, or until stream_writeSettle
+            Uring *ring;
+            Mem ringSend;
+            bool ringSendQueued;
+            bool ringSendFailed;
         };
 
         struct {
@@ -63,6 +99,9 @@ struct Stream {
 
 #define mkStreamStr(str) ((Stream){ .type = STREAM_STR, .s = (str), .i = 0 })
 #define mkStreamFd(_fd) ((Stream){ .type = STREAM_FD, .fd = (_fd) })
+#define mkStreamFdNonblocking(_fd, _timeout) ((Stream){ .type = STREAM_FD, .fd = (_fd), .fdTimeout = (_timeout) })
+#define mkStreamFdQueued(_fd) ((Stream){ .type = STREAM_FD, .fd = (_fd), .wqueueEnabled = true })
+#define mkStreamUring(_fd, _ring, _timeout) ((Stream){ .type = STREAM_URING, .fd = (_fd), .ring = (_ring), .fdTimeout = (_timeout) })
 #define mkStreamSb(_sb) ((Stream){ .type = STREAM_SB, .sb = (_sb) })
 #define mkStreamNull() ((Stream){ .type = STREAM_NULL })
 
@@ -140,14 +179,169 @@ void stream_wlimitDisable(Stream *s) {
     s->wlimit = 0;
 }
 
+bool stream_fdWait(Stream *s, short events) {
+    if(s->fdTimeout == 0) return false;
+    if(errno != EAGAIN && errno != EWOULDBLOCK) return false;
+
+    struct pollfd pfd = { .fd = s->fd, .events = events };
+    int result;
+    while((result = poll(&pfd, 1, s->fdTimeout)) < 0 && errno == EINTR) {}
+    return result > 0;
+}
+
+// NOTE: queued writes outlive whatever allocator the writer
+// is using (they're sent after the request is handled), so
+// they're allocated globally
+bool stream_wqueuePush(Stream *s, Mem mem, int fd, off_t offset, usz len) {
+    usz size = sizeof(StreamQueued) + (fd == -1 ? mem.len : 0);
+    StreamQueued *queued = (StreamQueued *)AllocateBytesC(ALLOC_GLOBAL, size).s;
+    if(queued == null) return false;
+
+    *queued = (StreamQueued){ .fd = -1 };
+    if(fd == -1) {
+        queued->mem = mkMem((byte *)(queued + 1), mem.len);
+        mem_copy(queued->mem, mem);
+        queued->left = mem.len;
+    }
+    else {
+        queued->fd = dup(fd);
+        queued->offset = offset;
+        queued->left = len;
+        if(queued->fd == -1) { FreeC(ALLOC_GLOBAL, queued); return false; }
+    }
+
+    if(s->wqueueTail) s->wqueueTail->next = queued;
+    else              s->wqueueHead = queued;
+    s->wqueueTail = queued;
+    return true;
+}
+
+void stream_wqueuePop(Stream *s) {
+    StreamQueued *queued = s->wqueueHead;
+    s->wqueueHead = queued->next;
+    if(s->wqueueHead == null) s->wqueueTail = null;
+
+    if(queued->fd != -1) close(queued->fd);
+    FreeC(ALLOC_GLOBAL, queued);
+}
+
+#define stream_wqueuePending(s) ((s)->type == STREAM_FD && (s)->wqueueHead != null)
+
+void stream_wqueueClear(Stream *s) {
+    while(stream_wqueuePending(s)) stream_wqueuePop(s);
+}
+
+// NOTE: sends as much of the queue as the fd takes without blocking.
+// Returns false if the fd failed, or a queued file got shorter
+bool stream_wqueueSend(Stream *s) {
+    while(stream_wqueuePending(s)) {
+        StreamQueued *queued = s->wqueueHead;
+
+        isz written;
+        if(queued->fd == -1) written = write(s->fd, queued->mem.s + queued->mem.len - queued->left, queued->left);
+        else                 written = sendfile(s->fd, queued->fd, &queued->offset, queued->left);
+
+        if(written < 0 && errno == EINTR) continue;
+        if(written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if(written <= 0) return false;
+
+        queued->left -= written;
+        if(queued->left == 0) stream_wqueuePop(s);
+    }
+
+    return true;
+}
+
+#define STREAM_URING_SEND 1
+#define STREAM_URING_RECV 2
+#define STREAM_URING_TIMEOUT 3
+
+void stream_uringQueueSend(Stream *s, Mem mem) {
+    struct io_uring_sqe *sqe;
+    while((sqe = uring_getSqe(s->ring)) == null) uring_submitAndWait(s->ring, 0);
+    uring_prepSend(sqe, s->fd, mem, STREAM_URING_SEND);
+    s->ringSend = mem;
+    s->ringSendQueued = true;
+}
+
+// NOTE: waits for the next completion on the stream's ring, submitting
+// whatever was queued. Partial sends are queued again right away
+bool stream_uringStep(Stream *s, struct io_uring_cqe *cqe) {
+    while(!uring_popCqe(s->ring, cqe)) {
+        if(!uring_submitAndWait(s->ring, 1)) return false;
+    }
+
+    if(cqe->user_data == STREAM_URING_SEND) {
+        if(cqe->res <= 0) {
+            s->ringSendQueued = false;
+            s->ringSendFailed = true;
+        }
+        else if((usz)cqe->res < s->ringSend.len) {
+            stream_uringQueueSend(s, memIndex(s->ringSend, (usz)cqe->res));
+        }
+        else {
+            s->ringSendQueued = false;
+        }
+    }
+
+    return true;
+}
+
+// NOTE: for streams that defer their writes (STREAM_URING), waits until
+// everything written so far has actually been sent. Until then, the
+// written memory must not be touched
+bool stream_writeSettle(Stream *s) {
+    if(!s) return false;
+    if(s->type != STREAM_URING) return true;
+
+    struct io_uring_cqe cqe;
+    while(s->ringSendQueued) {
+        if(!stream_uringStep(s, &cqe)) return false;
+    }
+
+    bool failed = s->ringSendFailed;
+    s->ringSendFailed = false;
+    return !failed;
+}
+
 ResultWrite stream_writeRaw(Stream *s, Mem mem) {
     if(!s) return none(ResultWrite);
 
     if(false) {}
+    else if(s->type == STREAM_FD && s->wqueueEnabled) {
+        // NOTE: once something is queued, everything after it has to be too
+        usz total = 0;
+        while(!stream_wqueuePending(s) && total < mem.len) {
+            isz written = write(s->fd, mem.s + total, mem.len - total);
+            if(written < 0 && errno == EINTR) continue;
+            if(written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if(written <= 0) return none(ResultWrite);
+            total += written;
+        }
+
+        if(total < mem.len && !stream_wqueuePush(s, memIndex(mem, total), -1, 0, 0)) return none(ResultWrite);
+        return mkResultWrite(mem.len, mem.len);
+    }
     else if(s->type == STREAM_FD) {
-        isz written = write(s->fd, mem.s, mem.len);
-        if(written < 0) return none(ResultWrite);
-        return mkResultWrite(mem.len, (usz)written);
+        usz total = 0;
+        do {
+            isz written = write(s->fd, mem.s + total, mem.len - total);
+            if(written < 0 && stream_fdWait(s, POLLOUT)) continue;
+            if(written < 0) return none(ResultWrite);
+            total += written;
+        } while(s->fdTimeout != 0 && total < mem.len);
+        return mkResultWrite(mem.len, total);
+    }
+    else if(s->type == STREAM_URING) {
+        if(!stream_writeSettle(s)) return none(ResultWrite);
+        if(mem.len == 0) return mkResultWrite(0, 0);
+        stream_uringQueueSend(s, mem);
+
+        // NOTE: the write buffer is settled before it's written into again,
+        // so only the rest have to be sent before returning
+        bool fromBuffer = s->wbufferEnabled && mem.s >= s->wbuffer.s && mem.s < s->wbuffer.s + s->wbuffer.len;
+        if(!fromBuffer && !stream_writeSettle(s)) return none(ResultWrite);
+        return mkResultWrite(mem.len, mem.len);
     }
     else if(s->type == STREAM_SB) {
         bool result = sb_appendMem(s->sb, mem);
@@ -180,6 +374,8 @@ ResultWrite stream_write(Stream *s, Mem mem) {
     if(!s) return none(ResultWrite);
 
     if(s->wbufferEnabled) {
+        if(s->type == STREAM_URING && s->ringSendQueued && !stream_writeSettle(s)) return none(ResultWrite);
+
         if(s->wbufferTaken + mem.len < s->wbuffer.len) {
             mem_copy(memIndex(s->wbuffer, s->wbufferTaken), mem);
             s->wbufferTaken += mem.len;
@@ -197,15 +393,83 @@ ResultWrite stream_write(Stream *s, Mem mem) {
     }
 }
 
+// NOTE: writes len bytes of the file fd starting at offset. For sockets,
+// they go straight from the page cache via sendfile(), without being
+// copied through the write buffer (which is flushed beforehand)
+ResultWrite stream_sendfile(Stream *s, int fd, off_t offset, usz len) {
+    if(!s) return none(ResultWrite);
+
+    if(s->type == STREAM_FD || s->type == STREAM_URING) {
+        while(s->wbufferEnabled && s->wbufferTaken != 0) {
+            ResultWrite result = stream_writeFlush(s);
+            if(result.error) return result;
+        }
+        if(!stream_writeSettle(s)) return none(ResultWrite);
+
+        usz total = 0;
+        while(total < len && !stream_wqueuePending(s)) {
+            isz written = sendfile(s->fd, fd, &offset, len - total);
+            if(written < 0 && errno == EINTR) continue;
+            if(written < 0 && s->wqueueEnabled && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if(written < 0 && stream_fdWait(s, POLLOUT)) continue;
+            if(written < 0) return none(ResultWrite);
+            if(written == 0) return mkResultWrite(len, total);
+            total += written;
+        }
+
+        if(total < len && s->wqueueEnabled) {
+            if(!stream_wqueuePush(s, memnull, fd, offset, len - total)) return none(ResultWrite);
+            total = len;
+        }
+        return mkResultWrite(len, total);
+    }
+
+    byte buffer[4096];
+    usz total = 0;
+    while(total < len) {
+        usz chunk = len - total < 4096 ? len - total : 4096;
+        isz bytesRead = pread(fd, buffer, chunk, offset + total);
+        if(bytesRead < 0 && errno == EINTR) continue;
+        if(bytesRead < 0) return none(ResultWrite);
+        if(bytesRead == 0) break;
+
+        ResultWrite result = stream_write(s, mkMem(buffer, bytesRead));
+        if(result.error) return result;
+        total += result.written;
+        if(result.partial) break;
+    }
+    return mkResultWrite(len, total);
+}
+
 ResultRead stream_readRaw(Stream *s, Mem mem) {
     if(!s) return none(ResultRead);
 
     if(false) {}
     else if(s->type == STREAM_FD) {
-        isz bytesRead = read(s->fd, mem.s, mem.len);
+        isz bytesRead;
+        while((bytesRead = read(s->fd, mem.s, mem.len)) < 0 && stream_fdWait(s, POLLIN)) {}
         if(bytesRead < 0) return none(ResultRead);
         return mkResultRead(mem.len, (usz)bytesRead);
     }
+    else if(s->type == STREAM_URING) {
+        // NOTE: a deferred send goes out in the same submission as this recv
+        // NOTE: the recv and its timeout have to be submitted together
+        while(uring_sqSpace(s->ring) < 2) uring_submitAndWait(s->ring, 0);
+
+        struct io_uring_sqe *recv = uring_getSqe(s->ring);
+        uring_prepRecv(recv, s->fd, mem, STREAM_URING_RECV);
+        if(s->fdTimeout != 0) {
+            uring_prepLinkTimeout(s->ring, recv, uring_getSqe(s->ring), s->fdTimeout, STREAM_URING_TIMEOUT);
+        }
+
+        struct io_uring_cqe cqe;
+        do {
+            if(!stream_uringStep(s, &cqe)) return none(ResultRead);
+        } while(cqe.user_data != STREAM_URING_RECV);
+
+        if(cqe.res < 0) return none(ResultRead);
+        return mkResultRead(mem.len, (usz)cqe.res);
+    }
     else if(s->type == STREAM_SB) {
         Mem src = memIndex(memLimit(s->sb->s, s->sb->len), s->sbi);
         src = memLimit(src, mem.len);
@@ -224,6 +488,31 @@ ResultRead stream_readRaw(Stream *s, Mem mem) {
     }
 }
 
+// NOTE: meant for non-blocking fds - reads whatever is immediately
+// available into the free part of the read buffer, without waiting.
+// Fails if the other side has closed the connection
+ResultRead stream_rbufferFill(Stream *s) {
+    if(!s) return none(ResultRead);
+    if(!s->rbufferEnabled || s->type != STREAM_FD) return none(ResultRead);
+
+    if(s->rbufferConsumed != 0) {
+        Mem unconsumed = memIndex(memLimit(s->rbuffer, s->rbufferSize), s->rbufferConsumed);
+        mem_move(s->rbuffer, unconsumed);
+        s->rbufferSize = unconsumed.len;
+        s->rbufferConsumed = 0;
+    }
+
+    Mem free = memIndex(s->rbuffer, s->rbufferSize);
+    if(free.len == 0) return mkResultRead(0, 0);
+
+    isz bytesRead = read(s->fd, free.s, free.len);
+    if(bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return mkResultRead(free.len, 0);
+    if(bytesRead <= 0) return none(ResultRead);
+
+    s->rbufferSize += bytesRead;
+    return mkResultRead(free.len, (usz)bytesRead);
+}
+
 ResultRead stream_read(Stream *s, Mem mem) {
     if(!s) return none(ResultRead);
 
@@ -358,6 +647,21 @@ MaybeRune stream_peekRune(Stream *s) {
     return r;
 }
 
+// NOTE: puts a peeked char back into the read buffer, so that it's
+// there to be seen again. Only works if it came from the buffer
+bool stream_rbufferUnpeek(Stream *s) {
+    if(!s->hasPeek || !s->rbufferEnabled || s->rbufferConsumed == 0) return false;
+
+    s->rbufferConsumed -= 1;
+    s->rbuffer.s[s->rbufferConsumed] = s->peekChar;
+    s->hasPeek = false;
+    if(!s->preservePos) {
+        s->pos -= 1;
+        stream_goBackOnePos(s);
+    }
+    return true;
+}
+
 MaybeChar stream_routeUntil(Stream *s, Stream *out, byte target, bool includeInResult, bool consumeLast) {
     MaybeChar c;
     while(isJust(c = stream_peekChar(s)) && c.value != target) {
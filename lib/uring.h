@@ -0,0 +1,181 @@
+#ifndef __LIB_URING
+#define __LIB_URING
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "types.h"
+
+// NOTE: a minimal io_uring wrapper over the raw syscalls, so we don't
+// depend on liburing. Submissions are only prepared by uring_getSqe, and
+// are handed to the kernel all at once by the next uring_submitAndWait
+
+typedef struct {
+    int fd;
+
+    Mem sqRing;
+    u32 *sqHead;
+    u32 *sqTail;
+    u32 *sqArray;
+    u32 sqMask;
+    u32 sqEntries;
+    u32 sqLocalTail;
+    struct io_uring_sqe *sqes;
+    Mem sqesMem;
+
+    Mem cqRing;
+    u32 *cqHead;
+    u32 *cqTail;
+    u32 cqMask;
+    struct io_uring_cqe *cqes;
+
+    // NOTE: prepared, but not yet seen by the kernel
+    u32 queued;
+
+    // NOTE: link timeouts are read by the kernel only on submission,
+    // so this has to stay alive until then
+    struct __kernel_timespec timeout;
+} Uring;
+
+void uring_deinit(Uring *ring) {
+    if(ring->sqesMem.s) munmap(ring->sqesMem.s, ring->sqesMem.len);
+    if(ring->cqRing.s) munmap(ring->cqRing.s, ring->cqRing.len);
+    if(ring->sqRing.s) munmap(ring->sqRing.s, ring->sqRing.len);
+    if(ring->fd >= 0) close(ring->fd);
+    *ring = (Uring){ .fd = -1 };
+}
+
+bool uring_init(Uring *ring, u32 entries) {
+    *ring = (Uring){ .fd = -1 };
+
+    struct io_uring_params params = {0};
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(fd < 0) return false;
+    ring->fd = fd;
+
+    usz sqSize = params.sq_off.array + params.sq_entries * sizeof(u32);
+    usz cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    usz sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    void *sq = mmap(null, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED) { uring_deinit(ring); return false; }
+    ring->sqRing = mkMem(sq, sqSize);
+
+    void *cq = mmap(null, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if(cq == MAP_FAILED) { uring_deinit(ring); return false; }
+    ring->cqRing = mkMem(cq, cqSize);
+
+    void *sqes = mmap(null, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) { uring_deinit(ring); return false; }
+    ring->sqesMem = mkMem(sqes, sqesSize);
+
+    byte *sqBase = sq;
+    ring->sqHead = (u32 *)(sqBase + params.sq_off.head);
+    ring->sqTail = (u32 *)(sqBase + params.sq_off.tail);
+    ring->sqArray = (u32 *)(sqBase + params.sq_off.array);
+    ring->sqMask = *(u32 *)(sqBase + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+    ring->sqes = sqes;
+
+    byte *cqBase = cq;
+    ring->cqHead = (u32 *)(cqBase + params.cq_off.head);
+    ring->cqTail = (u32 *)(cqBase + params.cq_off.tail);
+    ring->cqMask = *(u32 *)(cqBase + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cqBase + params.cq_off.cqes);
+
+    return true;
+}
+
+u32 uring_sqSpace(Uring *ring) {
+    u32 head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    return ring->sqEntries - (ring->sqLocalTail - head);
+}
+
+// NOTE: returns null if the submission queue is full
+struct io_uring_sqe *uring_getSqe(Uring *ring) {
+    if(uring_sqSpace(ring) == 0) return null;
+
+    u32 index = ring->sqLocalTail & ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqArray[index] = index;
+
+    ring->sqLocalTail += 1;
+    ring->queued += 1;
+    return sqe;
+}
+
+// NOTE: submits everything that was queued, and waits until at
+// least waitCount completions are available
+bool uring_submitAndWait(Uring *ring, u32 waitCount) {
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+    while(true) {
+        u32 flags = waitCount > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int result = syscall(__NR_io_uring_enter, ring->fd, ring->queued, waitCount, flags, null, 0);
+        if(result < 0 && errno == EINTR) continue;
+        if(result < 0) return false;
+
+        ring->queued -= (u32)result < ring->queued ? (u32)result : ring->queued;
+        return true;
+    }
+}
+
+bool uring_popCqe(Uring *ring, struct io_uring_cqe *cqe) {
+    u32 head = *ring->cqHead;
+    u32 tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    if(head == tail) return false;
+
+    *cqe = ring->cqes[head & ring->cqMask];
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void uring_prepRecv(struct io_uring_sqe *sqe, int fd, Mem mem, u64 userData) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (u64)mem.s;
+    sqe->len = mem.len;
+    sqe->user_data = userData;
+}
+
+void uring_prepSend(struct io_uring_sqe *sqe, int fd, Mem mem, u64 userData) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (u64)mem.s;
+    sqe->len = mem.len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = userData;
+}
+
+void uring_prepAccept(struct io_uring_sqe *sqe, int fd, struct sockaddr *addr, socklen_t *addrLen, u64 userData) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->addr = (u64)addr;
+    sqe->addr2 = (u64)addrLen;
+    sqe->user_data = userData;
+}
+
+// NOTE: cancels the previously prepared submission, if it doesn't complete
+// within timeoutMs. That submission has to be prepared right before this
+void uring_prepLinkTimeout(Uring *ring, struct io_uring_sqe *previous, struct io_uring_sqe *sqe, int timeoutMs, u64 userData) {
+    ring->timeout = (struct __kernel_timespec){
+        .tv_sec = timeoutMs / 1000,
+        .tv_nsec = (timeoutMs % 1000) * 1000000ll,
+    };
+
+    previous->flags |= IOSQE_IO_LINK;
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (u64)&ring->timeout;
+    sqe->len = 1;
+    sqe->user_data = userData;
+}
+
+#endif // __LIB_URING